@@ -7,7 +7,294 @@
 
 #include "quant_est.h"
 
+/* Values from Perl lists are converted in chunks of this many
+ * and handed to qesk_update_many */
+#define QE_XS_CHUNK 256
+
+/* Queries need an up to date finished summary */
+#define QE_XS_FINISH(self)                                              \
+  STMT_START {                                                          \
+    if (qesk_finish(self))                                              \
+      croak("Out of memory finishing the quantile summary");            \
+  } STMT_END
+
+/* Feeds n packed doubles or floats from buf to the sketch. Suitably
+ * aligned doubles are passed through without copying, anything else is
+ * converted in chunks. Returns non-zero on OOM. */
+static int
+qe_xs_add_packed(sketch_t *self, const char *buf, size_t n, int is_float)
+{
+  double chunk[QE_XS_CHUNK];
+  size_t i, nchunk;
+
+  if (!is_float && (PTR2UV(buf) % sizeof(double)) == 0)
+    return qesk_update_many(self, (const double *)buf, n);
+
+  while (n > 0) {
+    nchunk = n < QE_XS_CHUNK ? n : QE_XS_CHUNK;
+    if (is_float) {
+      float f;
+      for (i = 0; i < nchunk; ++i) {
+        memcpy(&f, buf + i * sizeof(float), sizeof(float));
+        chunk[i] = (double)f;
+      }
+      buf += nchunk * sizeof(float);
+    }
+    else {
+      memcpy(chunk, buf, nchunk * sizeof(double));
+      buf += nchunk * sizeof(double);
+    }
+    if (qesk_update_many(self, chunk, nchunk))
+      return 1;
+    n -= nchunk;
+  }
+
+  return 0;
+}
+
 MODULE = Math::QuantileEstimate    PACKAGE = Math::QuantileEstimate
 
 REQUIRE: 2.2201
 
+PROTOTYPES: DISABLE
+
+sketch_t *
+_new(CLASS, engine, epsilon, n)
+    char *CLASS
+    const char *engine
+    double epsilon
+    NV n
+  CODE:
+    RETVAL = qesk_new(engine, epsilon, n > 0 ? (qe_count_t)n : 0);
+    if (RETVAL == NULL)
+      croak("Could not create quantile estimator for engine=%s, epsilon=%" NVgf " and n=%" NVgf
+            " (unknown engine, or n isn't larger than e/epsilon)", engine, (NV)epsilon, n);
+  OUTPUT: RETVAL
+
+const char *
+cpu_variant(...)
+  CODE:
+    PERL_UNUSED_VAR(items);
+    RETVAL = gkstr_cpu_variant();
+  OUTPUT: RETVAL
+
+sketch_t *
+from_bytes(CLASS, bytes)
+    char *CLASS
+    SV *bytes
+  PREINIT:
+    STRLEN len;
+    const char *str;
+  CODE:
+    str = SvPVbyte(bytes, len);
+    RETVAL = qesk_deserialize((const unsigned char *)str, len);
+    if (RETVAL == NULL)
+      croak("Invalid serialized quantile estimator (or out of memory)");
+  OUTPUT: RETVAL
+
+SV *
+to_bytes(self)
+    sketch_t *self
+  PREINIT:
+    size_t size, len;
+  CODE:
+    size = qesk_serialized_size(self);
+    RETVAL = newSV(size);
+    len = qesk_serialize(self, (unsigned char *)SvPVX(RETVAL), size);
+    /* size is an upper bound, so nothing written (or more) is a bug that
+     * would otherwise only show up in from_bytes */
+    if (len == 0 || len > size) {
+      SvREFCNT_dec(RETVAL);
+      croak("Could not serialize the quantile estimator (%lu bytes of at most %lu)",
+            (unsigned long)len, (unsigned long)size);
+    }
+    SvPOK_on(RETVAL);
+    SvCUR_set(RETVAL, len);
+    *SvEND(RETVAL) = '\0';
+  OUTPUT: RETVAL
+
+void
+STORABLE_thaw(obj, cloning, serialized)
+    SV *obj
+    SV *cloning
+    SV *serialized
+  PREINIT:
+    STRLEN len;
+    const char *str;
+    sketch_t *s;
+  CODE:
+    PERL_UNUSED_VAR(cloning);
+    /* Storable hands us a blessed reference to an empty scalar: make it
+     * look like what the O_OBJECT typemap creates */
+    if (!sv_isobject(obj))
+      croak("STORABLE_thaw needs an object");
+    str = SvPVbyte(serialized, len);
+    s = qesk_deserialize((const unsigned char *)str, len);
+    if (s == NULL)
+      croak("Invalid serialized quantile estimator (or out of memory)");
+    sv_setiv(SvRV(obj), PTR2IV(s));
+
+void
+DESTROY(self)
+    sketch_t *self
+  CODE:
+    qesk_free(self);
+
+void
+add(self, ...)
+    sketch_t *self
+  PREINIT:
+    double buf[QE_XS_CHUNK];
+    I32 i;
+    size_t nbuf = 0;
+  CODE:
+    for (i = 1; i < items; ++i) {
+      buf[nbuf++] = (double)SvNV(ST(i));
+      if (nbuf == QE_XS_CHUNK || i == items-1) {
+        if (qesk_update_many(self, buf, nbuf))
+          croak("Out of memory adding values to the quantile summary");
+        nbuf = 0;
+      }
+    }
+
+void
+add_packed(self, packed)
+    sketch_t *self
+    SV *packed
+  ALIAS:
+    add_packed_float = 1
+  PREINIT:
+    STRLEN len;
+    const char *str;
+    const size_t elem_size = ix == 0 ? sizeof(double) : sizeof(float);
+  CODE:
+    /* Allow passing a reference, eg. from PDL's get_dataref */
+    if (SvROK(packed) && SvTYPE(SvRV(packed)) < SVt_PVAV)
+      packed = SvRV(packed);
+    /* The string buffer goes to the C code as is if it can: no copies,
+     * so this works for mmap()ed scalars of any size */
+    str = SvPVbyte(packed, len);
+    if (len % elem_size != 0)
+      croak("Length of packed data (%lu) is not a multiple of the size of a %s (%lu)",
+            (unsigned long)len, ix == 0 ? "double" : "float", (unsigned long)elem_size);
+    if (qe_xs_add_packed(self, str, len / elem_size, ix == 1))
+      croak("Out of memory adding values to the quantile summary");
+
+void
+start_background(self)
+    sketch_t *self
+  PREINIT:
+    stream_t *stream;
+  CODE:
+    stream = qesk_stream(self);
+    if (stream == NULL)
+      croak("start_background needs the 'gk' engine, this estimator uses '%s'", qesk_engine(self));
+    if (gkstr_start_background(stream))
+      croak("Could not start background compaction thread");
+
+NV
+count(self)
+    sketch_t *self
+  CODE:
+    RETVAL = (NV)qesk_count(self);
+  OUTPUT: RETVAL
+
+NV
+error_bound(self)
+    sketch_t *self
+  CODE:
+    RETVAL = qesk_error_bound(self);
+  OUTPUT: RETVAL
+
+void
+merge(self, other)
+    sketch_t *self
+    sketch_t *other
+  CODE:
+    if (self == other)
+      croak("Can't merge a quantile estimator into itself");
+    if (strcmp(qesk_engine(self), qesk_engine(other)) != 0)
+      croak("Can't merge quantile estimators of different engines ('%s' and '%s')",
+            qesk_engine(self), qesk_engine(other));
+    if (qesk_merge(self, other))
+      croak("Out of memory merging quantile estimators");
+
+void
+merge_many(self, others, nthreads = 1)
+    sketch_t *self
+    AV *others
+    int nthreads
+  PREINIT:
+    sketch_t **sketches;
+    SSize_t i, n;
+  CODE:
+    n = av_len(others) + 1;
+    Newx(sketches, n + 1, sketch_t *);
+    SAVEFREEPV(sketches);
+    sketches[0] = self;
+    for (i = 0; i < n; ++i) {
+      SV **svp = av_fetch(others, i, 0);
+      if (svp == NULL || !sv_isobject(*svp) || !sv_derived_from(*svp, "Math::QuantileEstimate"))
+        croak("merge_many needs an array of Math::QuantileEstimate objects");
+      sketches[i+1] = INT2PTR(sketch_t *, SvIV(SvRV(*svp)));
+    }
+    if (qesk_merge_many(sketches, (size_t)n + 1, nthreads))
+      croak("Out of memory merging quantile estimators, an estimator appears twice, or their engines differ");
+
+NV
+quantile(self, q)
+    sketch_t *self
+    double q
+  CODE:
+    QE_XS_FINISH(self);
+    RETVAL = qesk_query(self, q);
+  OUTPUT: RETVAL
+
+void
+quantiles(self, ...)
+    sketch_t *self
+  ALIAS:
+    cdf = 1
+  PREINIT:
+    double *in;
+    double *out;
+    I32 i;
+    const size_t n = items - 1;
+  PPCODE:
+    QE_XS_FINISH(self);
+    Newx(in, 2*n + 1, double);
+    SAVEFREEPV(in);
+    out = in + n;
+    for (i = 0; i < (I32)n; ++i)
+      in[i] = (double)SvNV(ST(i+1));
+    if (ix == 0)
+      qesk_query_many(self, in, out, n);
+    else
+      qesk_cdf_many(self, in, out, n);
+    EXTEND(SP, (IV)n);
+    for (i = 0; i < (I32)n; ++i)
+      mPUSHn(out[i]);
+
+NV
+rank(self, x)
+    sketch_t *self
+    double x
+  CODE:
+    QE_XS_FINISH(self);
+    RETVAL = qesk_rank(self, x);
+  OUTPUT: RETVAL
+
+const char *
+engine(self)
+    sketch_t *self
+  CODE:
+    RETVAL = qesk_engine(self);
+  OUTPUT: RETVAL
+
+NV
+memory_usage(self)
+    sketch_t *self
+  CODE:
+    RETVAL = (NV)qesk_memory_usage(self);
+  OUTPUT: RETVAL
+
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include <qe_sort.h>
+
+#include "mytap.h"
+
+static int
+is_sorted(double *vals, size_t n)
+{
+  size_t i;
+  for (i = 1; i < n; ++i) {
+    if (vals[i-1] > vals[i])
+      return 0;
+  }
+  return 1;
+}
+
+static void
+test_sort(size_t n, double scale)
+{
+  double *vals = malloc(n * sizeof(double));
+  uint64_t *scratch = malloc(2 * n * sizeof(uint64_t));
+  double sum_before = 0., sum_after = 0.;
+  char msg[128];
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    vals[i] = scale * ((double)rand() / RAND_MAX - 0.5);
+    sum_before += vals[i];
+  }
+  qe_sort_doubles(vals, n, scratch);
+  for (i = 0; i < n; ++i)
+    sum_after += vals[i];
+
+  sprintf(msg, "%lu values (scale %g) are sorted", (unsigned long)n, scale);
+  ok_m(is_sorted(vals, n), msg);
+  sprintf(msg, "%lu values (scale %g) are all still there", (unsigned long)n, scale);
+  is_double_m(1e-6 * scale, sum_after, sum_before, msg);
+
+  free(vals);
+  free(scratch);
+}
+
+/* Sorted input is left alone without ever touching the scratch space */
+static void
+test_sorted_input()
+{
+  const size_t n = 1000;
+  double *vals = malloc(n * sizeof(double));
+  uint64_t *scratch = malloc(2 * n * sizeof(uint64_t));
+  size_t i;
+  int untouched = 1;
+
+  for (i = 0; i < n; ++i)
+    vals[i] = (double)(i / 3) - 100.;
+  for (i = 0; i < 2 * n; ++i)
+    scratch[i] = 0xa5a5a5a5a5a5a5a5ULL;
+  qe_sort_doubles(vals, n, scratch);
+  ok_m(is_sorted(vals, n), "sorted input is still sorted");
+  for (i = 0; i < 2 * n; ++i)
+    untouched &= scratch[i] == 0xa5a5a5a5a5a5a5a5ULL;
+  ok_m(untouched, "sorted input isn't sorted again");
+
+  /* Out of order at the very end: still needs the full sort */
+  vals[n-1] = -1000.;
+  qe_sort_doubles(vals, n, scratch);
+  ok_m(is_sorted(vals, n), "sorted but for the last value");
+  ok_m(vals[0] == -1000., "the last value moves to the front");
+
+  free(vals);
+  free(scratch);
+}
+
+static void
+test_special_values()
+{
+  double vals[] = {3., -0., 1e300, -INFINITY, 0., -1e-300, INFINITY, -2.5, 5e-324, -3.};
+  const size_t n = sizeof(vals)/sizeof(vals[0]);
+  double big[200];
+  uint64_t scratch[400];
+  size_t i;
+
+  qe_sort_doubles(vals, n, scratch);
+  ok_m(is_sorted(vals, n), "special values are sorted (insertion sort)");
+
+  /* Same through the radix sort path */
+  for (i = 0; i < 200; ++i)
+    big[i] = vals[(i * 7) % n] * (double)(1 + i % 3);
+  qe_sort_doubles(big, 200, scratch);
+  ok_m(is_sorted(big, 200), "special values are sorted (radix sort)");
+  ok_m(big[0] == -INFINITY && big[199] == INFINITY, "infinities end up at the ends");
+}
+
+/* NaNs go to the end (or with the sign bit set, to the start) on both
+ * paths, and leave the other values sorted */
+static void
+test_nan()
+{
+  double big[200];
+  uint64_t scratch[400];
+  size_t n, i;
+
+  for (n = 10; n <= 200; n += 190) {
+    char msg[128];
+    for (i = 0; i < n; ++i)
+      big[i] = (double)((i * 7919) % n);
+    big[3] = NAN;
+    big[n/2] = -NAN;
+    qe_sort_doubles(big, n, scratch);
+    sprintf(msg, "NaNs end up at the ends of %lu values", (unsigned long)n);
+    ok_m(isnan(big[0]) && signbit(big[0]) && isnan(big[n-1]) && !signbit(big[n-1]), msg);
+    ok_m(is_sorted(big + 1, n - 2), "and the values in between are sorted");
+  }
+}
+
+int
+main ()
+{
+  srand(7);
+  test_special_values();
+  test_nan();
+  test_sort(0, 1.);
+  test_sort(1, 1.);
+  test_sort(10, 1.);
+  test_sort(64, 1e3);
+  test_sort(65, 1e3);
+  test_sort(1000, 1.);
+  test_sort(100000, 1e9);
+  test_sorted_input();
+  done_testing();
+  return 0;
+}
+
@@ -27,13 +27,600 @@ test_basics()
   gkstream_finish(s);
   t = gkstream_query(s, 2);
   ok_m(t > 0 && t < 4, "gkstream_query returns something in the right _order_of_magnitude_");
+  gkstr_free(s);
 }
 
+/* A permutation of 1..n, so the exact q-quantile of it is q*n */
+static int *
+make_permutation(int n)
+{
+  int *perm;
+  int i;
+
+  perm = malloc(n * sizeof(int));
+  for (i = 0; i < n; ++i)
+    perm[i] = i+1;
+  srand(42);
+  for (i = n-1; i > 0; --i) {
+    const int j = rand() % (i+1);
+    const int tmp = perm[i];
+    perm[i] = perm[j];
+    perm[j] = tmp;
+  }
+
+  return perm;
+}
+
+static void
+check_accuracy(stream_t *s, double epsilon, int n)
+{
+  double q;
+  double maxerr = 0.;
+  char msg[128];
+
+  is_double_m(1e-9, gkstream_query(s, 0.), 1., "query(0) is the minimum");
+  is_double_m(1e-9, gkstream_query(s, 1.), n, "query(1) is the maximum");
+  for (q = 0.; q <= 1.; q += 0.01) {
+    const double err = fabs(gkstream_query(s, q) - q*n) / n;
+    if (err > maxerr)
+      maxerr = err;
+  }
+  sprintf(msg, "max. rank error %g within 2*epsilon=%g (n=%i)", maxerr, 2*epsilon, n);
+  ok_m(maxerr <= 2*epsilon, msg);
+}
+
+static void
+test_accuracy(double epsilon, int n)
+{
+  stream_t *s;
+  int *perm = make_permutation(n);
+  int i;
+
+  s = gkstr_new(epsilon, n);
+  for (i = 0; i < n; ++i)
+    gkstr_update(s, perm[i]);
+  gkstream_finish(s);
+  check_accuracy(s, epsilon, n);
+
+  gkstr_free(s);
+  free(perm);
+}
+
+/* Same with a stream that doesn't know n, fed one by one and in bulk */
+static void
+test_unbounded(double epsilon, int n)
+{
+  stream_t *s;
+  int *perm = make_permutation(n);
+  double *vals;
+  int i;
+
+  s = gkstr_new_unbounded(epsilon);
+  ok_m(s != NULL, "gkstr_new_unbounded didn't (obviously) fail");
+  for (i = 0; i < n; ++i)
+    gkstr_update(s, perm[i]);
+  gkstream_finish(s);
+  check_accuracy(s, epsilon, n);
+  gkstr_free(s);
+
+  vals = malloc(n * sizeof(double));
+  for (i = 0; i < n; ++i)
+    vals[i] = perm[i];
+  s = gkstr_new_unbounded(epsilon);
+  gkstr_update_many(s, vals, n / 3);
+  gkstr_update_many(s, vals + n / 3, n - n / 3);
+  gkstream_finish(s);
+  check_accuracy(s, epsilon, n);
+  gkstr_free(s);
+
+  free(vals);
+  free(perm);
+}
+
+/* After the stream has grown all the levels it'll need, updates must
+ * not hit the allocator any more, compaction cascades included */
+static void
+test_steady_state_allocs()
+{
+  stream_t *s;
+  int i;
+  unsigned long nallocs;
+
+  /* block size is log(0.1*1000)/0.1 = 46 */
+  s = gkstr_new(0.1, 1000);
+  /* 2^10 blocks grow the levels up to 11, and the next 2^10-1 blocks
+   * will cascade through them without adding another */
+  for (i = 0; i < 1024 * 46; ++i)
+    gkstr_update(s, (double)(i % 1013));
+
+#if DEBUG
+  nallocs = gkstr_debug_nalloc_calls();
+  for (i = 0; i < 1023 * 46; ++i)
+    gkstr_update(s, (double)(i % 997));
+  is_int_m(0, (int)(gkstr_debug_nalloc_calls() - nallocs),
+           "no allocations in steady-state updates");
+#else
+  UNUSED(nallocs);
+  note("skipping allocation count check: not a debug build");
+#endif
+
+  gkstr_free(s);
+}
+
+/* Batches of odd sizes must end up with the very same summary
+ * as feeding the values one by one */
+static void
+test_update_many()
+{
+  stream_t *s1, *s2;
+  double *vals;
+  const int n = 50000;
+  int i, same = 1;
+  size_t done, chunk;
+  double q;
+
+  vals = malloc(n * sizeof(double));
+  for (i = 0; i < n; ++i)
+    vals[i] = (double)((i * 7919) % n);
+
+  s1 = gkstr_new(0.01, n);
+  s2 = gkstr_new(0.01, n);
+  for (i = 0; i < n; ++i)
+    gkstr_update(s1, vals[i]);
+  for (done = 0, chunk = 1; done < (size_t)n; done += chunk, chunk = chunk * 3 + 1) {
+    if (done + chunk > (size_t)n)
+      chunk = n - done;
+    ok_m(!gkstr_update_many(s2, vals + done, chunk), "gkstr_update_many didn't (obviously) fail");
+  }
+
+  gkstream_finish(s1);
+  gkstream_finish(s2);
+  for (q = 0.; q <= 1.; q += 0.01)
+    same = same && gkstream_query(s1, q) == gkstream_query(s2, q);
+  ok_m(same, "gkstr_update_many gives the same results as gkstr_update");
+
+  gkstr_free(s1);
+  gkstr_free(s2);
+  free(vals);
+}
+
+/* Finishing a stream must not stop it from taking more updates, and
+ * finishing it over and over (with the incremental re-merging of the
+ * levels) must end up with the same summary as finishing it once */
+static void
+test_finish_incremental()
+{
+  stream_t *s1, *s2;
+  const int n = 100000;
+  int *perm = make_permutation(n);
+  int i, same = 1;
+  double q;
+
+  s1 = gkstr_new(0.01, n);
+  s2 = gkstr_new(0.01, n);
+  ok_m(gkstream_query(s2, 0.5) != gkstream_query(s2, 0.5), "query before finish is NaN");
+  ok_m(!gkstream_finish(s2), "finishing an empty stream didn't (obviously) fail");
+  ok_m(gkstream_query(s2, 0.5) != gkstream_query(s2, 0.5), "query without data is NaN");
+
+  for (i = 0; i < n; ++i) {
+    gkstr_update(s1, perm[i]);
+    gkstr_update(s2, perm[i]);
+    if (i % 777 == 0) {
+      gkstream_finish(s2);
+      same = same && gkstream_query(s2, 1.) <= n;
+    }
+    if (i == n/2) {
+      gkstream_finish(s1);
+      same = same && fabs(gkstream_query(s1, 0.5) - n/2) < 0.04 * n;
+    }
+  }
+  ok_m(same, "queries between updates are sane");
+
+  gkstream_finish(s1);
+  gkstream_finish(s2);
+  for (q = 0.; q <= 1.; q += 0.01)
+    same = same && gkstream_query(s1, q) == gkstream_query(s2, q);
+  ok_m(same, "finishing many times gives the same results as finishing once");
+  check_accuracy(s2, 0.01, n);
+
+  gkstr_free(s1);
+  gkstr_free(s2);
+  free(perm);
+}
+
+/* Until the first block is packed, queries are exact, and finishing
+ * doesn't build a summary */
+static void
+test_exact_small()
+{
+  stream_t *s = gkstr_new(0.001, 1000000);
+  const int n = 2000; /* block size is log(1000)*1000 = 6907 */
+  int *perm = make_permutation(n);
+  double qs[4] = {0.9, 0.1, 0.5, 1.}, out[4], cdf;
+  unsigned long nallocs;
+  double mid = 0.;
+  int i, exact = 1;
+
+  for (i = 0; i < 50; ++i)
+    gkstr_update(s, perm[i]);
+#if DEBUG
+  nallocs = gkstr_debug_nalloc_calls();
+  gkstream_finish(s);
+  is_int_m(0, (int)(gkstr_debug_nalloc_calls() - nallocs),
+           "finishing a small stream doesn't allocate");
+#else
+  UNUSED(nallocs);
+  gkstream_finish(s);
+#endif
+
+  for (; i < n; ++i) {
+    gkstr_update(s, perm[i]);
+    if (i == n/2) {
+      gkstream_finish(s);
+      mid = gkstream_query(s, 0.5);
+    }
+  }
+  ok_m(!gkstream_is_current(s), "not current after more updates");
+  ok_m(gkstream_query(s, 0.5) == mid, "queries see the last finish");
+
+  gkstream_finish(s);
+  for (i = 1; i <= n; ++i) {
+    const double q = (double)i / n;
+    const double r = floor(q * n);
+    exact = exact && gkstream_query(s, q) == (r < 1. ? 1. : r);
+    exact = exact && gkstream_rank(s, (double)i) == (double)i;
+  }
+  ok_m(exact, "quantiles and ranks are exact");
+  gkstream_query_many(s, qs, out, 4);
+  ok_m(out[0] == 0.9*n && out[1] == 0.1*n && out[2] == 0.5*n && out[3] == n,
+       "gkstream_query_many is exact");
+  gkstream_cdf_many(s, qs, &cdf, 1);
+  is_double_m(1e-12, 0., cdf, "cdf below the minimum");
+
+  /* past the block size, it's the summary from then on */
+  for (i = 0; i < 10 * n; ++i)
+    gkstr_update(s, n + 1 + i);
+  ok_m(gkstream_query(s, 0.5) != gkstream_query(s, 0.5), "no stale answers once level 0 is packed");
+  gkstream_finish(s);
+  ok_m(fabs(gkstream_query(s, 0.5) - 5.5*n) <= 0.001 * 11*n + 1, "summary after the exact phase");
+
+  gkstr_free(s);
+  free(perm);
+}
+
+static void
+test_query_many()
+{
+  stream_t *s;
+  const int n = 100000;
+  int *perm = make_permutation(n);
+  double qs[203], out[203];
+  int i, same = 1;
+
+  s = gkstr_new(0.01, n);
+  gkstream_query_many(s, qs, out, 1);
+  ok_m(out[0] != out[0], "query_many before finish gives NaN");
+
+  for (i = 0; i < n; ++i)
+    gkstr_update(s, perm[i]);
+  gkstream_finish(s);
+
+  /* ascending, including out of range ones, then some descending */
+  for (i = 0; i < 203; ++i)
+    qs[i] = i < 103 ? -0.01 + 0.01 * i : 1. - 0.01 * (i - 103);
+  gkstream_query_many(s, qs, out, 203);
+  for (i = 0; i < 203; ++i)
+    same = same && out[i] == gkstream_query(s, qs[i]);
+  ok_m(same, "query_many gives the same results as query");
+
+  gkstr_free(s);
+  free(perm);
+}
+
+/* On a permutation of 1..n, the rank of x is x itself */
+static void
+test_rank()
+{
+  stream_t *s;
+  const double epsilon = 0.01;
+  const int n = 100000;
+  int *perm = make_permutation(n);
+  double xs[101], out[101];
+  double maxerr = 0.;
+  int i, same = 1;
+  char msg[128];
+
+  s = gkstr_new(epsilon, n);
+  ok_m(gkstream_rank(s, 1.) != gkstream_rank(s, 1.), "rank before finish is NaN");
+  for (i = 0; i < n; ++i)
+    gkstr_update(s, perm[i]);
+  gkstream_finish(s);
+
+  is_double_m(1e-9, gkstream_rank(s, 0.5), 0., "rank below the minimum is 0");
+  is_double_m(1e-9, gkstream_rank(s, n), n, "rank of the maximum is n");
+  is_double_m(1e-9, gkstream_rank(s, 2.*n), n, "rank above the maximum is n");
+  for (i = 0; i <= 100; ++i) {
+    const double x = (double)i * n / 100;
+    const double err = fabs(gkstream_rank(s, x) - x) / n;
+    if (err > maxerr)
+      maxerr = err;
+    xs[i] = x;
+  }
+  sprintf(msg, "max. rank error %g within epsilon=%g", maxerr, epsilon);
+  ok_m(maxerr <= epsilon, msg);
+
+  gkstream_cdf_many(s, xs, out, 101);
+  for (i = 0; i <= 100; ++i)
+    same = same && fabs(out[i] - gkstream_rank(s, xs[i]) / n) < 1e-12;
+  /* reversed order takes the binary search path */
+  for (i = 0; i <= 100; ++i)
+    xs[i] = (double)(100 - i) * n / 100;
+  gkstream_cdf_many(s, xs, out, 101);
+  for (i = 0; i <= 100; ++i)
+    same = same && fabs(out[i] - gkstream_rank(s, xs[i]) / n) < 1e-12;
+  ok_m(same, "cdf_many agrees with rank");
+
+  gkstr_free(s);
+  free(perm);
+}
+
+/* Splits a permutation over k streams made by make_stream, merges them
+ * all into the first one and checks the result. Its error bound must
+ * end up between min_error and max_error. */
+static void
+check_merge(stream_t *(*make_stream)(int i), int k, double min_error, double max_error, int n)
+{
+  stream_t **s = malloc(k * sizeof(stream_t *));
+  int *perm = make_permutation(n);
+  int i, fail = 0;
+  char msg[128];
+
+  for (i = 0; i < k; ++i)
+    s[i] = make_stream(i);
+  for (i = 0; i < n; ++i)
+    gkstr_update(s[i % k], perm[i]);
+
+  ok_m(gkstr_merge(s[0], s[0]) != 0, "merging a stream into itself fails");
+  for (i = 1; i < k; ++i)
+    fail |= gkstr_merge(s[0], s[i]);
+  ok_m(!fail, "gkstr_merge didn't (obviously) fail");
+  is_int_m(n, (int)gkstr_count(s[0]), "merged count");
+  sprintf(msg, "error bound of the merged stream is %g, within [%g, %g]",
+          gkstr_error_bound(s[0]), min_error, max_error);
+  ok_m(gkstr_error_bound(s[0]) > min_error - 1e-12
+       && gkstr_error_bound(s[0]) < max_error + 1e-12, msg);
+
+  gkstream_finish(s[0]);
+  check_accuracy(s[0], gkstr_error_bound(s[0]), n);
+
+  for (i = 0; i < k; ++i)
+    gkstr_free(s[i]);
+  free(s);
+  free(perm);
+}
+
+static stream_t *
+make_bounded(int i)
+{
+  UNUSED(i);
+  return gkstr_new(0.01, 100000);
+}
+
+static stream_t *
+make_unbounded(int i)
+{
+  UNUSED(i);
+  return gkstr_new_unbounded(0.01);
+}
+
+/* The first one has the largest epsilon, so the result has its error */
+static stream_t *
+make_mixed(int i)
+{
+  return i % 2 ? gkstr_new_unbounded(0.005 + 0.001 * i) : gkstr_new(0.02 - 0.001 * i, 50000);
+}
+
+static void
+test_merge()
+{
+  check_merge(make_bounded, 7, 0.01, 0.01, 100000);
+  /* the others get their own error on top of the merged ones' */
+  check_merge(make_unbounded, 5, 0.01, 0.02, 100000);
+  check_merge(make_mixed, 6, 0.02, 0.04, 100000);
+}
+
+/* Merging many streams that don't line up level by level must not pile
+ * up their summaries: after the first few merges, memory only grows
+ * with the log of the count */
+static void
+test_merge_memory()
+{
+  const int k = 300;
+  const int per = 5000;
+  const int n = k * per;
+  stream_t **s = malloc(k * sizeof(stream_t *));
+  int *perm = make_permutation(n);
+  size_t mem_early = 0;
+  int i, fail = 0;
+  char msg[128];
+
+  for (i = 0; i < k; ++i)
+    s[i] = gkstr_new_unbounded(0.01);
+  for (i = 0; i < n; ++i)
+    gkstr_update(s[i % k], perm[i]);
+
+  for (i = 1; i < k; ++i) {
+    fail |= gkstr_merge(s[0], s[i]);
+    if (i == 30)
+      mem_early = gkstr_memory_usage(s[0]);
+  }
+  ok_m(!fail, "300 unbounded streams merged");
+  is_int_m(n, (int)gkstr_count(s[0]), "merged count");
+  sprintf(msg, "memory after 300 merges (%lu) is less than twice that after 30 (%lu)",
+          (unsigned long)gkstr_memory_usage(s[0]), (unsigned long)mem_early);
+  ok_m(gkstr_memory_usage(s[0]) < 2 * mem_early, msg);
+  sprintf(msg, "error bound of the merged stream is %g", gkstr_error_bound(s[0]));
+  ok_m(gkstr_error_bound(s[0]) < 0.02 + 1e-12, msg);
+
+  gkstream_finish(s[0]);
+  check_accuracy(s[0], gkstr_error_bound(s[0]), n);
+
+  for (i = 0; i < k; ++i)
+    gkstr_free(s[i]);
+  free(s);
+  free(perm);
+}
+
+/* The same sketches reduced serially and on a few threads must give the
+ * very same result, with the usual accuracy */
+static void
+test_merge_many()
+{
+  const int k = 37;
+  const int n = 100000;
+  stream_t *s1[37], *s2[37];
+  int *perm = make_permutation(n);
+  int i, same = 1;
+  double q;
+
+  for (i = 0; i < k; ++i) {
+    s1[i] = i % 3 ? gkstr_new(0.01, n) : gkstr_new_unbounded(0.01);
+    s2[i] = i % 3 ? gkstr_new(0.01, n) : gkstr_new_unbounded(0.01);
+  }
+  for (i = 0; i < n; ++i) {
+    gkstr_update(s1[i % k], perm[i]);
+    gkstr_update(s2[i % k], perm[i]);
+  }
+
+  ok_m(!gkstr_merge_many(s1, k, 1), "gkstr_merge_many on one thread didn't (obviously) fail");
+  ok_m(!gkstr_merge_many(s2, k, 4), "gkstr_merge_many on four threads didn't (obviously) fail");
+  is_int_m(n, (int)gkstr_count(s2[0]), "merged count");
+
+  gkstream_finish(s1[0]);
+  gkstream_finish(s2[0]);
+  for (q = 0.; q <= 1.; q += 0.01)
+    same = same && gkstream_query(s1[0], q) == gkstream_query(s2[0], q);
+  ok_m(same, "same result for any number of threads");
+  check_accuracy(s2[0], 0.01, n);
+
+  /* the same stream twice can't work, wherever it is */
+  {
+    stream_t *dup[4];
+    const qe_count_t c1 = gkstr_count(s1[1]), c2 = gkstr_count(s1[2]);
+    dup[0] = s1[0];
+    dup[1] = s1[1];
+    dup[2] = dup[3] = s1[2];
+    ok_m(gkstr_merge_many(dup, 4, 2) != 0, "gkstr_merge_many with a duplicate fails");
+    dup[2] = s1[2];
+    dup[3] = s1[1];
+    ok_m(gkstr_merge_many(dup, 4, 1) != 0, "so does one that isn't next to its twin");
+    dup[0] = dup[2] = s1[1];
+    dup[1] = s1[2];
+    dup[3] = s1[3];
+    ok_m(gkstr_merge_many(dup, 4, 2) != 0, "also on more threads");
+    ok_m(gkstr_count(s1[1]) == c1 && gkstr_count(s1[2]) == c2, "and nothing got merged");
+  }
+
+  for (i = 0; i < k; ++i) {
+    gkstr_free(s1[i]);
+    gkstr_free(s2[i]);
+  }
+  free(perm);
+}
+
+/* Same for gkstr_merge_many: the tree of merges over many unbounded
+ * streams must end up smaller than a single stream that saw it all */
+static void
+test_merge_many_memory()
+{
+  const int k = 300;
+  const int per = 5000;
+  const int n = k * per;
+  stream_t **s = malloc(k * sizeof(stream_t *));
+  stream_t *all = gkstr_new_unbounded(0.01);
+  int *perm = make_permutation(n);
+  int i;
+  char msg[128];
+
+  for (i = 0; i < k; ++i)
+    s[i] = gkstr_new_unbounded(0.01);
+  for (i = 0; i < n; ++i) {
+    gkstr_update(s[i % k], perm[i]);
+    gkstr_update(all, perm[i]);
+  }
+
+  ok_m(!gkstr_merge_many(s, k, 4), "gkstr_merge_many of 300 unbounded streams");
+  is_int_m(n, (int)gkstr_count(s[0]), "merged count");
+  sprintf(msg, "memory of the merged stream (%lu) is less than that of one that saw it all (%lu)",
+          (unsigned long)gkstr_memory_usage(s[0]), (unsigned long)gkstr_memory_usage(all));
+  ok_m(gkstr_memory_usage(s[0]) < gkstr_memory_usage(all), msg);
+
+  gkstream_finish(s[0]);
+  check_accuracy(s[0], gkstr_error_bound(s[0]), n);
+
+  for (i = 0; i < k; ++i)
+    gkstr_free(s[i]);
+  gkstr_free(all);
+  free(s);
+  free(perm);
+}
+
+/* Packing up blocks on a background thread must end up with the very
+ * same summaries as doing it on the spot */
+static void
+test_background()
+{
+  const int n = 200000;
+  int *perm = make_permutation(n);
+  int i, j, same = 1;
+  double q;
+
+  for (j = 0; j < 2; ++j) {
+    stream_t *s1 = j ? gkstr_new_unbounded(0.01) : gkstr_new(0.01, n);
+    stream_t *s2 = j ? gkstr_new_unbounded(0.01) : gkstr_new(0.01, n);
+
+    ok_m(!gkstr_start_background(s2), "gkstr_start_background didn't (obviously) fail");
+    for (i = 0; i < n; ++i) {
+      gkstr_update(s1, perm[i]);
+      gkstr_update(s2, perm[i]);
+      if (i % 50000 == 0) {
+        gkstream_finish(s1);
+        gkstream_finish(s2);
+        same = same && gkstream_query(s1, 0.5) == gkstream_query(s2, 0.5);
+      }
+    }
+    gkstream_finish(s1);
+    gkstream_finish(s2);
+    for (q = 0.; q <= 1.; q += 0.01)
+      same = same && gkstream_query(s1, q) == gkstream_query(s2, q);
+    ok_m(same, "background packing gives the same results");
+
+    gkstr_free(s1);
+    gkstr_free(s2);
+  }
+
+  free(perm);
+}
 
 int
 main ()
 {
   test_basics();
+  test_accuracy(0.01, 100000);
+  test_accuracy(0.005, 200000);
+  test_steady_state_allocs();
+  test_update_many();
+  test_unbounded(0.01, 100000);
+  test_unbounded(0.001, 1000000);
+  test_finish_incremental();
+  test_exact_small();
+  test_query_many();
+  test_rank();
+  test_merge();
+  test_merge_memory();
+  test_merge_many();
+  test_merge_many_memory();
+  test_background();
   ok_m(1, "alive");
   done_testing();
   return 0;
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+/* Heavily quantized data: few distinct values, most of them in long runs
+ * of equal values. Level 0 collapses those runs as it's sorted, and the
+ * levels keep every tuple while there are few enough of them. */
+
+/* Shuffles vals in place, with a fixed seed so failures repeat */
+static void
+shuffle(double *vals, size_t n)
+{
+  size_t i;
+
+  srand(42);
+  for (i = n; i > 1; --i) {
+    const size_t j = (size_t)rand() % i;
+    const double tmp = vals[i-1];
+    vals[i-1] = vals[j];
+    vals[j] = tmp;
+  }
+}
+
+/* A single value, in blocks of all sizes: every run collapses */
+static void
+test_constant(size_t n, double epsilon)
+{
+  double *vals = malloc(n * sizeof(double));
+  stream_t *s = gkstr_new(epsilon, n);
+  char msg[128];
+  size_t i;
+  int fail = 0;
+  double q;
+
+  for (i = 0; i < n; ++i)
+    vals[i] = 7.;
+  fail |= gkstr_update_many(s, vals, n / 3);
+  for (i = n / 3; i < n; ++i)
+    fail |= gkstr_update(s, vals[i]);
+  sprintf(msg, "%lu equal values went in", (unsigned long)n);
+  ok_m(!fail, msg);
+
+  gkstream_finish(s);
+  for (q = 0.; q <= 1.; q += 0.125) {
+    sprintf(msg, "%lu equal values: query(%.3f)", (unsigned long)n, q);
+    ok_m(gkstream_query(s, q) == 7., msg);
+  }
+
+  gkstr_free(s);
+  free(vals);
+}
+
+/* Value k (1 <= k <= nvalues) comes up k*k times, in random order.
+ * With fewer distinct values than a level keeps, none of them gets
+ * pruned away, including the rare ones at the bottom: probing the
+ * middle of every value's ranks (and both ends) finds all of them. */
+static void
+test_few_values(size_t nvalues, double epsilon)
+{
+  size_t n = 0;
+  double *vals;
+  char *found;
+  stream_t *s;
+  char msg[128];
+  size_t i, k;
+  size_t rank_below = 0;
+  int fail = 0;
+
+  for (k = 1; k <= nvalues; ++k)
+    n += k * k;
+  vals = malloc(n * sizeof(double));
+  found = calloc(nvalues + 1, 1);
+  for (i = 0, k = 1; k <= nvalues; ++k) {
+    size_t j;
+    for (j = 0; j < k * k; ++j)
+      vals[i++] = (double)k;
+  }
+  shuffle(vals, n);
+
+  s = gkstr_new(epsilon, n);
+  fail |= gkstr_update_many(s, vals, n);
+  sprintf(msg, "%lu values in %lu runs went in", (unsigned long)n, (unsigned long)nvalues);
+  ok_m(!fail, msg);
+  gkstream_finish(s);
+
+  found[(size_t)gkstream_query(s, 0.)] = 1;
+  found[(size_t)gkstream_query(s, 1.)] = 1;
+  for (k = 1; k <= nvalues; ++k) {
+    const double q = ((double)rank_below + (double)(k * k) / 2.) / (double)n;
+    const double v = gkstream_query(s, q);
+    if (v >= 1. && v <= (double)nvalues)
+      found[(size_t)v] = 1;
+    rank_below += k * k;
+  }
+  for (k = 1; k <= nvalues; ++k) {
+    if (!found[k]) {
+      printf("# %lu never came up\n", (unsigned long)k);
+      ++fail;
+    }
+  }
+  sprintf(msg, "%lu runs: every value is still there", (unsigned long)nvalues);
+  ok_m(!fail, msg);
+
+  gkstr_free(s);
+  free(found);
+  free(vals);
+}
+
+int
+main ()
+{
+  test_constant(500, 0.01);
+  test_constant(1000, 0.01);
+  test_constant(1000000, 0.001);
+  test_few_values(10, 0.01);
+  test_few_values(60, 0.01);
+  test_few_values(200, 0.001);
+  done_testing();
+  return 0;
+}
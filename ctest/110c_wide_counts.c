@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+/* Shuffles vals in place, with a fixed seed so failures repeat */
+static void
+shuffle(double *vals, size_t n)
+{
+  size_t i;
+
+  srand(42);
+  for (i = n; i > 1; --i) {
+    const size_t j = ((size_t)rand() * ((size_t)RAND_MAX + 1) + (size_t)rand()) % i;
+    const double tmp = vals[i-1];
+    vals[i-1] = vals[j];
+    vals[j] = tmp;
+  }
+}
+
+/* Doubles the stream the given number of times, by merging a copy of it
+ * into it, which gets past 2^32 elements without feeding them all */
+static int
+double_up(stream_t *s, int times)
+{
+  int fail = 0;
+
+  while (times-- > 0) {
+    const size_t size = gkstr_serialized_size(s);
+    unsigned char *buf = malloc(size);
+    const size_t len = gkstr_serialize(s, buf, size);
+    stream_t *copy = len > 0 ? gkstr_deserialize(buf, len) : NULL;
+
+    fail |= copy == NULL || gkstr_merge(s, copy);
+    gkstr_free(copy);
+    free(buf);
+  }
+
+  return fail;
+}
+
+/* More than 2^32 elements, which would wrap around any 32-bit count or
+ * rank. Values 1..100 in random order with equal counts, so the exact
+ * q-quantile is ceil(100*q). */
+static void
+test_past_2_32()
+{
+  const size_t nvals = 100 << 12;
+  const int ndoublings = 14;
+  const qe_count_t n = (qe_count_t)nvals << ndoublings;
+  double *vals;
+  stream_t *s;
+  size_t i;
+  int fail = 0;
+  double q;
+
+  vals = malloc(nvals * sizeof(double));
+  for (i = 0; i < nvals; ++i)
+    vals[i] = (double)(1 + i / (nvals / 100));
+  shuffle(vals, nvals);
+
+  s = gkstr_new(0.001, n);
+  ok_m(s != NULL, "gkstr_new with n > 2^32 didn't (obviously) fail");
+
+  fail |= gkstr_update_many(s, vals, nvals);
+  fail |= double_up(s, ndoublings);
+  ok_m(!fail, "updates and merges didn't (obviously) fail");
+  ok_m(gkstr_count(s) == n, "count is past 2^32");
+
+  gkstream_finish(s);
+  is_double_m(1e-9, gkstream_query(s, 0.), 1., "query(0) is the minimum");
+  is_double_m(1e-9, gkstream_query(s, 1.), 100., "query(1) is the maximum");
+  /* stay clear of the quantiles where the value changes */
+  for (q = 0.055; q < 1.; q += 0.1) {
+    char msg[64];
+    sprintf(msg, "query(%.2f) is exact", q);
+    is_double_m(1e-9, gkstream_query(s, q), ceil(100*q), msg);
+  }
+
+  gkstr_free(s);
+  free(vals);
+}
+
+/* The last tuple of a run of equal values takes the g of the whole run,
+ * which doesn't fit into a 32-bit tuple count once the run passes 2^32:
+ * one value, but for one in 1024 elements that has another one. */
+static void
+test_long_run()
+{
+  const size_t nvals = 1 << 20;
+  const size_t ntwos = nvals >> 10;
+  const int ndoublings = 13;
+  const qe_count_t n = (qe_count_t)nvals << ndoublings;
+  const qe_count_t nones = (qe_count_t)(nvals - ntwos) << ndoublings;
+  double *vals;
+  stream_t *s;
+  size_t i;
+  int fail = 0;
+
+  vals = malloc(nvals * sizeof(double));
+  for (i = 0; i < nvals; ++i)
+    vals[i] = i < ntwos ? 2. : 1.;
+  shuffle(vals, nvals);
+
+  s = gkstr_new(0.001, n);
+  fail |= gkstr_update_many(s, vals, nvals);
+  fail |= double_up(s, ndoublings);
+  ok_m(!fail, "updates and merges didn't (obviously) fail");
+
+  gkstream_finish(s);
+  ok_m(nones > ((qe_count_t)1 << 32), "the run is longer than 2^32");
+  ok_m(gkstr_count(s) == n, "count");
+  ok_m(gkstream_query(s, 0.1) == 1., "query(0.1) is in the run");
+  ok_m(gkstream_query(s, 0.5) == 1., "query(0.5) is in the run");
+  ok_m(gkstream_query(s, 0.99) == 1., "query(0.99) is in the run");
+  ok_m(gkstream_query(s, 1.) == 2., "query(1) is past it");
+  ok_m(fabs(gkstream_rank(s, 1.) - (double)nones) <= 0.001 * (double)n,
+       "rank of the run's value is its length");
+  ok_m(gkstream_rank(s, 2.) == (double)n, "rank of the maximum is the count");
+
+  gkstr_free(s);
+  free(vals);
+}
+
+int
+main ()
+{
+  test_past_2_32();
+  test_long_run();
+  done_testing();
+  return 0;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include <quant_est.h>
+#include <qe_sort.h>
+
+#include "mytap.h"
+
+static int
+same_quantiles(stream_t *s1, stream_t *s2)
+{
+  double q;
+  int same = 1;
+
+  gkstream_finish(s1);
+  gkstream_finish(s2);
+  for (q = 0.; q <= 1.; q += 0.01)
+    same = same && gkstream_query(s1, q) == gkstream_query(s2, q);
+  return same && gkstr_count(s1) == gkstr_count(s2);
+}
+
+static unsigned char *
+serialize(stream_t *s, size_t *len)
+{
+  const size_t size = gkstr_serialized_size(s);
+  unsigned char *buf = malloc(size);
+
+  *len = gkstr_serialize(s, buf, size);
+  return buf;
+}
+
+/* Round trip in the middle of a stream (with a partially filled level 0),
+ * then keep feeding both copies the same values */
+static void
+test_roundtrip(stream_t *s, const char *name)
+{
+  const int n = 200000;
+  stream_t *s2;
+  unsigned char *buf;
+  size_t len;
+  int i;
+  char msg[128];
+
+  for (i = 0; i < n/2 + 17; ++i)
+    gkstr_update(s, (double)((i * 7919) % n));
+
+  buf = serialize(s, &len);
+  sprintf(msg, "%s: serialize didn't (obviously) fail", name);
+  ok_m(len > 0 && len <= gkstr_serialized_size(s), msg);
+  sprintf(msg, "%s: serialize with a short buffer fails", name);
+  ok_m(gkstr_serialize(s, buf, len - 1) == 0, msg);
+
+  s2 = gkstr_deserialize(buf, len);
+  sprintf(msg, "%s: deserialize didn't (obviously) fail", name);
+  ok_m(s2 != NULL, msg);
+  sprintf(msg, "%s: same results after deserializing", name);
+  ok_m(same_quantiles(s, s2), msg);
+
+  for (; i < n; ++i) {
+    gkstr_update(s, (double)((i * 7919) % n));
+    gkstr_update(s2, (double)((i * 7919) % n));
+  }
+  sprintf(msg, "%s: same results after more updates", name);
+  ok_m(same_quantiles(s, s2), msg);
+
+  gkstr_free(s2);
+  free(buf);
+  gkstr_free(s);
+}
+
+/* Truncated or corrupted input must be rejected, not crash */
+static void
+test_malformed()
+{
+  stream_t *s = gkstr_new(0.01, 10000);
+  stream_t *s2;
+  unsigned char *buf;
+  size_t len, i;
+  int all_null = 1;
+
+  for (i = 0; i < 5000; ++i)
+    gkstr_update(s, (double)(i % 1013));
+  buf = serialize(s, &len);
+
+  for (i = 0; i < len; ++i) {
+    s2 = gkstr_deserialize(buf, i);
+    all_null = all_null && s2 == NULL;
+    if (s2 != NULL)
+      gkstr_free(s2);
+  }
+  ok_m(all_null, "truncated input is rejected");
+
+  buf[4] = 99;
+  ok_m(gkstr_deserialize(buf, len) == NULL, "unknown version is rejected");
+  buf[4] = 1;
+  buf[0] = 'X';
+  ok_m(gkstr_deserialize(buf, len) == NULL, "bad magic is rejected");
+  buf[0] = 'Q';
+
+  /* flipping bytes anywhere must not crash, whatever it turns into */
+  for (i = 6; i < len; ++i) {
+    buf[i] ^= 0xff;
+    s2 = gkstr_deserialize(buf, len);
+    if (s2 != NULL) {
+      gkstream_finish(s2);
+      gkstr_free(s2);
+    }
+    buf[i] ^= 0xff;
+  }
+  ok_m(1, "survived corrupted input");
+
+  s2 = gkstr_deserialize(buf, len);
+  ok_m(s2 != NULL && same_quantiles(s, s2), "restored input still works");
+  if (s2 != NULL)
+    gkstr_free(s2);
+
+  free(buf);
+  gkstr_free(s);
+}
+
+static unsigned char *
+put_varint(unsigned char *p, uint64_t x)
+{
+  while (x >= 0x80) {
+    *p++ = (unsigned char)(x | 0x80);
+    x >>= 7;
+  }
+  *p++ = (unsigned char)x;
+  return p;
+}
+
+static unsigned char *
+put_f64(unsigned char *p, double d)
+{
+  uint64_t u;
+  int i;
+
+  memcpy(&u, &d, sizeof(u));
+  for (i = 0; i < 8; ++i)
+    *p++ = (unsigned char)(u >> (8 * i));
+  return p;
+}
+
+/* Writes a bounded stream by hand: nothing in level 0, ntuples tuples
+ * with the given sort keys and g (delta 0) in level 1, and an empty done
+ * summary. Returns the length. */
+static size_t
+handmade(unsigned char *buf, double epsilon, uint64_t n,
+         const uint64_t *keys, const uint64_t *g, size_t ntuples)
+{
+  unsigned char *p = buf;
+  uint64_t count = 0, key = 0;
+  size_t i;
+
+  for (i = 0; i < ntuples; ++i)
+    count += g[i];
+  memcpy(p, "QEST", 4);
+  p += 4;
+  *p++ = 1;
+  *p++ = 0;
+  p = put_f64(p, epsilon);
+  p = put_f64(p, epsilon);
+  p = put_varint(p, n);
+  p = put_varint(p, (uint64_t)floor(log(epsilon * (double)n) / epsilon));
+  p = put_varint(p, count);
+  p = put_varint(p, 0);
+  p = put_varint(p, 0);
+  p = put_varint(p, 1);
+  p = put_varint(p, ntuples);
+  for (i = 0; i < ntuples; ++i) {
+    p = put_varint(p, keys[i] - key);
+    p = put_varint(p, g[i]);
+    p = put_varint(p, 0);
+    key = keys[i];
+  }
+  p = put_varint(p, 0);
+
+  return (size_t)(p - buf);
+}
+
+/* Input that's well-formed as far as the encoding goes, but describes
+ * something no stream could have written */
+static void
+test_inconsistent()
+{
+  unsigned char buf[256];
+  uint64_t keys[3], g[3] = {1, 2, 1};
+  size_t len;
+  stream_t *s;
+
+  keys[0] = qe_sort_double_to_key(1.);
+  keys[1] = qe_sort_double_to_key(2.);
+  keys[2] = qe_sort_double_to_key(3.);
+  len = handmade(buf, 0.01, 10000, keys, g, 3);
+  s = gkstr_deserialize(buf, len);
+  ok_m(s != NULL, "handmade input is accepted");
+  if (s != NULL) {
+    gkstream_finish(s);
+    ok_m(gkstr_count(s) == 4 && gkstream_query(s, 1.) == 3., "and restores what it says");
+    gkstr_free(s);
+  }
+
+  /* The levels are sized by what's in the input, not by b: this b
+   * would take hundreds of GB per level */
+  len = handmade(buf, 1e-9, (uint64_t)1 << 62, keys, g, 3);
+  s = gkstr_deserialize(buf, len);
+  ok_m(s != NULL && gkstr_memory_usage(s) < 1000000, "a huge block size doesn't allocate by it");
+  if (s != NULL)
+    gkstr_free(s);
+
+  g[1] = 0;
+  len = handmade(buf, 0.01, 10000, keys, g, 3);
+  ok_m(gkstr_deserialize(buf, len) == NULL, "a tuple with g = 0 is rejected");
+  g[1] = 2;
+
+  /* keys that wrap around and start over at the bottom */
+  keys[2] = keys[1] + ((uint64_t)1 << 63) + 5;
+  len = handmade(buf, 0.01, 10000, keys, g, 3);
+  ok_m(gkstr_deserialize(buf, len) == NULL, "values out of order are rejected");
+
+  keys[2] = ~(uint64_t)0;
+  len = handmade(buf, 0.01, 10000, keys, g, 3);
+  ok_m(gkstr_deserialize(buf, len) == NULL, "a NaN in a summary is rejected");
+}
+
+int
+main ()
+{
+  test_roundtrip(gkstr_new(0.01, 200000), "bounded");
+  test_roundtrip(gkstr_new_unbounded(0.01), "unbounded");
+  test_malformed();
+  test_inconsistent();
+  done_testing();
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+#define NTHREADS 8
+#define N 400000
+
+typedef struct {
+  sharded_t *sh;
+  int id;
+  int fail;
+} worker_arg_t;
+
+/* Thread i adds the values congruent to i modulo NTHREADS, so all of
+ * them together add 1..N. Every other batch goes one by one. */
+static void *
+worker(void *p)
+{
+  worker_arg_t *arg = (worker_arg_t *)p;
+  double batch[100];
+  int i, j;
+
+  for (i = arg->id; i < N; i += 100 * NTHREADS) {
+    int nbatch = 0;
+    for (j = i; j < N && j < i + 100 * NTHREADS; j += NTHREADS)
+      batch[nbatch++] = (double)(j + 1);
+    if ((i / (100 * NTHREADS)) % 2)
+      arg->fail |= gkshard_update_many(arg->sh, arg->id, batch, nbatch);
+    else
+      for (j = 0; j < nbatch; ++j)
+        arg->fail |= gkshard_update(arg->sh, arg->id, batch[j]);
+  }
+
+  return NULL;
+}
+
+/* Snapshots in the middle of the updates must be sane */
+static void *
+reader(void *p)
+{
+  worker_arg_t *arg = (worker_arg_t *)p;
+  qe_count_t last = 0;
+  int i;
+
+  for (i = 0; i < 50; ++i) {
+    stream_t *s = gkshard_snapshot(arg->sh);
+    double q;
+    if (s == NULL) {
+      arg->fail = 1;
+      break;
+    }
+    /* counts never go down, and quantiles are in range */
+    arg->fail |= gkstr_count(s) < last;
+    last = gkstr_count(s);
+    q = gkstream_query(s, 0.5);
+    arg->fail |= last > 0 && !(q >= 1 && q <= N);
+    gkstr_free(s);
+  }
+
+  return NULL;
+}
+
+static void
+test_threads()
+{
+  sharded_t *sh = gkshard_new(0.01, N, NTHREADS);
+  pthread_t threads[NTHREADS + 1];
+  worker_arg_t args[NTHREADS + 1];
+  stream_t *s;
+  double q, maxerr = 0.;
+  int i, fail = 0;
+  char msg[128];
+
+  ok_m(sh != NULL, "gkshard_new didn't (obviously) fail");
+
+  for (i = 0; i <= NTHREADS; ++i) {
+    args[i].sh = sh;
+    args[i].id = i;
+    args[i].fail = 0;
+    pthread_create(&threads[i], NULL, i < NTHREADS ? worker : reader, &args[i]);
+  }
+  for (i = 0; i <= NTHREADS; ++i) {
+    pthread_join(threads[i], NULL);
+    fail |= args[i].fail;
+  }
+  ok_m(!fail, "concurrent updates and snapshots didn't (obviously) fail");
+
+  s = gkshard_snapshot(sh);
+  ok_m(s != NULL, "gkshard_snapshot didn't (obviously) fail");
+  is_int_m(N, (int)gkstr_count(s), "snapshot has all elements");
+  is_double_m(1e-9, gkstream_query(s, 0.), 1., "query(0) is the minimum");
+  is_double_m(1e-9, gkstream_query(s, 1.), N, "query(1) is the maximum");
+  for (q = 0.; q <= 1.; q += 0.01) {
+    const double err = fabs(gkstream_query(s, q) - q*N) / N;
+    if (err > maxerr)
+      maxerr = err;
+  }
+  sprintf(msg, "max. rank error %g within 2*epsilon=%g", maxerr, 0.02);
+  ok_m(maxerr <= 0.02, msg);
+
+  gkstr_free(s);
+  gkshard_free(sh);
+}
+
+int
+main ()
+{
+  test_threads();
+  done_testing();
+  return 0;
+}
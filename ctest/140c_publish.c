@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+#define NREADERS 4
+#define N 300000
+
+typedef struct {
+  stream_t *s;
+  volatile int *writer_done;
+  int fail;
+  int nreads;
+} reader_arg_t;
+
+/* The writer adds 1, 2, 3, ... in order, so every snapshot's maximum
+ * is its count, and counts never go down */
+static void *
+reader(void *p)
+{
+  reader_arg_t *arg = (reader_arg_t *)p;
+  int id = gkstr_reader_register(arg->s);
+  qe_count_t last = 0;
+
+  if (id < 0) {
+    arg->fail = 1;
+    return NULL;
+  }
+
+  while (!__atomic_load_n(arg->writer_done, __ATOMIC_ACQUIRE)) {
+    const qe_snapshot_t *snap = gkstr_read_begin(arg->s, id);
+    const qe_count_t count = gksnap_count(snap);
+
+    arg->fail |= count < last;
+    if (count > 0) {
+      arg->fail |= gksnap_query(snap, 1.) != (double)count;
+      arg->fail |= gksnap_query(snap, 0.) != 1.;
+    }
+    last = count;
+    gkstr_read_end(arg->s, id);
+    ++arg->nreads;
+  }
+
+  gkstr_reader_unregister(arg->s, id);
+  return NULL;
+}
+
+static void
+test_publish()
+{
+  stream_t *s = gkstr_new(0.01, N);
+  pthread_t threads[NREADERS];
+  reader_arg_t args[NREADERS];
+  volatile int writer_done = 0;
+  const qe_snapshot_t *snap;
+  double qs[3] = {0.1, 0.5, 0.9}, out[3];
+  int i, fail = 0, id, same;
+
+  ok_m(gkstr_reader_register(s) == -1, "no readers before the first publish");
+  ok_m(!gkstr_publish(s), "gkstr_publish didn't (obviously) fail");
+
+  for (i = 0; i < NREADERS; ++i) {
+    args[i].s = s;
+    args[i].writer_done = &writer_done;
+    args[i].fail = 0;
+    args[i].nreads = 0;
+    pthread_create(&threads[i], NULL, reader, &args[i]);
+  }
+
+  for (i = 1; i <= N; ++i) {
+    fail |= gkstr_update(s, (double)i);
+    if (i % 10000 == 0)
+      fail |= gkstr_publish(s);
+  }
+  __atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+  ok_m(!fail, "updating and publishing didn't (obviously) fail");
+
+  for (i = 0; i < NREADERS; ++i) {
+    pthread_join(threads[i], NULL);
+    fail |= args[i].fail;
+  }
+  ok_m(!fail, "readers always saw consistent snapshots");
+
+  id = gkstr_reader_register(s);
+  snap = gkstr_read_begin(s, id);
+  is_int_m(N, (int)gksnap_count(snap), "last snapshot has everything");
+  gksnap_query_many(snap, qs, out, 3);
+  same = 1;
+  for (i = 0; i < 3; ++i)
+    same = same && out[i] == gkstream_query(s, qs[i]);
+  ok_m(same, "snapshot queries agree with the stream");
+  is_double_m(1e-9, gksnap_rank(snap, N/2), gkstream_rank(s, N/2), "snapshot rank agrees");
+  gkstr_read_end(s, id);
+  gkstr_reader_unregister(s, id);
+
+  gkstr_free(s);
+}
+
+/* Streams in the exact phase publish the sorted values alone */
+static void
+test_publish_exact()
+{
+  stream_t *s = gkstr_new(0.01, N);
+  const qe_snapshot_t *snap;
+  int i, id;
+
+  for (i = 100; i >= 1; --i)
+    gkstr_update(s, (double)i);
+  gkstr_publish(s);
+  id = gkstr_reader_register(s);
+  snap = gkstr_read_begin(s, id);
+  is_int_m(100, (int)gksnap_count(snap), "exact snapshot has everything");
+  ok_m(gksnap_query(snap, 0.37) == 37. && gksnap_rank(snap, 63.5) == 63.,
+       "exact snapshot answers exactly");
+  gkstr_read_end(s, id);
+  gkstr_reader_unregister(s, id);
+
+  gkstr_free(s);
+}
+
+int
+main ()
+{
+  test_publish();
+  test_publish_exact();
+  done_testing();
+  return 0;
+}
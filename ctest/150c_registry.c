@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+#define NKEYS 100000
+
+typedef struct {
+  size_t nint;
+  size_t nstr;
+  qe_count_t count;
+  qe_count_t key_sum;
+} each_arg_t;
+
+static int
+count_each(void *ctx, const char *key, size_t keylen, uint64_t ikey, stream_t *s)
+{
+  each_arg_t *arg = (each_arg_t *)ctx;
+
+  if (key == NULL) {
+    ++arg->nint;
+    arg->key_sum += ikey;
+  }
+  else {
+    ++arg->nstr;
+    arg->key_sum += keylen;
+  }
+  arg->count += gkstr_count(s);
+  return 0;
+}
+
+static int
+stop_each(void *ctx, const char *key, size_t keylen, uint64_t ikey, stream_t *s)
+{
+  UNUSED(key); UNUSED(keylen); UNUSED(ikey); UNUSED(s);
+  return ++*(int *)ctx == 3 ? 42 : 0;
+}
+
+static void
+test_keys()
+{
+  registry_t *reg = gkreg_new(0.01, 0);
+  stream_t *s;
+  each_arg_t arg;
+  const double vals[3] = {1., 2., 3.};
+  char name[32];
+  int i, fail = 0, nseen = 0;
+
+  ok_m(reg != NULL, "gkreg_new didn't (obviously) fail");
+  ok_m(gkreg_new(0.01, 10) == NULL, "gkreg_new fails for n too small");
+  ok_m(gkreg_find(reg, 1) == NULL, "nothing there before the first get");
+
+  for (i = 0; i < NKEYS; ++i) {
+    s = gkreg_get(reg, (uint64_t)i);
+    fail |= s == NULL || gkstr_update(s, (double)(i % 7));
+  }
+  ok_m(!fail, "gkreg_get and updates didn't (obviously) fail");
+  is_int_m(NKEYS, (int)gkreg_size(reg), "one stream per integer key");
+  ok_m(gkreg_get(reg, 1234) == gkreg_find(reg, 1234), "same stream on every lookup");
+  ok_m(gkreg_get(reg, 1234) != gkreg_get(reg, 1235), "different streams for different keys");
+
+  for (i = 0; i < 1000; ++i) {
+    sprintf(name, "/api/endpoint/%d", i);
+    s = gkreg_get_str(reg, name, strlen(name));
+    fail |= s == NULL || gkstr_update_many(s, vals, 3);
+  }
+  ok_m(!fail, "gkreg_get_str didn't (obviously) fail");
+  is_int_m(NKEYS + 1000, (int)gkreg_size(reg), "string keys live next to integer keys");
+  ok_m(gkreg_find_str(reg, "/api/endpoint/17", 16) == gkreg_get_str(reg, "/api/endpoint/17", 16),
+       "same stream for the same string");
+  ok_m(gkreg_find_str(reg, "/api/endpoint/1", 14) != gkreg_find_str(reg, "/api/endpoint/1", 15),
+       "key length counts");
+  ok_m(gkreg_find_str(reg, "/api/nope", 9) == NULL, "gkreg_find_str doesn't create streams");
+
+  memset(&arg, 0, sizeof(arg));
+  ok_m(gkreg_each(reg, count_each, &arg) == 0, "gkreg_each returns 0");
+  ok_m(arg.nint == NKEYS && arg.nstr == 1000, "gkreg_each visits every stream once");
+  is_int_m(NKEYS + 3000, (int)arg.count, "gkreg_each sees all values");
+  ok_m(gkreg_each(reg, stop_each, &nseen) == 42 && nseen == 3,
+       "gkreg_each stops at a non-zero return value");
+
+  gkreg_free(reg);
+}
+
+/* Until level 0 fills up, a stream keeps every value, so its quantiles
+ * are exact */
+static void
+test_exact()
+{
+  registry_t *reg = gkreg_new(0.01, 1000000);
+  stream_t *s = gkreg_get_str(reg, "small", 5);
+  double qs[3] = {0.25, 0.5, 1.}, out[3];
+  int i;
+
+  for (i = 200; i >= 1; --i)
+    gkstr_update(s, (double)i);
+  gkstream_finish(s);
+  gkstream_query_many(s, qs, out, 3);
+  ok_m(out[0] == 50. && out[1] == 100. && out[2] == 200., "small streams are exact");
+  is_double_m(1e-9, 120., gkstream_rank(s, 120.), "and so are their ranks");
+
+  gkreg_free(reg);
+}
+
+/* Idle streams are just their slot in a slab: the buffers, the array
+ * of levels and the state for queries all come with the first use */
+static void
+test_idle_allocs()
+{
+  registry_t *reg = gkreg_new(0.001, 0);
+  char msg[128];
+  size_t idle;
+#if DEBUG
+  unsigned long nallocs = gkstr_debug_nalloc_calls();
+  double per_stream;
+  int i;
+
+  for (i = 0; i < NKEYS; ++i)
+    gkreg_get_str(reg, (const char *)&i, sizeof(i));
+  per_stream = (double)(gkstr_debug_nalloc_calls() - nallocs) / NKEYS;
+  sprintf(msg, "%.3f allocations per idle stream", per_stream);
+  ok_m(per_stream < 0.05, msg);
+#else
+  note("skipping allocation count check: not a debug build");
+#endif
+
+  idle = gkstr_memory_usage(gkreg_get(reg, 42));
+  sprintf(msg, "idle stream takes %lu bytes", (unsigned long)idle);
+  ok_m(idle <= 320, msg);
+
+  gkreg_free(reg);
+}
+
+int
+main ()
+{
+  test_keys();
+  test_exact();
+  test_idle_allocs();
+  done_testing();
+  return 0;
+}
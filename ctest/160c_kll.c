@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+#define N 1000000
+
+/* Values 1..n in scrambled order, so that value i has rank i */
+static double
+nth_value(int i, int n)
+{
+  return (double)(((long long)i * 7919) % n + 1);
+}
+
+static void
+fill(sketch_t *sk, int from, int to, int n)
+{
+  int i;
+
+  for (i = from; i < to; ++i)
+    qesk_update(sk, nth_value(i, n));
+}
+
+/* Largest error of the quantiles and ranks of a sketch of 1..n, as a
+ * fraction of n */
+static double
+max_error(sketch_t *sk, int n)
+{
+  double worst = 0.;
+  int i;
+
+  for (i = 0; i <= 1000; ++i) {
+    const double q = i / 1000.;
+    const double qerr = fabs(qesk_query(sk, q) - q * n) / n;
+    const double rerr = fabs(qesk_rank(sk, q * n) - floor(q * n)) / n;
+    worst = qerr > worst ? qerr : worst;
+    worst = rerr > worst ? rerr : worst;
+  }
+
+  return worst;
+}
+
+static int
+same_quantiles(sketch_t *s1, sketch_t *s2)
+{
+  int same = qesk_count(s1) == qesk_count(s2);
+  int i;
+
+  for (i = 0; i <= 100; ++i)
+    same = same && qesk_query(s1, i / 100.) == qesk_query(s2, i / 100.);
+  return same;
+}
+
+static void
+test_engines()
+{
+  sketch_t *gk = qesk_new("gk", 0.01, 0);
+  sketch_t *kll = qesk_new("kll", 0.01, 0);
+
+  ok_m(gk != NULL && kll != NULL, "qesk_new didn't (obviously) fail");
+  ok_m(qesk_new("nope", 0.01, 0) == NULL, "unknown engines fail");
+  ok_m(qesk_new("kll", 1e-7, 0) == NULL, "kll fails for tiny epsilons");
+  ok_m(strcmp(qesk_engine(gk), "gk") == 0 && strcmp(qesk_engine(kll), "kll") == 0,
+       "qesk_engine names the engine");
+  ok_m(qesk_stream(gk) != NULL && qesk_stream(kll) == NULL, "only gk sketches have a stream");
+  ok_m(isnan(qesk_query(kll, 0.5)), "no data, no answer");
+
+  qesk_update(gk, 1.);
+  qesk_update(kll, 1.);
+  ok_m(qesk_merge(gk, kll) != 0, "sketches of different engines don't merge");
+  ok_m(qesk_merge(kll, kll) != 0, "a sketch doesn't merge into itself");
+
+  qesk_free(gk);
+  qesk_free(kll);
+}
+
+static void
+test_accuracy()
+{
+  sketch_t *kll = qesk_new("kll", 0.01, 0);
+  sketch_t *gk = qesk_new("gk", 0.01, N);
+  sketch_t *small = qesk_new("kll", 0.01, 0);
+  double err;
+  char msg[128];
+  int i, exact = 1;
+
+  fill(kll, 0, N, N);
+  fill(gk, 0, N, N);
+  is_int_m(N, (int)qesk_count(kll), "count");
+  err = max_error(kll, N);
+  sprintf(msg, "largest rank error %g is within epsilon", err);
+  ok_m(err <= 0.01, msg);
+  ok_m(qesk_query(kll, 0.) == 1. && qesk_query(kll, 1.) == (double)N,
+       "the extremes are exact");
+  sprintf(msg, "kll takes %lu bytes, gk %lu",
+          (unsigned long)qesk_memory_usage(kll), (unsigned long)qesk_memory_usage(gk));
+  ok_m(qesk_memory_usage(kll) * 4 < qesk_memory_usage(gk), msg);
+
+  fill(small, 0, 100, 100);
+  for (i = 1; i < 100; ++i) {
+    exact = exact && qesk_query(small, (i + 0.5) / 100.) == (double)i
+                  && qesk_rank(small, (double)i) == (double)i;
+  }
+  ok_m(exact, "small sketches are exact");
+
+  qesk_free(kll);
+  qesk_free(gk);
+  qesk_free(small);
+}
+
+static void
+test_update_many()
+{
+  sketch_t *s1 = qesk_new("kll", 0.005, 0);
+  sketch_t *s2 = qesk_new("kll", 0.005, 0);
+  double *vals = malloc(N * sizeof(double));
+  int i;
+
+  for (i = 0; i < N; ++i)
+    vals[i] = nth_value(i, N);
+  fill(s1, 0, N, N);
+  for (i = 0; i < N; i += 777)
+    qesk_update_many(s2, vals + i, i + 777 <= N ? 777 : (size_t)(N - i));
+  ok_m(same_quantiles(s1, s2), "update_many gives the same results as update");
+
+  free(vals);
+  qesk_free(s1);
+  qesk_free(s2);
+}
+
+static void
+test_merge()
+{
+  sketch_t *parts[10], *dup[3];
+  sketch_t *other = qesk_new("kll", 0.02, 0);
+  double err;
+  char msg[128];
+  int i;
+
+  for (i = 0; i < 10; ++i) {
+    parts[i] = qesk_new("kll", 0.01, 0);
+    fill(parts[i], i * (N/10), (i+1) * (N/10), N);
+  }
+  dup[0] = parts[2];
+  dup[1] = parts[3];
+  dup[2] = parts[2];
+  ok_m(qesk_merge_many(dup, 3, 1) != 0, "merge_many fails if a sketch appears twice");
+  is_int_m(N/10, (int)qesk_count(parts[2]), "and merges nothing");
+  ok_m(qesk_merge_many(parts, 10, 4) == 0, "merge_many didn't (obviously) fail");
+  is_int_m(N, (int)qesk_count(parts[0]), "count after merge_many");
+  is_int_m(N/10, (int)qesk_count(parts[1]), "the others are left alone");
+  err = max_error(parts[0], N);
+  sprintf(msg, "largest rank error %g after merge_many is within epsilon", err);
+  ok_m(err <= 0.01, msg);
+
+  fill(other, 0, 10, 10);
+  qesk_merge(parts[1], other);
+  is_double_m(1e-12, 0.02, qesk_error_bound(parts[1]), "merges keep the larger error bound");
+
+  for (i = 0; i < 10; ++i)
+    qesk_free(parts[i]);
+  qesk_free(other);
+}
+
+static sketch_t *
+roundtrip(sketch_t *sk, size_t *len_p)
+{
+  const size_t size = qesk_serialized_size(sk);
+  unsigned char *buf = malloc(size);
+  sketch_t *copy;
+  size_t len;
+
+  len = qesk_serialize(sk, buf, size);
+  *len_p = len;
+  copy = len > 0 ? qesk_deserialize(buf, len) : NULL;
+  if (len > 0 && qesk_deserialize(buf, len - 1) != NULL)
+    fail();
+  free(buf);
+
+  return copy;
+}
+
+static void
+test_serialize()
+{
+  sketch_t *kll = qesk_new("kll", 0.01, 0);
+  sketch_t *gk = qesk_new("gk", 0.01, 0);
+  sketch_t *copy, *gkcopy;
+  size_t len;
+
+  fill(kll, 0, N/2 + 17, N);
+  fill(gk, 0, 5000, N);
+  copy = roundtrip(kll, &len);
+  ok_m(copy != NULL && strcmp(qesk_engine(copy), "kll") == 0, "kll sketches round trip");
+  ok_m(len < 10000, "and take a few KB");
+  ok_m(same_quantiles(kll, copy), "same results after deserializing");
+  fill(kll, N/2 + 17, N, N);
+  fill(copy, N/2 + 17, N, N);
+  ok_m(same_quantiles(kll, copy), "and after more updates");
+
+  gkcopy = roundtrip(gk, &len);
+  ok_m(gkcopy != NULL && strcmp(qesk_engine(gkcopy), "gk") == 0, "gk sketches round trip");
+  ok_m(same_quantiles(gk, gkcopy), "with the same results");
+  ok_m(qesk_deserialize((const unsigned char *)"QEKL garbage", 12) == NULL,
+       "garbage doesn't deserialize");
+
+  qesk_free(kll);
+  qesk_free(copy);
+  qesk_free(gk);
+  qesk_free(gkcopy);
+}
+
+int
+main ()
+{
+  test_engines();
+  test_accuracy();
+  test_update_many();
+  test_merge();
+  test_serialize();
+  done_testing();
+  return 0;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <quant_est.h>
+
+#include "mytap.h"
+
+#define N 1000000
+
+/* Values 1..n in scrambled order, so that value i has rank i */
+static double
+nth_value(int i, int n)
+{
+  return (double)(((long long)i * 7919) % n + 1);
+}
+
+static void
+fill(sketch_t *sk, int from, int to, int n)
+{
+  int i;
+
+  for (i = from; i < to; ++i)
+    qesk_update(sk, nth_value(i, n));
+}
+
+/* Largest error of the quantiles and ranks of a sketch of 1..n, as a
+ * fraction of n */
+static double
+max_error(sketch_t *sk, int n)
+{
+  double worst = 0.;
+  int i;
+
+  for (i = 0; i <= 1000; ++i) {
+    const double q = i / 1000.;
+    const double qerr = fabs(qesk_query(sk, q) - q * n) / n;
+    const double rerr = fabs(qesk_rank(sk, q * n) - floor(q * n)) / n;
+    worst = qerr > worst ? qerr : worst;
+    worst = rerr > worst ? rerr : worst;
+  }
+
+  return worst;
+}
+
+/* Largest error of the quantiles of a sketch of 1..n in the tails,
+ * as a fraction of the elements beyond the quantile */
+static double
+max_tail_error(sketch_t *sk, int n)
+{
+  static const double tails[] = {1e-2, 1e-3, 1e-4, 1e-5};
+  double worst = 0.;
+  size_t i;
+
+  for (i = 0; i < sizeof(tails) / sizeof(tails[0]); ++i) {
+    const double lo = fabs(qesk_query(sk, tails[i]) - tails[i] * n) / (tails[i] * n);
+    const double hi = fabs(qesk_query(sk, 1. - tails[i]) - (1. - tails[i]) * n) / (tails[i] * n);
+    worst = lo > worst ? lo : worst;
+    worst = hi > worst ? hi : worst;
+  }
+
+  return worst;
+}
+
+static int
+same_quantiles(sketch_t *s1, sketch_t *s2)
+{
+  int same = qesk_count(s1) == qesk_count(s2);
+  int i;
+
+  for (i = 0; i <= 100; ++i)
+    same = same && qesk_query(s1, i / 100.) == qesk_query(s2, i / 100.);
+  return same;
+}
+
+static void
+test_engine()
+{
+  sketch_t *td = qesk_new("tdigest", 0.01, 0);
+  sketch_t *kll = qesk_new("kll", 0.01, 0);
+  double out[3];
+  const double qs[3] = {0., 0.5, 1.};
+
+  ok_m(td != NULL, "qesk_new didn't (obviously) fail");
+  ok_m(qesk_new("tdigest", 1e-7, 0) == NULL, "tdigest fails for tiny epsilons");
+  ok_m(strcmp(qesk_engine(td), "tdigest") == 0, "qesk_engine names the engine");
+  ok_m(qesk_stream(td) == NULL, "no stream");
+  ok_m(isnan(qesk_query(td, 0.5)), "no data, no answer");
+
+  qesk_update(td, 5.);
+  qesk_query_many(td, qs, out, 3);
+  ok_m(out[0] == 5. && out[1] == 5. && out[2] == 5., "a single element is every quantile");
+  qesk_update(kll, 1.);
+  ok_m(qesk_merge(td, kll) != 0, "sketches of different engines don't merge");
+  ok_m(qesk_merge(td, td) != 0, "a sketch doesn't merge into itself");
+
+  qesk_free(td);
+  qesk_free(kll);
+}
+
+static void
+test_accuracy()
+{
+  sketch_t *td = qesk_new("tdigest", 0.01, 0);
+  sketch_t *gk = qesk_new("gk", 0.01, N);
+  sketch_t *sorted = qesk_new("tdigest", 0.01, 0);
+  double err;
+  char msg[128];
+  int i;
+
+  fill(td, 0, N, N);
+  fill(gk, 0, N, N);
+  is_int_m(N, (int)qesk_count(td), "count");
+  err = max_error(td, N);
+  sprintf(msg, "largest rank error %g is within epsilon", err);
+  ok_m(err <= 0.01, msg);
+  err = max_tail_error(td, N);
+  sprintf(msg, "largest error in the tails %g is within 1%% of the tail", err);
+  ok_m(err <= 0.01, msg);
+  ok_m(qesk_query(td, 0.) == 1. && qesk_query(td, 1.) == (double)N,
+       "the extremes are exact");
+  ok_m(qesk_rank(td, 0.5) == 0. && qesk_rank(td, (double)N) == (double)N,
+       "and so are the ranks beyond them");
+  sprintf(msg, "tdigest takes %lu bytes, gk %lu",
+          (unsigned long)qesk_memory_usage(td), (unsigned long)qesk_memory_usage(gk));
+  ok_m(qesk_memory_usage(td) < qesk_memory_usage(gk), msg);
+
+  for (i = 1; i <= N; ++i)
+    qesk_update(sorted, (double)i);
+  err = max_tail_error(sorted, N);
+  sprintf(msg, "same for sorted input: %g", err);
+  ok_m(err <= 0.01, msg);
+
+  qesk_free(td);
+  qesk_free(gk);
+  qesk_free(sorted);
+}
+
+/* Exponentially distributed values, from the scrambled ranks */
+static void
+test_skewed()
+{
+  sketch_t *td = qesk_new("tdigest", 0.01, 0);
+  static const double qs[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+  double worst = 0., out[5];
+  char msg[128];
+  size_t i;
+
+  for (i = 0; i < N; ++i)
+    qesk_update(td, -log(1. - (nth_value((int)i, N) - 0.5) / N));
+  qesk_query_many(td, qs, out, 5);
+  for (i = 0; i < 5; ++i) {
+    const double expected = -log(1. - qs[i]);
+    const double err = fabs(out[i] - expected) / expected;
+    worst = err > worst ? err : worst;
+  }
+  sprintf(msg, "largest relative error %g of latency-like quantiles is within 1%%", worst);
+  ok_m(worst <= 0.01, msg);
+
+  qesk_free(td);
+}
+
+static void
+test_update_many()
+{
+  sketch_t *s1 = qesk_new("tdigest", 0.005, 0);
+  sketch_t *s2 = qesk_new("tdigest", 0.005, 0);
+  double *vals = malloc(N * sizeof(double));
+  int i;
+
+  for (i = 0; i < N; ++i)
+    vals[i] = nth_value(i, N);
+  fill(s1, 0, N, N);
+  for (i = 0; i < N; i += 777)
+    qesk_update_many(s2, vals + i, i + 777 <= N ? 777 : (size_t)(N - i));
+  ok_m(same_quantiles(s1, s2), "update_many gives the same results as update");
+
+  free(vals);
+  qesk_free(s1);
+  qesk_free(s2);
+}
+
+/* The sort scratch is twice the buffer (8 / epsilon elements), so an
+ * idle digest doesn't allocate it until the buffer is first flushed */
+static void
+test_idle_memory()
+{
+  sketch_t *td = qesk_new("tdigest", 0.001, 0);
+  size_t idle, flushed;
+  char msg[128];
+
+  fill(td, 0, 100, 100);
+  idle = qesk_memory_usage(td);
+  sprintf(msg, "idle digest holds %lu bytes", (unsigned long)idle);
+  ok_m(idle < 100000, msg);
+  fill(td, 0, 20000, 20000);
+  flushed = qesk_memory_usage(td);
+  sprintf(msg, "flushed digest holds %lu bytes", (unsigned long)flushed);
+  ok_m(flushed > idle + 8000 * 2 * sizeof(uint64_t), msg);
+  ok_m(qesk_query(td, 0.5) > 9000. && qesk_query(td, 0.5) < 11000.,
+       "flushed digest still answers");
+
+  qesk_free(td);
+}
+
+static sketch_t *
+roundtrip(sketch_t *sk, size_t *len_p)
+{
+  const size_t size = qesk_serialized_size(sk);
+  unsigned char *buf = malloc(size);
+  sketch_t *copy;
+  size_t len;
+
+  len = qesk_serialize(sk, buf, size);
+  *len_p = len;
+  copy = len > 0 ? qesk_deserialize(buf, len) : NULL;
+  if (len > 0 && qesk_deserialize(buf, len - 1) != NULL)
+    fail();
+  free(buf);
+
+  return copy;
+}
+
+static void
+test_merge()
+{
+  sketch_t *parts[10];
+  sketch_t *other = qesk_new("tdigest", 0.02, 0);
+  sketch_t *copy;
+  double err;
+  char msg[128];
+  size_t len;
+  int i;
+
+  for (i = 0; i < 10; ++i) {
+    parts[i] = qesk_new("tdigest", 0.01, 0);
+    fill(parts[i], i * (N/10), (i+1) * (N/10), N);
+  }
+  ok_m(qesk_merge_many(parts, 10, 4) == 0, "merge_many didn't (obviously) fail");
+  is_int_m(N, (int)qesk_count(parts[0]), "count after merge_many");
+  is_int_m(N/10, (int)qesk_count(parts[1]), "the others are left alone");
+  err = max_error(parts[0], N);
+  sprintf(msg, "largest rank error %g after merge_many is within epsilon", err);
+  ok_m(err <= 0.01, msg);
+  err = max_tail_error(parts[0], N);
+  sprintf(msg, "largest error in the tails %g is within 1%% of the tail", err);
+  ok_m(err <= 0.01, msg);
+  copy = roundtrip(parts[0], &len);
+  ok_m(copy != NULL && same_quantiles(parts[0], copy), "the merged digest round trips");
+  qesk_free(copy);
+
+  fill(other, 0, 10, 10);
+  qesk_merge(parts[1], other);
+  is_double_m(1e-12, 0.02, qesk_error_bound(parts[1]), "merges keep the larger error bound");
+
+  for (i = 0; i < 10; ++i)
+    qesk_free(parts[i]);
+  qesk_free(other);
+}
+
+static void
+test_serialize()
+{
+  sketch_t *td = qesk_new("tdigest", 0.01, 0);
+  sketch_t *empty = qesk_new("tdigest", 0.01, 0);
+  sketch_t *copy;
+  size_t len;
+
+  fill(td, 0, N/2 + 17, N);
+  copy = roundtrip(td, &len);
+  ok_m(copy != NULL && strcmp(qesk_engine(copy), "tdigest") == 0, "digests round trip");
+  ok_m(len < 10000, "and take a few KB");
+  ok_m(same_quantiles(td, copy), "same results after deserializing");
+  fill(td, N/2 + 17, N, N);
+  fill(copy, N/2 + 17, N, N);
+  ok_m(same_quantiles(td, copy), "and after more updates");
+  qesk_free(copy);
+
+  copy = roundtrip(empty, &len);
+  ok_m(copy != NULL && qesk_count(copy) == 0, "empty digests round trip");
+  ok_m(qesk_deserialize((const unsigned char *)"QETD garbage", 12) == NULL,
+       "garbage doesn't deserialize");
+
+  qesk_free(td);
+  qesk_free(empty);
+  qesk_free(copy);
+}
+
+int
+main ()
+{
+  test_engine();
+  test_accuracy();
+  test_skewed();
+  test_update_many();
+  test_idle_memory();
+  test_merge();
+  test_serialize();
+  done_testing();
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include <quant_est.h>
+
+/* Microbenchmark, not part of the test suite: update throughput for
+ * block sizes b from 100 to 1,000,000 (or the first argument).
+ * Packing up a full level 0 prunes it once per level it's carried
+ * through, so with an O(len) prune the cost per element must stay
+ * flat (up to the log(b) of the sort and cache effects) as b grows. */
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+int
+main (int argc, char **argv)
+{
+  const double max_b = argc > 1 ? atof(argv[1]) : 1e6;
+  double b;
+  double *vals;
+  const size_t nvals = 1 << 20;
+  size_t i;
+
+  vals = malloc(nvals * sizeof(double));
+  srand(42);
+  for (i = 0; i < nvals; ++i)
+    vals[i] = (double)rand() / RAND_MAX;
+
+  printf("%10s %12s %12s %10s\n", "b", "epsilon", "n", "ns/elem");
+  for (b = 100; b <= max_b; b *= 10) {
+    /* b = log(epsilon*n)/epsilon, solved for epsilon with epsilon*n = 100 */
+    const double epsilon = log(100.) / b;
+    const int n = (int)ceil(100. / epsilon);
+    /* Enough data for a deep cascade even for the largest b */
+    const size_t total = (size_t)(32 * b) > nvals * 8 ? (size_t)(32 * b) : nvals * 8;
+    stream_t *s = gkstr_new(epsilon, n);
+    size_t done;
+    double t0, t1;
+
+    if (s == NULL) {
+      printf("gkstr_new failed for b=%g\n", b);
+      return 1;
+    }
+
+    t0 = now();
+    for (done = 0; done < total; done += nvals)
+      gkstr_update_many(s, vals, total - done < nvals ? total - done : nvals);
+    t1 = now();
+
+    printf("%10.0f %12g %12i %10.2f\n", b, epsilon, n, 1e9 * (t1 - t0) / (double)total);
+    gkstr_free(s);
+  }
+
+  free(vals);
+  return 0;
+}
+
@@ -14,6 +14,58 @@ our @ISA = qw(Exporter);
 our @EXPORT_OK = qw();
 our %EXPORT_TAGS = ('all' => \@EXPORT_OK);
 
+sub new {
+  my $class = shift;
+  croak("Odd number of arguments to ${class}->new") if @_ % 2;
+  my %args = @_;
+
+  my $epsilon = delete $args{epsilon};
+  my $n = delete $args{n};
+  my $engine = delete $args{engine};
+  croak("Unknown arguments to ${class}->new: " . join(', ', sort keys %args))
+    if keys %args;
+  croak("Need an 'epsilon' between 0 and 1")
+    if not defined $epsilon or $epsilon <= 0 or $epsilon >= 1;
+  croak("'n' needs to be positive if given")
+    if defined $n and $n <= 0;
+
+  return $class->_new(defined($engine) ? $engine : 'gk', $epsilon, defined($n) ? $n : 0);
+}
+
+sub STORABLE_freeze {
+  my ($self, $cloning) = @_;
+  return $self->to_bytes;
+}
+
+# Sereal, with freeze_callbacks enabled
+sub FREEZE {
+  my ($self, $serializer) = @_;
+  return $self->to_bytes;
+}
+
+sub THAW {
+  my ($class, $serializer, $bytes) = @_;
+  return $class->from_bytes($bytes);
+}
+
+sub add_piddle {
+  my ($self, $pdl) = @_;
+
+  require PDL::Types;
+  my $type = $pdl->get_datatype;
+  $pdl->make_physical;
+  if ($type == $PDL::Types::PDL_D) {
+    $self->add_packed($pdl->get_dataref);
+  }
+  elsif ($type == $PDL::Types::PDL_F) {
+    $self->add_packed_float($pdl->get_dataref);
+  }
+  else {
+    croak("Can only add piddles of type double or float, got " . $pdl->type);
+  }
+  return;
+}
+
 1;
 __END__
 
@@ -25,13 +77,210 @@ Math::QuantileEstimate - Online calculation of quantiles with low memory overhea
 
   use Math::QuantileEstimate;
 
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.001);
+  $qe->add(@latencies);
+  $qe->add_packed(pack('d*', @more_latencies));
+
+  my $median = $qe->quantile(0.5);
+  my ($p99, $p999) = $qe->quantiles(0.99, 0.999);
+  my $frac_fast = ($qe->cdf(0.25))[0];
+
 =head1 DESCRIPTION
 
+Estimates quantiles of a stream of numbers in a single pass, using
+memory that grows only logarithmically with the length of the stream.
+The answers are approximate: a quantile query for C<q> returns a value
+whose rank in the stream is within C<epsilon*N> of C<q*N>, where C<N> is
+the number of values added so far. Until a few thousand values (for
+typical choices of C<epsilon>) have been added, the estimator keeps them
+all, and the answers are exact.
+
+The work is done by one of several sketch engines, picked per estimator
+with the C<engine> argument of C<new>, so that the one that fits a
+metric best can be used without changing the code that feeds and
+queries it.
+
 =head1 METHODS
 
 =head2 C<new>
 
-Constructor.
+Constructor. Takes named arguments:
+
+=over 2
+
+=item C<epsilon>
+
+The maximum rank error as a fraction of the number of values.
+Required.
+
+=item C<n>
+
+The expected number of values. If given, it must be larger than
+C<e/epsilon>. Memory use is tuned to it. The estimator still works if
+more values are added, but its error bound no longer holds. If not
+given, the estimator adapts to any number of values, at the cost of
+some more memory. Only used by the C<gk> engine.
+
+=item C<engine>
+
+The sketch behind the estimator:
+
+=over 2
+
+=item C<gk> (the default)
+
+The multi-level Greenwald-Khanna summary of Zhang and Wang. The rank
+error is guaranteed to be within C<epsilon>.
+
+=item C<kll>
+
+The KLL sketch of Karnin, Lang and Liberty. It takes a fraction of the
+memory and adds values a bit faster, but its rank error is only within
+C<epsilon> with high probability (99%).
+
+=item C<tdigest>
+
+The merging t-digest of Dunning and Ertl, for metrics whose far tails
+matter most, like the p99.9 and p99.99 of latencies. The closer a
+quantile is to 0 or 1, the more accurate it is: near the quantile C<q>,
+the rank error is about C<epsilon*min(q, 1-q)>, and the extremes are
+exact. In the middle of the distribution it's typically well below
+C<epsilon>. None of that is guaranteed, though: the values between the
+centroids it keeps are interpolated. It takes memory in
+C<log(N)/epsilon>.
+
+=back
+
+Estimators of different engines can't be merged.
+
+=back
+
+=head2 C<add>
+
+Adds all of its arguments to the estimator.
+
+=head2 C<add_packed>
+
+Adds the values from a string of native doubles as created by
+C<pack('d*', ...)>. The string buffer is used as is, without creating
+any Perl scalars or copies, so this is the fastest way to add values.
+That also works for strings mapped from binary files with
+L<File::Map> or similar. Also takes a reference to such a string.
+
+=head2 C<add_packed_float>
+
+Like C<add_packed>, but for a string of native floats as created by
+C<pack('f*', ...)>.
+
+=head2 C<add_piddle>
+
+Adds all values of a L<PDL> piddle of type double or float, reading
+them straight from its data buffer.
+
+=head2 C<start_background>
+
+Moves the compaction of the internal buffers, which otherwise happens
+every few thousand values in the middle of an C<add>, to a background
+thread. Adding values then takes about the same time for every value,
+which is good for the tail latency of instrumented code. All other
+methods first wait for the thread to catch up. Croaks if the thread
+can't be started, eg. on systems without threads, and for engines other
+than C<gk>, which have nothing to move.
+
+=head2 C<count>
+
+The number of values added so far.
+
+=head2 C<engine>
+
+The name of the engine, see C<new>.
+
+=head2 C<memory_usage>
+
+The number of bytes of memory the estimator holds, for comparing
+engines and settings.
+
+=head2 C<merge>
+
+Given another estimator, adds everything it has seen to this one, as if
+its values had been added here, too. The other estimator is left alone.
+Estimators created with the same C<epsilon> and C<n> merge without any
+loss. Merging others is a bit less compact, and the error bound becomes
+the larger of the two, see C<error_bound>. Once an estimator has taken
+in a lot of those, the ones merged after that are compressed, to keep
+its memory in check, and their error bound grows by this one's
+C<epsilon>. Croaks if the engines differ.
+
+=head2 C<merge_many>
+
+  $qe->merge_many(\@others, $nthreads);
+
+Merges all estimators in the array into this one. This is done as a
+balanced tree of merges, and the merges of each level of the tree run
+on up to C<$nthreads> threads (default 1). The result is the same for
+any number of threads. Estimators that are compressed while merging
+(see C<merge>) can be at every level of the tree, and each of those
+levels adds C<epsilon> to the error bound. Unlike with C<merge>, the other estimators
+are used as scratch space: they end up holding parts of the tree and
+shouldn't be used afterwards, except for freeing them.
+
+=head2 C<error_bound>
+
+The guaranteed maximum rank error, as a fraction of the number of
+values. That's C<epsilon>, unless estimators with a larger one were
+merged in, or were compressed while merging, see C<merge>. For the C<tdigest> engine, which guarantees nothing, it's
+just that C<epsilon>.
+
+=head2 C<quantile>
+
+Given a quantile between 0 and 1, returns the estimated value at that
+quantile. Returns NaN if no values have been added.
+
+=head2 C<quantiles>
+
+Like C<quantile>, but takes a list of quantiles and returns a list of
+values. Fastest with the quantiles in ascending order.
+
+=head2 C<rank>
+
+Given a value, returns the estimated number of added values less than
+or equal to it.
+
+=head2 C<cdf>
+
+Takes a list of values and returns, for each of them, the estimated
+fraction of added values less than or equal to it.
+
+=head2 C<to_bytes>
+
+Returns the complete state of the estimator as a compact binary string,
+so that it can be stored or sent elsewhere and picked up again with
+C<from_bytes>. The format is versioned and portable across platforms.
+It is described in F<quant_est.c>. Croaks if the estimator can't be
+serialized, which would be a bug.
+
+=head2 C<from_bytes>
+
+Class method. Recreates an estimator from the output of C<to_bytes>.
+The result takes more values and answers queries just like the
+original. Croaks on invalid input.
+
+=head2 C<cpu_variant>
+
+Class method. Returns which of the CPU specific variants of the
+internal number crunching is in use: C<avx512>, C<avx2>, C<sse2> or
+C<generic>. The best one the CPU supports is picked when the module is
+loaded, so the same build can be deployed to different machines.
+The variants only differ in speed: they all round the same way, so
+estimators (and what C<to_bytes> makes of them) come out bit for bit
+the same on any of them.
+
+=head1 SERIALIZATION
+
+Besides C<to_bytes> and C<from_bytes>, estimators have the hooks that
+L<Storable> (C<STORABLE_freeze> and C<STORABLE_thaw>) and L<Sereal>
+(C<FREEZE> and C<THAW>, with the encoder's C<freeze_callbacks> option)
+look for, and use the same format with them.
 
 =head1 SEE ALSO
 
@@ -39,6 +288,14 @@ The algorithm implemented here is following:
 Qi Zhang and Wei Wang, "A Fast Algorithm for Approximate Quantiles in High Speed Data Streams",
 19th International Conference on Scientific and Statistical Database Management (SSDBM 2007)
 
+The C<kll> engine:
+Zohar Karnin, Kevin Lang and Edo Liberty, "Optimal Quantile Approximation in Streams",
+IEEE 57th Annual Symposium on Foundations of Computer Science (FOCS 2016)
+
+The C<tdigest> engine:
+Ted Dunning and Otmar Ertl, "Computing Extremely Accurate Quantiles Using t-Digests",
+arXiv:1902.04023 (2019)
+
 Other algorithms (with different space/time trade-off):
 Michael Greenwald and Sanjeev Khanna, "Space-Efﬁcient Online Computation of Quantile Summaries",
 at SIGMOD (2001), p. 58-66.
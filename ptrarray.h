@@ -87,14 +87,14 @@ QE_STATIC_INLINE void ptrarray_truncate(ptrarray_t *stack, size_t newlen);
 QE_STATIC_INLINE ptrarray_t *
 ptrarray_make(const unsigned int initsize, unsigned int flags_)
 {
-  ptrarray_t *stack = (ptrarray_t *)malloc(sizeof(ptrarray_t));
+  ptrarray_t *stack = (ptrarray_t *)QE_MALLOC(sizeof(ptrarray_t));
   if (stack == NULL)
     return NULL;
 
   stack->size = (initsize == 0 ? 16 : initsize);
   stack->nextpos = 0;
   stack->flags = flags_;
-  stack->data = malloc(sizeof(void *) * stack->size);
+  stack->data = QE_MALLOC(sizeof(void *) * stack->size);
 
   return stack;
 }
@@ -106,11 +106,11 @@ ptrarray_free(ptrarray_t *stack)
     unsigned int i;
     const unsigned int n = stack->nextpos;
     for (i = 1; i <= n; ++i)
-      free(stack->data[n-i]);
+      QE_FREE(stack->data[n-i]);
   }
   
-  free(stack->data);
-  free(stack);
+  QE_FREE(stack->data);
+  QE_FREE(stack);
 }
 
 static int
@@ -122,7 +122,7 @@ ptrarray_grow(ptrarray_t *stack, unsigned int nelems)
                           : nelems) + 5 /* some static growth for avoiding lots
                                          * of reallocs on very small arrays */
                       ) * PTRARRAY_GROWTH_FACTOR);
-  stack->data = realloc(stack->data, sizeof(void *) * newsize);
+  stack->data = QE_REALLOC(stack->data, sizeof(void *) * newsize);
   if (stack->data == NULL)
     return 1; /* OOM */
   stack->size = newsize;
@@ -188,7 +188,7 @@ ptrarray_truncate(ptrarray_t *stack, size_t newlen)
 
   if (stack->flags & PTRARRAYf_FREE_ELEMS) {
     for (i = newlen; i < n; ++i) {
-      free(stack->data[i]);
+      QE_FREE(stack->data[i]);
     }
   }
 
@@ -229,7 +229,7 @@ ptrarray_compact(ptrarray_t *stack)
 {
   const unsigned int minsize = stack->nextpos + 1;
   if (stack->size > minsize) {
-    stack->data = realloc(stack->data, sizeof(void *) * minsize);
+    stack->data = QE_REALLOC(stack->data, sizeof(void *) * minsize);
     stack->size = minsize;
   }
 }
@@ -9,6 +9,15 @@
 
 #define QE_STATIC_INLINE static QEINLINE
 
+/* For kernels that the CPU specific variants in quant_est.c compile
+ * their own copies of. Also in DEBUG builds, which would otherwise call
+ * the one copy built for the baseline from every variant. */
+#if defined(__GNUC__)
+#   define QE_ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#   define QE_ALWAYS_INLINE QE_STATIC_INLINE
+#endif
+
 #ifndef STMT_START
 #   define STMT_START	do
 #endif
@@ -16,4 +25,36 @@
 #   define STMT_END	while (0)
 #endif
 
+/* All heap traffic of the library goes through these. Debug builds count
+ * the calls so that the tests can check that steady-state updates don't
+ * touch the allocator. */
+#if DEBUG
+extern unsigned long qe_nalloc_calls;
+/* gkstr_merge_many allocates from several threads */
+#   if defined(__GNUC__)
+#     define QE_COUNT_ALLOC  __sync_fetch_and_add(&qe_nalloc_calls, 1)
+#   else
+#     define QE_COUNT_ALLOC  ++qe_nalloc_calls
+#   endif
+#   define QE_MALLOC(n)      (QE_COUNT_ALLOC, malloc(n))
+#   define QE_CALLOC(n, s)   (QE_COUNT_ALLOC, calloc((n), (s)))
+#   define QE_REALLOC(p, n)  (QE_COUNT_ALLOC, realloc((p), (n)))
+#   define QE_FREE(p)        (QE_COUNT_ALLOC, free(p))
+#else
+#   define QE_MALLOC(n)      malloc(n)
+#   define QE_CALLOC(n, s)   calloc((n), (s))
+#   define QE_REALLOC(p, n)  realloc((p), (n))
+#   define QE_FREE(p)        free(p)
+#endif
+
+/* Pointer sized atomics for the lock-free queue of the sharded front-end */
+#if defined(__GNUC__)
+#   define QE_ATOMIC_CAS_PTR(p, old, new) \
+      __atomic_compare_exchange_n((p), &(old), (new), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#   define QE_ATOMIC_XCHG_PTR(p, new)     __atomic_exchange_n((p), (new), __ATOMIC_ACQUIRE)
+#   define QE_ATOMIC_LOAD_PTR(p)          __atomic_load_n((p), __ATOMIC_RELAXED)
+#elif !defined(QE_NO_THREADS)
+#   error "Need GCC style atomics for threads, or define QE_NO_THREADS"
+#endif
+
 #endif
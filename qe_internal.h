@@ -0,0 +1,383 @@
+#ifndef QE_INTERNAL_H_
+#define QE_INTERNAL_H_
+
+/* What the quant_est*.c files share, and nothing outside of them uses:
+ * the summary and stream structs and the functions on them that more
+ * than one subsystem calls. quant_est.h has the API. */
+
+#include "quant_est.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <math.h>
+
+#ifndef QE_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "qe_defs.h"
+#include "ptrarray.h"
+
+/* Per-tuple counts. g and delta of a tuple are bounded by about
+ * 2*epsilon*N, so 32 bits go a long way even when the stream's own
+ * counts (qe_count_t) don't fit: with epsilon = 0.001, up to 2^41
+ * elements. The exception are runs of equal values, whose last tuple
+ * takes the g of the whole run: a run that doesn't fit is spread over
+ * as many tuples with the same value as it takes. Define
+ * QE_WIDE_TUPLE_COUNTS for 64-bit tuple counts, at 24 instead of 16
+ * bytes per tuple. */
+#ifdef QE_WIDE_TUPLE_COUNTS
+typedef uint64_t qe_tuple_count_t;
+# define QE_TUPLE_COUNT_MAX UINT64_MAX
+#else
+typedef uint32_t qe_tuple_count_t;
+# define QE_TUPLE_COUNT_MAX UINT32_MAX
+#endif
+
+/* A summary is stored as one array per tuple field, all three carved out
+ * of a single allocation owned by the summary. Tuple i is
+ * (v[i], g[i], delta[i]) in the usual GK notation:
+ *   rmin(i) = g[0] + ... + g[i]
+ *   rmax(i) = rmin(i) + delta[i] */
+typedef struct {
+  double *v;
+  qe_tuple_count_t *g;
+  qe_tuple_count_t *delta;
+  size_t len;  /* N tuples in use */
+  size_t size; /* N tuples allocated */
+} gksummary_t;
+
+/* Bytes per allocated tuple */
+#define QE_TUPLE_BYTES (sizeof(double) + 2 * sizeof(qe_tuple_count_t))
+
+typedef ptrarray_t summaries_t;
+
+#ifndef QE_NO_THREADS
+typedef struct qe_published_struct qe_published_t;
+#endif
+
+/* The parts of a stream that only come into play once it's queried or
+ * packed up in the background. A stream only allocates them then, see
+ * gkstr_aux, so that the many streams of a registry that never get
+ * there stay small. */
+typedef struct {
+  /* Queries are answered from a snapshot built by gkstream_finish.
+   * snapshots[k] holds levels k and up merged (including the finished
+   * partitions), so snapshots[0] is the summary of the whole stream. */
+  summaries_t *snapshots;
+  /* rmin of every tuple in snapshots[0], for binary searching by rank */
+  qe_count_t *snapshot_rmin;
+  size_t snapshot_rmin_size; /* N entries allocated */
+#ifndef QE_NO_THREADS
+  /* Background compaction, see gkstr_start_background. Full level 0
+   * blocks are swapped with the spare buffer, and the worker packs the
+   * spare up the levels. The lock covers pending and bg_error; while
+   * pending is set, the worker owns the spare, the stream's carry,
+   * merged, sort scratch and all levels above 0. */
+  int background;
+  pthread_t bg_thread;
+  pthread_mutex_t bg_lock;
+  pthread_cond_t bg_work; /* pending was set, or the worker should stop */
+  pthread_cond_t bg_idle; /* pending was cleared */
+  int pending;
+  int bg_stop;
+  int bg_error;
+  gksummary_t spare;
+#endif
+} gkstr_aux_t;
+
+struct stream_struct {
+  gksummary_t level0; /* the unsorted buffer of the latest elements */
+  /* Array of gksummary_t pointers, one per level, with &level0 first.
+   * Only made once the stream first needs a level above 0, see
+   * gkstr_level and gkstr_reserve_levels. */
+  summaries_t *summaries;
+  /* Scratch space for packing up level 0, reused across updates:
+   * carry is the compressed summary on its way up the levels, merged
+   * holds a level merged with the carry before it's pruned again. */
+  gksummary_t carry;
+  gksummary_t merged;
+  uint64_t *sort_scratch; /* keys for sorting level 0, see gkstr_reserve_scratch */
+  size_t sort_scratch_size; /* N values it can sort */
+  double epsilon;
+  double error; /* guaranteed rank error, as a fraction of count */
+  qe_count_t n;     /* expected number of elements; b is derived from it */
+  qe_count_t count; /* number of elements seen so far */
+  size_t b; /* block size */
+  /* Streams of unknown length are cut into partitions of growing size,
+   * each of which gets the levels treatment with n = its own size. See
+   * gkstr_new_unbounded. */
+  int unbounded;
+  qe_count_t partition_end; /* count at which the current partition is done */
+  gksummary_t done;         /* the finished partitions, compressed and merged */
+  /* Only the levels below dirty_level have been left alone since the
+   * last gkstream_finish, so the snapshots above it can be reused. */
+  size_t dirty_level;
+  qe_count_t snapshot_count; /* number of elements in snapshots[0] */
+  /* Until the first block is packed, level 0 has all the elements, and
+   * gkstream_finish just sorts it in place instead. Queries then read
+   * the first snapshot_count values of level 0 (if it still has all the
+   * elements), with exact ranks. */
+  int exact;
+  gkstr_aux_t *aux; /* NULL until first needed, see gkstr_aux */
+#ifndef QE_NO_THREADS
+  /* Snapshots for lock-free readers, set up by the first gkstr_publish */
+  qe_published_t *published;
+#endif
+};
+
+
+/**************************************************
+ * CPU specific kernels
+ **************************************************/
+
+/* The kernels of the variant for this CPU, picked when the library is
+ * loaded. Defined in quant_est.c. */
+typedef struct {
+  const char *name;
+  /* qe_sort_doubles, for level 0 */
+  void (*sort_doubles)(double *vals, size_t n, uint64_t *scratch);
+  /* qe_find_run, for gks_merge_values */
+  size_t (*find_run)(const double *v, size_t from, size_t n);
+  /* qe_sum_doubles, for the centroids of the t-digest */
+  double (*sum_doubles)(const double *v, size_t n);
+  /* qe_scan_counts and qe_scan_doubles, for the rank scans of the
+   * batch queries */
+  size_t (*scan_counts)(const qe_count_t *a, size_t from, size_t n, qe_count_t r);
+  size_t (*scan_doubles)(const double *v, size_t from, size_t n, double x);
+} qe_kernels_t;
+
+extern qe_kernels_t qe_kernels;
+
+
+/**************************************************
+ * gksummary_t functions
+ **************************************************/
+
+/* Defined in quant_est.c, which documents them. Those returning int
+ * return non-zero on OOM. */
+int gks_init(gksummary_t *gk, size_t nprealloc);
+void gks_destroy(gksummary_t *gk);
+void gks_sort_values(gksummary_t *gk, uint64_t *scratch);
+int gks_prune(gksummary_t *gk, int b, gksummary_t *resgk);
+
+/* Exchange the contents (including the buffers) of two summaries */
+QE_STATIC_INLINE void
+gks_swap(gksummary_t *gk1, gksummary_t *gk2)
+{
+  const gksummary_t tmp = *gk1;
+  *gk1 = *gk2;
+  *gk2 = tmp;
+}
+
+/* N tuples in summary */
+QE_STATIC_INLINE size_t
+gks_len(gksummary_t *gk)
+{
+  return gk->len;
+}
+
+QE_STATIC_INLINE void
+gks_clear(gksummary_t *gk)
+{
+  gk->len = 0;
+}
+
+
+/**************************************************
+ * stream_t functions
+ **************************************************/
+
+/* Defined in quant_est.c, same as above. gkstr_setup and
+ * gkstr_setup_unbounded set up a zeroed out stream_t, and gkstr_destroy
+ * frees what it owns, but not the stream_t itself. */
+int gkstr_setup(stream_t *stream, double epsilon, qe_count_t n);
+int gkstr_setup_unbounded(stream_t *stream, double epsilon);
+void gkstr_destroy(stream_t *stream);
+int gkstr_carry_up(stream_t *stream, size_t k);
+#ifndef QE_NO_THREADS
+/* Defined in quant_est_publish.c */
+void gkstr_free_published(stream_t *stream);
+#endif
+
+/* Number of target ranks when pruning a summary above level 0 */
+QE_STATIC_INLINE size_t
+gkstr_prune_size(stream_t *stream)
+{
+  return (stream->b+1)/2+1;
+}
+
+/* Max. number of tuples in a summary pruned to prune_size, see gks_prune */
+QE_STATIC_INLINE size_t
+gkstr_level_size(stream_t *stream)
+{
+  return 2 * gkstr_prune_size(stream) + 1;
+}
+
+
+/**************************************************
+ * Queries
+ **************************************************/
+
+/* Everything the queries need from a finished summary: the tuples'
+ * values and deltas, their rmin, and the number of elements. Queries on
+ * streams and on published snapshots both go through this. Exact views
+ * of small streams only have the sorted values, and rmin and delta are
+ * NULL: there, rmin(i) = i+1 and delta(i) = 0. Views of weighted samples
+ * (the KLL sketch) have rmin but no delta: rmin(i) is the weight of the
+ * values up to and including v[i]. */
+typedef struct {
+  const double *v;
+  const qe_tuple_count_t *delta;
+  const qe_count_t *rmin;
+  size_t ntuples;
+  qe_count_t count;
+} qe_view_t;
+
+/* Defined in quant_est.c */
+int gkstream_view(stream_t *s, qe_view_t *view);
+double qe_view_query(const qe_view_t *view, double q);
+void qe_view_query_many(const qe_view_t *view, const double *qs, double *out, size_t k);
+double qe_view_rank(const qe_view_t *view, double x);
+void qe_view_cdf_many(const qe_view_t *view, const double *xs, double *out, size_t k);
+
+/* Number of entries in the ascending array v that are <= x */
+QE_STATIC_INLINE size_t
+gkstream_value_upper_bound(const double *v, size_t n, double x)
+{
+  const double *base = v;
+
+  if (n == 0)
+    return 0;
+
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = base[half] <= x ? base + half : base;
+    n -= half;
+  }
+
+  return (size_t)(base - v) + (*base <= x);
+}
+
+QE_STATIC_INLINE void
+qe_fill_nan(double *out, size_t k)
+{
+  size_t i;
+
+  for (i = 0; i < k; ++i)
+    out[i] = NAN;
+}
+
+
+
+/**************************************************
+ * Serialization
+ **************************************************/
+
+/* Longest varint of a 64-bit number */
+#define QE_VARINT_MAX 10
+
+QE_STATIC_INLINE unsigned char *
+qe_put_varint(unsigned char *p, uint64_t x)
+{
+  while (x >= 0x80) {
+    *p++ = (unsigned char)(x | 0x80);
+    x >>= 7;
+  }
+  *p++ = (unsigned char)x;
+  return p;
+}
+
+QE_STATIC_INLINE unsigned char *
+qe_put_f64(unsigned char *p, double d)
+{
+  uint64_t u;
+  int i;
+
+  memcpy(&u, &d, sizeof(u));
+  for (i = 0; i < 8; ++i)
+    *p++ = (unsigned char)(u >> (8 * i));
+  return p;
+}
+
+/* Reading side: a cursor into the buffer that turns into NULL on
+ * running past the end or on malformed input */
+typedef struct {
+  const unsigned char *p;
+  const unsigned char *end;
+} qe_reader_t;
+
+QE_STATIC_INLINE uint64_t
+qe_get_varint(qe_reader_t *r)
+{
+  uint64_t x = 0;
+  unsigned int shift = 0;
+
+  while (r->p != NULL) {
+    unsigned char c;
+    if (r->p == r->end || shift > 63) {
+      r->p = NULL;
+      break;
+    }
+    c = *r->p++;
+    x |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return x;
+    shift += 7;
+  }
+
+  return 0;
+}
+
+QE_STATIC_INLINE double
+qe_get_f64(qe_reader_t *r)
+{
+  uint64_t u = 0;
+  double d;
+  int i;
+
+  if (r->p == NULL || r->end - r->p < 8) {
+    r->p = NULL;
+    return 0.;
+  }
+  for (i = 0; i < 8; ++i)
+    u |= (uint64_t)*r->p++ << (8 * i);
+  memcpy(&d, &u, sizeof(d));
+  return d;
+}
+
+
+/**************************************************
+ * Sketch engines
+ **************************************************/
+
+/* A sketch forwards everything to its engine, which works on its own
+ * struct. finish brings what the queries read up to date, and has to be
+ * cheap if it already is. deserialize gets the whole buffer, which
+ * starts with the engine's magic. */
+typedef struct {
+  const char *name;
+  const char *magic;
+  void * (*create)(double epsilon, qe_count_t n);
+  void (*destroy)(void *impl);
+  int (*update)(void *impl, double e);
+  int (*update_many)(void *impl, const double *vals, size_t n);
+  int (*merge)(void *dst, void *src);
+  qe_count_t (*count)(void *impl);
+  double (*error_bound)(void *impl);
+  int (*finish)(void *impl);
+  void (*query_many)(void *impl, const double *qs, double *out, size_t k);
+  double (*rank)(void *impl, double x);
+  void (*cdf_many)(void *impl, const double *xs, double *out, size_t k);
+  size_t (*serialized_size)(void *impl);
+  size_t (*serialize)(void *impl, unsigned char *buf, size_t size);
+  void * (*deserialize)(const unsigned char *buf, size_t len);
+  size_t (*memory_usage)(void *impl);
+} qe_engine_t;
+
+/* Defined in quant_est_kll.c */
+extern const qe_engine_t qe_engine_kll;
+/* Defined in quant_est_tdigest.c */
+extern const qe_engine_t qe_engine_tdigest;
+
+#endif
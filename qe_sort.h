@@ -0,0 +1,132 @@
+#ifndef QE_SORT_H_
+#define QE_SORT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "qe_defs.h"
+
+/* Sorting of plain arrays of doubles, as used for packing up level 0.
+ * Large arrays are LSD radix sorted on the IEEE-754 bit patterns, small
+ * ones get an insertion sort. All API functions are static. */
+
+/* Below this many elements, insertion sort beats the radix sort's
+ * fixed cost of clearing and scanning the histograms. */
+#ifndef QE_SORT_INSERTION_MAX
+# define QE_SORT_INSERTION_MAX 64
+#endif
+
+#define QE_SORT_RADIX_BITS 8
+#define QE_SORT_RADIX_BUCKETS (1 << QE_SORT_RADIX_BITS)
+#define QE_SORT_RADIX_PASSES (64 / QE_SORT_RADIX_BITS)
+
+/****************************
+ * API
+ */
+
+/* Sorts n doubles ascending. scratch must have room for 2*n uint64_t.
+ * NaNs end up at either end, depending on their sign bit. */
+QE_ALWAYS_INLINE void qe_sort_doubles(double *vals, size_t n, uint64_t *scratch);
+
+/***************************
+ * Implementation
+ */
+
+/* Map a double to an unsigned int with the same ordering: flip all bits
+ * of negative numbers, only the sign bit of positive ones. */
+QE_ALWAYS_INLINE uint64_t
+qe_sort_double_to_key(double d)
+{
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  return u ^ ((uint64_t)((int64_t)u >> 63) | ((uint64_t)1 << 63));
+}
+
+QE_ALWAYS_INLINE double
+qe_sort_key_to_double(uint64_t u)
+{
+  double d;
+  u ^= ((u >> 63) - 1) | ((uint64_t)1 << 63);
+  memcpy(&d, &u, sizeof(d));
+  return d;
+}
+
+/* Compares the keys rather than the doubles, so that NaNs (and -0.)
+ * end up where the radix sort puts them */
+QE_ALWAYS_INLINE void
+qe_sort_insertion(double *vals, size_t n)
+{
+  size_t i, j;
+
+  for (i = 1; i < n; ++i) {
+    const double v = vals[i];
+    const uint64_t key = qe_sort_double_to_key(v);
+    for (j = i; j > 0 && qe_sort_double_to_key(vals[j-1]) > key; --j)
+      vals[j] = vals[j-1];
+    vals[j] = v;
+  }
+}
+
+QE_ALWAYS_INLINE void
+qe_sort_doubles(double *vals, size_t n, uint64_t *scratch)
+{
+  size_t counts[QE_SORT_RADIX_PASSES][QE_SORT_RADIX_BUCKETS];
+  uint64_t *src = scratch;
+  uint64_t *dst = scratch + n;
+  size_t i;
+  unsigned int pass;
+
+  if (n <= QE_SORT_INSERTION_MAX) {
+    qe_sort_insertion(vals, n);
+    return;
+  }
+
+  /* Already sorted input (eg. timestamps, replayed sorted dumps) is
+   * cheap to detect, and random input bails out of this right away */
+  for (i = 1; i < n && vals[i-1] <= vals[i]; ++i)
+    ;
+  if (i == n)
+    return;
+
+  /* One pass to build the keys and the histograms for all digits */
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n; ++i) {
+    const uint64_t key = qe_sort_double_to_key(vals[i]);
+    src[i] = key;
+    for (pass = 0; pass < QE_SORT_RADIX_PASSES; ++pass)
+      ++counts[pass][(key >> (pass * QE_SORT_RADIX_BITS)) & (QE_SORT_RADIX_BUCKETS-1)];
+  }
+
+  for (pass = 0; pass < QE_SORT_RADIX_PASSES; ++pass) {
+    size_t *c = counts[pass];
+    const unsigned int shift = pass * QE_SORT_RADIX_BITS;
+    size_t sum = 0;
+    unsigned int d;
+
+    /* All keys share this digit (very common for the exponent bytes
+     * and the low mantissa bytes of quantized data): nothing to do */
+    if (c[(src[0] >> shift) & (QE_SORT_RADIX_BUCKETS-1)] == n)
+      continue;
+
+    for (d = 0; d < QE_SORT_RADIX_BUCKETS; ++d) {
+      const size_t tmp = c[d];
+      c[d] = sum;
+      sum += tmp;
+    }
+
+    for (i = 0; i < n; ++i) {
+      const uint64_t key = src[i];
+      dst[c[(key >> shift) & (QE_SORT_RADIX_BUCKETS-1)]++] = key;
+    }
+
+    {
+      uint64_t *tmp = src;
+      src = dst;
+      dst = tmp;
+    }
+  }
+
+  for (i = 0; i < n; ++i)
+    vals[i] = qe_sort_key_to_double(src[i]);
+}
+
+#endif
@@ -1,473 +1,2697 @@
-#include "quant_est.h"
-#include <stdlib.h>
+#include "qe_internal.h"
 #include <stdio.h>
-#include <string.h>
 
-#include <math.h>
+#include "qe_sort.h"
 
-#include "qe_defs.h"
-#include "ptrarray.h"
+#if DEBUG
+unsigned long qe_nalloc_calls = 0;
 
+unsigned long
+gkstr_debug_nalloc_calls(void)
+{
+  return qe_nalloc_calls;
+}
+#endif
+
+
+/**************************************************
+ * CPU specific kernels
+ **************************************************/
+
+/* The kernels that gain from wider vector units are compiled once per
+ * instruction set from the same source, and the best one the CPU has
+ * is picked when the library is loaded, so a single binary runs
+ * everywhere. Only GCC style compilers on x86 get the variants. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(QE_NO_DISPATCH)
+#   define QE_DISPATCH 1
+#endif
+
+#if defined(__SSE2__)
+#   define QE_BASELINE_VARIANT "sse2"
+#else
+#   define QE_BASELINE_VARIANT "generic"
+#endif
+
+/* The first i >= from where v[i], v[i+1] and v[i+2] are equal, or n if
+ * there's none */
+QE_ALWAYS_INLINE size_t
+qe_find_run(const double *v, size_t from, size_t n)
+{
+  size_t i;
+
+  for (i = from; i + 2 < n; ++i) {
+    if (v[i] == v[i+1] && v[i+1] == v[i+2])
+      return i;
+  }
+
+  return n;
+}
+
+/* The first i >= from with a[i] > r in the ascending array a, or n:
+ * where a scan for rank r stops in the rmin of a summary */
+QE_ALWAYS_INLINE size_t
+qe_scan_counts(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+  while (from < n && a[from] <= r)
+    ++from;
+
+  return from;
+}
+
+/* The first i >= from with v[i] > x in the ascending array v, or n */
+QE_ALWAYS_INLINE size_t
+qe_scan_doubles(const double *v, size_t from, size_t n, double x)
+{
+  while (from < n && v[from] <= x)
+    ++from;
+
+  return from;
+}
+
+/* The sum of the n values, added up in four interleaved lanes that are
+ * combined as (a0 + a1) + (a2 + a3) at the end. The vector versions keep
+ * exactly this order, four lanes whatever their width, so that every
+ * variant rounds the same way and the t-digest doesn't depend on the
+ * CPU it ran on. */
+QE_ALWAYS_INLINE double
+qe_sum_doubles(const double *v, size_t n)
+{
+  double a0 = 0., a1 = 0., a2 = 0., a3 = 0., sum;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    a0 += v[i];
+    a1 += v[i+1];
+    a2 += v[i+2];
+    a3 += v[i+3];
+  }
+  sum = (a0 + a1) + (a2 + a3);
+  for (; i < n; ++i)
+    sum += v[i];
+
+  return sum;
+}
+
+#ifdef QE_DISPATCH
+/* Most positions in a sorted summary don't start a run of three, so the
+ * vector versions test blocks of 8 positions for any run at once, and
+ * leave finding it in the block to qe_find_run. They differ in the
+ * vector width only. */
+typedef double qe_v2d_t __attribute__((vector_size(16)));
+typedef long long qe_v2i_t __attribute__((vector_size(16)));
+typedef double qe_v4d_t __attribute__((vector_size(32)));
+typedef long long qe_v4i_t __attribute__((vector_size(32)));
+
+QE_ALWAYS_INLINE size_t
+qe_find_run_v2(const double *v, size_t from, size_t n)
+{
+  size_t i;
+
+  for (i = from; i + 10 <= n; i += 8) {
+    qe_v2i_t any = {0, 0};
+    qe_v2d_t a, b, c;
+    size_t k;
+    for (k = 0; k < 8; k += 2) {
+      memcpy(&a, v + i + k, sizeof(a));
+      memcpy(&b, v + i + k + 1, sizeof(b));
+      memcpy(&c, v + i + k + 2, sizeof(c));
+      any |= (a == b) & (b == c);
+    }
+    if (any[0] | any[1])
+      break;
+  }
+
+  return qe_find_run(v, i, n);
+}
+
+QE_ALWAYS_INLINE size_t
+qe_find_run_v4(const double *v, size_t from, size_t n)
+{
+  size_t i;
+
+  for (i = from; i + 10 <= n; i += 8) {
+    qe_v4i_t any = {0, 0, 0, 0};
+    qe_v4d_t a, b, c;
+    size_t k;
+    for (k = 0; k < 8; k += 4) {
+      memcpy(&a, v + i + k, sizeof(a));
+      memcpy(&b, v + i + k + 1, sizeof(b));
+      memcpy(&c, v + i + k + 2, sizeof(c));
+      any |= (a == b) & (b == c);
+    }
+    if (any[0] | any[1] | any[2] | any[3])
+      break;
+  }
+
+  return qe_find_run(v, i, n);
+}
+
+/* The scans skip blocks of 8 entries that are all <= the target at once.
+ * Counts are compared as signed, which they fit into, as SSE4.2 and
+ * AVX2 only have the signed 64-bit compare. */
+QE_ALWAYS_INLINE size_t
+qe_scan_counts_v2(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+  const qe_v2i_t rr = {(long long)r, (long long)r};
+  size_t i;
+
+  for (i = from; i + 8 <= n; i += 8) {
+    qe_v2i_t any = {0, 0}, x;
+    size_t k;
+    for (k = 0; k < 8; k += 2) {
+      memcpy(&x, a + i + k, sizeof(x));
+      any |= x > rr;
+    }
+    if (any[0] | any[1])
+      break;
+  }
+
+  return qe_scan_counts(a, i, n, r);
+}
+
+QE_ALWAYS_INLINE size_t
+qe_scan_counts_v4(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+  const qe_v4i_t rr = {(long long)r, (long long)r, (long long)r, (long long)r};
+  size_t i;
+
+  for (i = from; i + 8 <= n; i += 8) {
+    qe_v4i_t any = {0, 0, 0, 0}, x;
+    size_t k;
+    for (k = 0; k < 8; k += 4) {
+      memcpy(&x, a + i + k, sizeof(x));
+      any |= x > rr;
+    }
+    if (any[0] | any[1] | any[2] | any[3])
+      break;
+  }
+
+  return qe_scan_counts(a, i, n, r);
+}
+
+QE_ALWAYS_INLINE size_t
+qe_scan_doubles_v2(const double *v, size_t from, size_t n, double x)
+{
+  const qe_v2d_t xx = {x, x};
+  size_t i;
+
+  for (i = from; i + 8 <= n; i += 8) {
+    qe_v2i_t any = {0, 0};
+    qe_v2d_t a;
+    size_t k;
+    for (k = 0; k < 8; k += 2) {
+      memcpy(&a, v + i + k, sizeof(a));
+      any |= a > xx;
+    }
+    if (any[0] | any[1])
+      break;
+  }
+
+  return qe_scan_doubles(v, i, n, x);
+}
+
+QE_ALWAYS_INLINE size_t
+qe_scan_doubles_v4(const double *v, size_t from, size_t n, double x)
+{
+  const qe_v4d_t xx = {x, x, x, x};
+  size_t i;
+
+  for (i = from; i + 8 <= n; i += 8) {
+    qe_v4i_t any = {0, 0, 0, 0};
+    qe_v4d_t a;
+    size_t k;
+    for (k = 0; k < 8; k += 4) {
+      memcpy(&a, v + i + k, sizeof(a));
+      any |= a > xx;
+    }
+    if (any[0] | any[1] | any[2] | any[3])
+      break;
+  }
+
+  return qe_scan_doubles(v, i, n, x);
+}
+
+QE_ALWAYS_INLINE double
+qe_sum_doubles_v2(const double *v, size_t n)
+{
+  qe_v2d_t lo = {0., 0.}, hi = {0., 0.}, a, b;
+  double sum;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    memcpy(&a, v + i, sizeof(a));
+    memcpy(&b, v + i + 2, sizeof(b));
+    lo += a;
+    hi += b;
+  }
+  sum = (lo[0] + lo[1]) + (hi[0] + hi[1]);
+  for (; i < n; ++i)
+    sum += v[i];
+
+  return sum;
+}
+
+QE_ALWAYS_INLINE double
+qe_sum_doubles_v4(const double *v, size_t n)
+{
+  qe_v4d_t acc = {0., 0., 0., 0.}, a;
+  double sum;
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    memcpy(&a, v + i, sizeof(a));
+    acc += a;
+  }
+  sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  for (; i < n; ++i)
+    sum += v[i];
+
+  return sum;
+}
+#endif
+
+static void
+qe_sort_doubles_baseline(double *vals, size_t n, uint64_t *scratch)
+{
+  qe_sort_doubles(vals, n, scratch);
+}
+
+static size_t
+qe_find_run_baseline(const double *v, size_t from, size_t n)
+{
+#ifdef QE_DISPATCH
+  return qe_find_run_v2(v, from, n);
+#else
+  return qe_find_run(v, from, n);
+#endif
+}
+
+static double
+qe_sum_doubles_baseline(const double *v, size_t n)
+{
+#ifdef QE_DISPATCH
+  return qe_sum_doubles_v2(v, n);
+#else
+  return qe_sum_doubles(v, n);
+#endif
+}
+
+static size_t
+qe_scan_counts_baseline(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+#ifdef QE_DISPATCH
+  return qe_scan_counts_v2(a, from, n, r);
+#else
+  return qe_scan_counts(a, from, n, r);
+#endif
+}
+
+static size_t
+qe_scan_doubles_baseline(const double *v, size_t from, size_t n, double x)
+{
+#ifdef QE_DISPATCH
+  return qe_scan_doubles_v2(v, from, n, x);
+#else
+  return qe_scan_doubles(v, from, n, x);
+#endif
+}
+
+qe_kernels_t qe_kernels = {
+  QE_BASELINE_VARIANT,
+  qe_sort_doubles_baseline,
+  qe_find_run_baseline,
+  qe_sum_doubles_baseline,
+  qe_scan_counts_baseline,
+  qe_scan_doubles_baseline
+};
+
+#ifdef QE_DISPATCH
+__attribute__((target("avx2")))
+static void
+qe_sort_doubles_avx2(double *vals, size_t n, uint64_t *scratch)
+{
+  qe_sort_doubles(vals, n, scratch);
+}
+
+__attribute__((target("avx2")))
+static size_t
+qe_find_run_avx2(const double *v, size_t from, size_t n)
+{
+  return qe_find_run_v4(v, from, n);
+}
+
+__attribute__((target("avx2")))
+static double
+qe_sum_doubles_avx2(const double *v, size_t n)
+{
+  return qe_sum_doubles_v4(v, n);
+}
+
+__attribute__((target("avx2")))
+static size_t
+qe_scan_counts_avx2(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+  return qe_scan_counts_v4(a, from, n, r);
+}
+
+__attribute__((target("avx2")))
+static size_t
+qe_scan_doubles_avx2(const double *v, size_t from, size_t n, double x)
+{
+  return qe_scan_doubles_v4(v, from, n, x);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl")))
+static void
+qe_sort_doubles_avx512(double *vals, size_t n, uint64_t *scratch)
+{
+  qe_sort_doubles(vals, n, scratch);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl")))
+static size_t
+qe_find_run_avx512(const double *v, size_t from, size_t n)
+{
+  return qe_find_run_v4(v, from, n);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl")))
+static double
+qe_sum_doubles_avx512(const double *v, size_t n)
+{
+  return qe_sum_doubles_v4(v, n);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl")))
+static size_t
+qe_scan_counts_avx512(const qe_count_t *a, size_t from, size_t n, qe_count_t r)
+{
+  return qe_scan_counts_v4(a, from, n, r);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl")))
+static size_t
+qe_scan_doubles_avx512(const double *v, size_t from, size_t n, double x)
+{
+  return qe_scan_doubles_v4(v, from, n, x);
+}
+
+__attribute__((constructor))
+static void
+qe_kernels_init(void)
+{
+  /* constructors may run before the compiler sets up __builtin_cpu_supports */
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+      && __builtin_cpu_supports("avx512vl"))
+  {
+    qe_kernels.name = "avx512";
+    qe_kernels.sort_doubles = qe_sort_doubles_avx512;
+    qe_kernels.find_run = qe_find_run_avx512;
+    qe_kernels.sum_doubles = qe_sum_doubles_avx512;
+    qe_kernels.scan_counts = qe_scan_counts_avx512;
+    qe_kernels.scan_doubles = qe_scan_doubles_avx512;
+  }
+  else if (__builtin_cpu_supports("avx2")) {
+    qe_kernels.name = "avx2";
+    qe_kernels.sort_doubles = qe_sort_doubles_avx2;
+    qe_kernels.find_run = qe_find_run_avx2;
+    qe_kernels.sum_doubles = qe_sum_doubles_avx2;
+    qe_kernels.scan_counts = qe_scan_counts_avx2;
+    qe_kernels.scan_doubles = qe_scan_doubles_avx2;
+  }
+}
+#endif
+
+const char *
+gkstr_cpu_variant(void)
+{
+  return qe_kernels.name;
+}
+
+
+/**************************************************
+ * gksummary_t functions
+ **************************************************/
+
+/* Make sure the summary has room for at least n tuples.
+ * Returns non-zero on OOM. */
+static int
+gks_reserve(gksummary_t *gk, size_t n)
+{
+  char *block;
+  double *v;
+  qe_tuple_count_t *g;
+  qe_tuple_count_t *delta;
+
+  if (n <= gk->size)
+    return 0;
+
+  block = QE_MALLOC(n * QE_TUPLE_BYTES);
+  if (block == NULL)
+    return 1;
+  v = (double *)block;
+  g = (qe_tuple_count_t *)(v + n);
+  delta = g + n;
+
+  if (gk->len != 0) {
+    memcpy(v, gk->v, gk->len * sizeof(double));
+    memcpy(g, gk->g, gk->len * sizeof(qe_tuple_count_t));
+    memcpy(delta, gk->delta, gk->len * sizeof(qe_tuple_count_t));
+  }
+  QE_FREE(gk->v); /* the base of the old block */
+
+  gk->v = v;
+  gk->g = g;
+  gk->delta = delta;
+  gk->size = n;
+  return 0;
+}
+
+/* Set up a summary that lives inside some other struct. With
+ * nprealloc == 0, nothing gets allocated until the first tuple. */
+int
+gks_init(gksummary_t *gk, size_t nprealloc)
+{
+  gk->v = NULL;
+  gk->g = NULL;
+  gk->delta = NULL;
+  gk->len = 0;
+  gk->size = 0;
+
+  return gks_reserve(gk, nprealloc);
+}
+
+void
+gks_destroy(gksummary_t *gk)
+{
+  QE_FREE(gk->v);
+}
+
+QE_STATIC_INLINE gksummary_t *
+gks_new(size_t nprealloc)
+{
+  gksummary_t *gk = QE_MALLOC(sizeof(gksummary_t));
+  if (gk == NULL)
+    return NULL;
+
+  if (gks_init(gk, nprealloc)) {
+    QE_FREE(gk);
+    return NULL;
+  }
+
+  return gk;
+}
+
+QE_STATIC_INLINE void
+gks_free(gksummary_t *gk)
+{
+  gks_destroy(gk);
+  QE_FREE(gk);
+}
+
+/* N items that the summary represents */
+QE_STATIC_INLINE qe_count_t
+gks_size(gksummary_t *gk)
+{
+  size_t i;
+  qe_count_t n = 0;
+  const size_t l = gks_len(gk);
+  const qe_tuple_count_t *g = gk->g;
+
+  for (i = 0; i < l; ++i)
+    n += g[i];
+
+  return n;
+}
+
+/* Replace the contents of dst with a copy of src.
+ * Returns non-zero on OOM. */
+QE_STATIC_INLINE int
+gks_copy(gksummary_t *dst, gksummary_t *src)
+{
+  const size_t n = gks_len(src);
+
+  gks_clear(dst);
+  if (n == 0)
+    return 0;
+  if (gks_reserve(dst, n))
+    return 1;
+  memcpy(dst->v, src->v, n * sizeof(double));
+  memcpy(dst->g, src->g, n * sizeof(qe_tuple_count_t));
+  memcpy(dst->delta, src->delta, n * sizeof(qe_tuple_count_t));
+  dst->len = n;
+  return 0;
+}
+
+/* Append a tuple, growing the summary geometrically if necessary.
+ * Returns non-zero on OOM. */
+QE_STATIC_INLINE int
+gks_push(gksummary_t *gk, double v, qe_tuple_count_t g, qe_tuple_count_t delta)
+{
+  const size_t i = gk->len;
+
+  if (i == gk->size && gks_reserve(gk, (size_t)(i * PTRARRAY_GROWTH_FACTOR) + 5))
+    return 1;
+
+  gk->v[i] = v;
+  gk->g[i] = g;
+  gk->delta[i] = delta;
+  gk->len = i + 1;
+  return 0;
+}
+
+/* Runs of equal values are kept as (at most) two tuples: the first one
+ * of the run, and the last one, which takes over the g of everything in
+ * between. Keeping just the last one would be enough for quantile
+ * queries, but then nothing tells a long run of equal values apart from
+ * many different values just below it, and rank queries for values
+ * just below the run would be off by up to the length of the run. */
+
+/* Turns a block of raw values (only v[] is filled in) into an exact
+ * summary: sorted values, each with g = 1 and delta = 0, except that
+ * runs of equal values are collapsed to two tuples on the way (as
+ * gks_merge_values would do).
+ * scratch needs room for twice as many keys as there are values. */
+void
+gks_sort_values(gksummary_t *gk, uint64_t *scratch)
+{
+  size_t src;
+  size_t run_start = 0;
+  size_t dst = 0;
+  const size_t n = gks_len(gk);
+  double *v = gk->v;
+  qe_tuple_count_t *g = gk->g;
+  qe_tuple_count_t *delta = gk->delta;
+
+  if (n == 0)
+    return;
+
+  qe_kernels.sort_doubles(v, n, scratch);
+
+  /* dst never overtakes src: a run of length 1 makes one tuple, any
+   * longer run two */
+  for (src = 1; src <= n; ++src) {
+    const double run_v = v[run_start];
+
+    if (src < n && v[src] == run_v)
+      continue;
+
+    v[dst] = run_v;
+    g[dst] = 1;
+    delta[dst] = 0;
+    ++dst;
+    if (src - run_start > 1) {
+      v[dst] = run_v;
+      g[dst] = (qe_tuple_count_t)(src - run_start - 1);
+      delta[dst] = 0;
+      ++dst;
+    }
+    run_start = src;
+  }
+
+  gk->len = dst;
+}
+
+/* reduces the number of elements but doesn't lose precision.
+ * Algorithm "value merging" in Appendix A of
+ * "Power-Conserving Computation of Order-Statistics over Sensor Networks" (Greenwald, Khanna 2004)
+ * http://www.cis.upenn.edu/~mbgreen/papers/pods04.pdf
+ * Of a run of equal values, the first and the last tuple are kept, and
+ * the g of the dropped ones is added to the last one, as far as that
+ * fits into a tuple count.
+ * Tuple src is dropped iff src-2, src-1 and src are equal. So after a
+ * while without dropping any, the find_run kernel looks for the next
+ * such run in blocks, and everything up to it moves down in one go. */
+QE_STATIC_INLINE void
+gks_merge_values(gksummary_t *gk)
+{
+  size_t src;
+  size_t dst = 0;
+  size_t kept = 0; /* tuples kept in a row */
+  double *v = gk->v;
+  qe_tuple_count_t *g = gk->g;
+  qe_tuple_count_t *delta = gk->delta;
+  const size_t n = gks_len(gk);
+
+  if (n == 0)
+    return;
+
+  for (src = 1; src < n; ++src) {
+    if (v[dst] == v[src] && dst > 0 && v[dst-1] == v[src]
+        && g[src] <= QE_TUPLE_COUNT_MAX - g[dst]) {
+      /* already have both ends of the run: this is the new last one,
+       * unless its g would overflow, then it's kept as another one */
+      g[dst] += g[src];
+      delta[dst] = delta[src];
+      kept = 0;
+      continue;
+    }
+
+    if (++kept == 8) {
+      /* Tuples src and up are kept up to the second one of the next run
+       * of three, which can start at src-1 at the earliest */
+      const size_t run = qe_kernels.find_run(v, src - 1, n);
+      const size_t stop = run < n ? run + 2 : n;
+      if (dst + 1 != src) {
+        memmove(v + dst + 1, v + src, (stop - src) * sizeof(double));
+        memmove(g + dst + 1, g + src, (stop - src) * sizeof(qe_tuple_count_t));
+        memmove(delta + dst + 1, delta + src, (stop - src) * sizeof(qe_tuple_count_t));
+      }
+      dst += stop - src;
+      src = stop - 1;
+      kept = 0;
+      continue;
+    }
+
+    ++dst;
+    v[dst] = v[src];
+    g[dst] = g[src];
+    delta[dst] = delta[src];
+  }
+
+  gk->len = dst + 1;
+}
+
+/* Appends tuple j of gk, which has the given rmin, to resgk, which ends
+ * with tuple *last of gk at rmin *last_rmin, and makes it the last one.
+ * If the g that takes doesn't fit into a tuple count (long runs of equal
+ * values), as many of the tuples in between are kept, too, as it takes
+ * to bridge the gap: each of their own g's fits. Returns non-zero on OOM. */
+QE_STATIC_INLINE int
+gks_prune_keep(gksummary_t *resgk, gksummary_t *gk, size_t j, qe_count_t rmin,
+               size_t *last, qe_count_t *last_rmin)
+{
+  while (rmin - *last_rmin > QE_TUPLE_COUNT_MAX) {
+    /* the furthest tuple still in reach, at least the next one */
+    size_t k = *last + 1;
+    qe_count_t k_rmin = *last_rmin + gk->g[k];
+    while (k + 1 < j && k_rmin + gk->g[k+1] - *last_rmin <= QE_TUPLE_COUNT_MAX)
+      k_rmin += gk->g[++k];
+    if (gks_push(resgk, gk->v[k], (qe_tuple_count_t)(k_rmin - *last_rmin), gk->delta[k]))
+      return 1;
+    *last = k;
+    *last_rmin = k_rmin;
+  }
+
+  if (gks_push(resgk, gk->v[j], (qe_tuple_count_t)(rmin - *last_rmin), gk->delta[j]))
+    return 1;
+  *last = j;
+  *last_rmin = rmin;
+  return 0;
+}
+
+/* From http://www.mathcs.emory.edu/~cheung/Courses/584-StreamDB/Syllabus/08-Quantile/Greenwald-D.html "Prune"
+ * Keeps the first tuple and the tuples that best approximate ranks
+ * i*N/b for i in 1..b. The g of every kept tuple is recomputed so that
+ * rmin and rmax of each kept tuple are preserved. If a kept tuple is
+ * the end of a run of equal values, the start of the run is kept, too.
+ * The target ranks only ever grow, so a single pass over the input
+ * tuples serves all of them: O(len + b).
+ * Writes at most 2b+1 tuples to resgk (b+1 plus the starts of runs),
+ * and more only for runs too long for a single tuple's g, replacing its
+ * previous contents. Returns non-zero on OOM. */
+int
+gks_prune(gksummary_t *gk, int b, gksummary_t *resgk)
+{
+  const size_t input_n_tuples = gks_len(gk);
+  const double *v = gk->v;
+  const qe_tuple_count_t *g = gk->g;
+  const qe_tuple_count_t *delta = gk->delta;
+  size_t gk_idx = 0;
+  qe_count_t gk_rmin;
+  size_t res_idx = 0; /* the tuple of gk that's last in resgk */
+  qe_count_t res_rmin; /* and its rmin */
+  qe_count_t size;
+  double size_per_b;
+  size_t i;
+
+  gks_clear(resgk);
+  if (input_n_tuples == 0)
+    return 0;
+
+  if (gks_reserve(resgk, 2 * (size_t)b + 1))
+    return 1;
+
+  /* Few enough tuples already (typical for heavily quantized data):
+   * keeping all of them is both cheaper and more precise */
+  if (input_n_tuples <= (size_t)b + 1) {
+    memcpy(resgk->v, v, input_n_tuples * sizeof(double));
+    memcpy(resgk->g, g, input_n_tuples * sizeof(qe_tuple_count_t));
+    memcpy(resgk->delta, delta, input_n_tuples * sizeof(qe_tuple_count_t));
+    resgk->len = input_n_tuples;
+    return 0;
+  }
+
+  size = gks_size(gk);
+  size_per_b = (double)size / (double)b;
+
+  /* resgk is preallocated to the right size, so pushing can't fail
+   * unless runs need more tuples, see gks_prune_keep */
+  gk_rmin = res_rmin = g[0];
+  gks_push(resgk, v[0], g[0], delta[0]);
+
+  for (i = 1; i <= (size_t)b; ++i) {
+    /* the last rank exactly, rounding mustn't lose the maximum */
+    const qe_count_t rank = i == (size_t)b ? size : (qe_count_t)(size_per_b * (double)i);
+    size_t res_last;
+
+    /* find an element of rank 'rank' in gk: the last one with rmin <= rank */
+    while (gk_idx < input_n_tuples-1 && gk_rmin + g[gk_idx+1] <= rank) {
+      ++gk_idx;
+      gk_rmin += g[gk_idx];
+    }
+
+    if (gk_rmin == res_rmin)
+      continue; /* that very tuple is kept already */
+
+    if (v[gk_idx-1] == v[gk_idx] && resgk->v[resgk->len - 1] != v[gk_idx]) {
+      /* end of a run whose start isn't kept yet */
+      if (gks_prune_keep(resgk, gk, gk_idx - 1, gk_rmin - g[gk_idx], &res_idx, &res_rmin))
+        return 1;
+    }
+
+    res_last = resgk->len - 1;
+    if (resgk->v[res_last] == v[gk_idx] && res_last > 0 && resgk->v[res_last-1] == v[gk_idx]
+        && gk_rmin - res_rmin <= QE_TUPLE_COUNT_MAX - resgk->g[res_last])
+    {
+      /* Already have both ends of this run: move the last one up */
+      resgk->g[res_last] += (qe_tuple_count_t)(gk_rmin - res_rmin);
+      resgk->delta[res_last] = delta[gk_idx];
+      res_idx = gk_idx;
+      res_rmin = gk_rmin;
+    }
+    else if (gks_prune_keep(resgk, gk, gk_idx, gk_rmin, &res_idx, &res_rmin)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* This is the Merge algorithm from
+ * http://www.cs.ubc.ca/~xujian/paper/quant.pdf .  It is much simpler than the
+ * MERGE algorithm at
+ * http://www.mathcs.emory.edu/~cheung/Courses/584-StreamDB/Syllabus/08-Quantile/Greenwald-D.html
+ * or "COMBINE" in http://www.cis.upenn.edu/~mbgreen/papers/chapter.pdf
+ * "Quantiles and Equidepth Histograms over Streams" (Greenwald, Khanna 2005)
+ *
+ * In (g, delta) form: the merged tuple for x keeps g(x), since its rmin
+ * is rmin1(x) + rmin2(y) with y the last tuple taken from the other
+ * summary. Its rmax is rmax1(x) + rmax2(z) - 1 with z the next tuple of
+ * the other summary, which makes delta(x) + g(z) + delta(z) - 1. If y
+ * has the same value as x, x can just as well go right after y, and
+ * rmax1(x) + rmax2(y) is a bound, too: delta(x) + delta(y). That's the
+ * one to use when z is the end of a run of x's value too long for the
+ * first bound to fit into a tuple count. */
+/* Writes the merged summary to smerge, replacing its previous contents.
+ * The inputs are left alone. Returns non-zero on OOM.
+ * This isn't among the qe_kernels: it's 15-18% of the update time of
+ * unbounded streams, each step depends on the one before, and neither a
+ * branchless version nor one built for AVX2 ran any faster. */
+QE_STATIC_INLINE int
+gks_merge(gksummary_t *s1, gksummary_t *s2, gksummary_t *smerge)
+{
+  size_t i1 = 0;
+  size_t i2 = 0;
+  size_t o = 0;
+  int ties = 0;
+  const size_t n1 = gks_len(s1);
+  const size_t n2 = gks_len(s2);
+  const double *v1 = s1->v, *v2 = s2->v;
+  const qe_tuple_count_t *g1 = s1->g, *g2 = s2->g;
+  const qe_tuple_count_t *d1 = s1->delta, *d2 = s2->delta;
+  double *v;
+  qe_tuple_count_t *g, *delta;
+
+  gks_clear(smerge);
+  if (gks_reserve(smerge, n1 + n2))
+    return 1;
+  v = smerge->v;
+  g = smerge->g;
+  delta = smerge->delta;
+
+  while (i1 < n1 && i2 < n2) {
+    qe_count_t d;
+    if (v1[i1] <= v2[i2]) {
+      ties |= v1[i1] == v2[i2];
+      v[o] = v1[i1];
+      g[o] = g1[i1];
+      d = (qe_count_t)d1[i1] + g2[i2] + d2[i2] - 1;
+      if (d > QE_TUPLE_COUNT_MAX && i2 > 0 && v2[i2-1] == v1[i1])
+        d = (qe_count_t)d1[i1] + d2[i2-1];
+      ++i1;
+    }
+    else {
+      v[o] = v2[i2];
+      g[o] = g2[i2];
+      d = (qe_count_t)d2[i2] + g1[i1] + d1[i1] - 1;
+      if (d > QE_TUPLE_COUNT_MAX && i1 > 0 && v1[i1-1] == v2[i2])
+        d = (qe_count_t)d2[i2] + d1[i1-1];
+      ++i2;
+    }
+    delta[o] = (qe_tuple_count_t)d;
+    ++o;
+  }
+
+  /* Past the end of the other summary, rmax2(z) is just its size, and
+   * so is the rmin2(y) that's already accounted for in the g's. */
+  if (i1 < n1) {
+    memcpy(v + o, v1 + i1, (n1 - i1) * sizeof(double));
+    memcpy(g + o, g1 + i1, (n1 - i1) * sizeof(qe_tuple_count_t));
+    memcpy(delta + o, d1 + i1, (n1 - i1) * sizeof(qe_tuple_count_t));
+    o += n1 - i1;
+  }
+  if (i2 < n2) {
+    memcpy(v + o, v2 + i2, (n2 - i2) * sizeof(double));
+    memcpy(g + o, g2 + i2, (n2 - i2) * sizeof(qe_tuple_count_t));
+    memcpy(delta + o, d2 + i2, (n2 - i2) * sizeof(qe_tuple_count_t));
+    o += n2 - i2;
+  }
+  smerge->len = o;
+
+  /* all done
+   * The merged list might have duplicate elements -- merge them. Both
+   * inputs have runs of at most two tuples already, so that's only
+   * needed if a value is in both, and then the first tuple with it was
+   * taken from s1 while s2 was at the same value. */
+  if (ties)
+    gks_merge_values(smerge);
+
+  return 0;
+}
+
+
+/**************************************************
+ * stream_t functions
+ **************************************************/
+
+/* Number of levels, level 0 included */
+QE_STATIC_INLINE size_t
+gkstr_nlevels(stream_t *stream)
+{
+  return stream->summaries != NULL ? ptrarray_nelems(stream->summaries) : 1;
+}
+
+/* Level k < gkstr_nlevels(stream) */
+QE_STATIC_INLINE gksummary_t *
+gkstr_level(stream_t *stream, size_t k)
+{
+  if (stream->summaries == NULL)
+    return &stream->level0;
+  return (gksummary_t *)ptrarray_data_pointer(stream->summaries)[k];
+}
+
+/* Make the array of levels, for a stream that's about to get levels
+ * above 0. Returns non-zero on OOM. */
+static int
+gkstr_reserve_levels(stream_t *stream)
+{
+  if (stream->summaries != NULL)
+    return 0;
+  stream->summaries = ptrarray_make(4, 0);
+  if (stream->summaries == NULL)
+    return 1;
+  if (ptrarray_push(stream->summaries, &stream->level0)) {
+    ptrarray_free(stream->summaries);
+    stream->summaries = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+/* The state of the stream that only queries and background packing
+ * need, allocated on first use. Returns NULL on OOM. */
+static gkstr_aux_t *
+gkstr_aux(stream_t *stream)
+{
+  if (stream->aux == NULL)
+    stream->aux = (gkstr_aux_t *)QE_CALLOC(1, sizeof(gkstr_aux_t));
+  return stream->aux;
+}
+
+/* Whether full level 0 blocks are packed up by a worker thread */
+QE_STATIC_INLINE int
+gkstr_has_background(stream_t *stream)
+{
+#ifndef QE_NO_THREADS
+  return stream->aux != NULL && stream->aux->background;
+#else
+  (void)stream;
+  return 0;
+#endif
+}
+
+static void gkstr_stop_background(stream_t *stream);
+
+/* Frees everything the stream owns, but not the stream_t itself */
+void
+gkstr_destroy(stream_t *stream)
+{
+  size_t i;
+  gksummary_t **t;
+
+  gkstr_stop_background(stream);
+#ifndef QE_NO_THREADS
+  gkstr_free_published(stream);
+#endif
+
+  if (stream->summaries != NULL) {
+    const size_t n = ptrarray_nelems(stream->summaries);
+    t = (gksummary_t **)ptrarray_data_pointer(stream->summaries);
+    /* level 0 is part of the stream */
+    for (i = 1; i < n; ++i)
+      gks_free(t[i]);
+    ptrarray_free(stream->summaries);
+  }
+
+  if (stream->aux != NULL) {
+    gkstr_aux_t *aux = stream->aux;
+    if (aux->snapshots != NULL) {
+      const size_t nsnap = ptrarray_nelems(aux->snapshots);
+      t = (gksummary_t **)ptrarray_data_pointer(aux->snapshots);
+      for (i = 0; i < nsnap; ++i)
+        gks_free(t[i]);
+      ptrarray_free(aux->snapshots);
+    }
+    QE_FREE(aux->snapshot_rmin);
+    QE_FREE(aux);
+  }
+
+  gks_destroy(&stream->level0);
+  gks_destroy(&stream->carry);
+  gks_destroy(&stream->merged);
+  gks_destroy(&stream->done);
+  QE_FREE(stream->sort_scratch);
+}
+
+void
+gkstr_free(stream_t *stream)
+{
+  gkstr_destroy(stream);
+  QE_FREE(stream);
+}
+
+/* Make sure the sort scratch space can sort n values.
+ * Returns non-zero on OOM. */
+static int
+gkstr_reserve_scratch(stream_t *stream, size_t n)
+{
+  uint64_t *scratch;
+
+  if (n <= stream->sort_scratch_size)
+    return 0;
+  scratch = QE_REALLOC(stream->sort_scratch, 2 * n * sizeof(uint64_t));
+  if (scratch == NULL)
+    return 1;
+  stream->sort_scratch = scratch;
+  stream->sort_scratch_size = n;
+  return 0;
+}
+
+/* Make sure everything the packing of a full level 0 needs is there:
+ * the sort scratch space, and the scratch summaries at the size of the
+ * levels, so that packing doesn't need to allocate once the stream has
+ * all its levels. Returns non-zero on OOM. */
+static int
+gkstr_reserve_pack(stream_t *stream)
+{
+  const size_t level_size = gkstr_level_size(stream);
+
+  return gkstr_reserve_levels(stream)
+         || gkstr_reserve_scratch(stream, stream->b)
+         || gks_reserve(&stream->carry, level_size)
+         || gks_reserve(&stream->merged, 2 * level_size);
+}
+
+/* Use block size b for n expected elements.
+ * Level 0, the array of levels, the sort scratch space and the scratch
+ * summaries are only allocated (and grown) once they are needed, so a stream that has
+ * seen few or no elements takes little memory: level 0 grows with the
+ * number of elements up to b, and holds them all as they are until
+ * then. Streams with background packing are the exception, as the
+ * worker relies on everything being in place.
+ * Returns non-zero on OOM. */
+static int
+gkstr_use_block_size(stream_t *stream, qe_count_t n, size_t b)
+{
+  stream->n = n;
+  stream->b = b;
+
+#ifndef QE_NO_THREADS
+  if (gkstr_has_background(stream)
+      && (gkstr_reserve_pack(stream)
+          || gks_reserve(&stream->aux->spare, b)))
+    return 1;
+#endif
+
+  return 0;
+}
+
+/* Level 0 is out of room but not full yet: give it some more, never
+ * beyond b. Returns non-zero on OOM. */
+static int
+gkstr_grow_level0(stream_t *stream)
+{
+  size_t size = stream->level0.size * 2;
+
+  if (size < 8)
+    size = 8;
+  if (size > stream->b)
+    size = stream->b;
+  return gks_reserve(&stream->level0, size);
+}
+
+/* Derive the block size from epsilon and the expected number of elements
+ * n, and grow the block size dependent buffers to match.
+ * Returns non-zero if n is too small for epsilon, or on OOM. */
+static int
+gkstr_set_block_size(stream_t *stream, qe_count_t n)
+{
+  const double epsN = stream->epsilon * (double)n;
+  const double b = floor(log(epsN) / stream->epsilon);
+
+  if (!(b >= 1.))
+    return 1; /* FIXME error handling */
+
+  return gkstr_use_block_size(stream, n, (size_t)b);
+}
+
+/* Sets up everything but the block size in the zeroed out stream.
+ * On failure, the stream is left for gkstr_destroy. */
+static int
+gkstr_init(stream_t *stream, double epsilon)
+{
+  stream->epsilon = epsilon;
+
+  gks_init(&stream->level0, 0);
+  gks_init(&stream->carry, 0);
+  gks_init(&stream->merged, 0);
+  gks_init(&stream->done, 0);
+
+  return 0;
+}
+
+int
+gkstr_setup(stream_t *stream, double epsilon, qe_count_t n)
+{
+  if (gkstr_init(stream, epsilon) || gkstr_set_block_size(stream, n))
+    return 1;
+  stream->error = epsilon;
+
+  return 0;
+}
+
+/* The extension of Zhang and Wang for streams of unknown length:
+ * partition P_i has 2^i * 8/epsilon elements, and the elements of each
+ * partition go through the levels with epsilon/2 and n = |P_i|. Once a
+ * partition is done, its summary is pruned to 2/epsilon tuples (adding
+ * another epsilon/2 of error) and merged into the summary of all
+ * previous partitions, which doesn't add to the error. */
+int
+gkstr_setup_unbounded(stream_t *stream, double epsilon)
+{
+  if (!(epsilon > 0. && epsilon < 1.))
+    return 1; /* FIXME error handling */
+
+  if (gkstr_init(stream, epsilon / 2.))
+    return 1;
+  stream->unbounded = 1;
+  stream->error = epsilon;
+  /* epsilon/2 * |P_0| = 4, so the first block size is log(4)*2/epsilon */
+  if (gkstr_set_block_size(stream, (qe_count_t)ceil(8. / epsilon)))
+    return 1;
+  stream->partition_end = stream->n;
+
+  return 0;
+}
+
+/* A fresh stream_t for the deserialization, with everything but the
+ * block size set up */
+static stream_t *
+gkstr_alloc(double epsilon)
+{
+  stream_t *stream = (stream_t *)QE_CALLOC(1, sizeof(stream_t));
+
+  if (stream == NULL)
+    return NULL;
+  if (gkstr_init(stream, epsilon)) {
+    gkstr_free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+stream_t *
+gkstr_new(double epsilon, qe_count_t n)
+{
+  stream_t *stream = (stream_t *)QE_CALLOC(1, sizeof(stream_t));
+
+  if (stream == NULL)
+    return NULL;
+  if (gkstr_setup(stream, epsilon, n)) {
+    gkstr_free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+stream_t *
+gkstr_new_unbounded(double epsilon)
+{
+  stream_t *stream = (stream_t *)QE_CALLOC(1, sizeof(stream_t));
+
+  if (stream == NULL)
+    return NULL;
+  if (gkstr_setup_unbounded(stream, epsilon)) {
+    gkstr_free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+/* Carry the compressed summary in stream->carry up from level k until
+ * it lands on an empty level, merging it with (and emptying) every full
+ * level on the way. Grows a new level if it falls off the top. */
+int
+gkstr_carry_up(stream_t *stream, size_t k)
+{
+  gksummary_t **gks;
+  gksummary_t *carry = &stream->carry;
+  gksummary_t *merged = &stream->merged;
+  const int prune_size = (int)gkstr_prune_size(stream);
+  size_t n_summaries;
+  gksummary_t *gk;
+
+  if (gkstr_reserve_levels(stream))
+    return 1;
+  gks = (gksummary_t **)ptrarray_data_pointer(stream->summaries);
+  n_summaries = ptrarray_nelems(stream->summaries);
+
+  for (; k < n_summaries; ++k) {
+    if (gks_len(gks[k]) == 0) {
+      /* --------------------------------------
+       * Empty: put compressed summary in sk
+       * -------------------------------------- */
+      /* The empty level's buffer becomes the new carry */
+      gks_swap(gks[k], carry);
+      if (k > stream->dirty_level)
+        stream->dirty_level = k;
+      return 0;
+    }
+
+    /* --------------------------------------
+     * sk contained a compressed summary
+     * -------------------------------------- */
+
+    /* here we're merging two summaries with s.b * 2^k entries each */
+    if (gks_merge(gks[k], carry, merged)
+        || gks_prune(merged, prune_size, carry))
+      return 1;
+    /* NOTE: carry is used in next iteration
+     * -  it is passed to the next level ! */
+
+    gks_clear(gks[k]);
+  }
+
+  /* fell off the end of our loop -- no more stream->summaries entries */
+  gk = gks_new(gkstr_level_size(stream));
+  if (gk == NULL)
+    return 1;
+  if (ptrarray_push(stream->summaries, gk)) {
+    gks_free(gk);
+    return 1;
+  }
+  gks_swap(gk, carry);
+  stream->dirty_level = n_summaries;
+  return 0;
+}
+
+/* Once level 0 fills up, it's compressed and carried up the levels
+ * until it lands on an empty one. All of that reuses the buffers of the
+ * levels and the stream's scratch summaries, so the only allocations
+ * after the first b updates happen when the stream grows a new level,
+ * ie. whenever the number of elements seen doubles.
+ * gk is the full level 0, or the spare it was swapped with. */
+static int
+gkstr_pack(stream_t *stream, gksummary_t *gk)
+{
+  gks_sort_values(gk, stream->sort_scratch);
+
+  if (gks_prune(gk, (int)gkstr_prune_size(stream), &stream->carry))
+    return 1;
+  gks_clear(gk);
+
+  return gkstr_carry_up(stream, 1);
+}
+
+#ifndef QE_NO_THREADS
+static void *
+gkstr_background_worker(void *arg)
+{
+  stream_t *stream = (stream_t *)arg;
+  gkstr_aux_t *aux = stream->aux;
+
+  pthread_mutex_lock(&aux->bg_lock);
+  for (;;) {
+    int err;
+
+    while (!aux->pending && !aux->bg_stop)
+      pthread_cond_wait(&aux->bg_work, &aux->bg_lock);
+    if (!aux->pending)
+      break; /* told to stop, and nothing left to do */
+
+    pthread_mutex_unlock(&aux->bg_lock);
+    err = gkstr_pack(stream, &aux->spare);
+    pthread_mutex_lock(&aux->bg_lock);
+
+    aux->bg_error |= err;
+    aux->pending = 0;
+    pthread_cond_signal(&aux->bg_idle);
+  }
+  pthread_mutex_unlock(&aux->bg_lock);
+
+  return NULL;
+}
+#endif
+
+/* Wait for the background worker (if any) to finish the block it's
+ * working on, after which the levels can be used again. Returns
+ * non-zero if the worker has run into an error. */
+QE_STATIC_INLINE int
+gkstr_wait_background(stream_t *stream)
+{
+#ifndef QE_NO_THREADS
+  gkstr_aux_t *aux = stream->aux;
+  int err;
+
+  if (!gkstr_has_background(stream))
+    return 0;
+  pthread_mutex_lock(&aux->bg_lock);
+  while (aux->pending)
+    pthread_cond_wait(&aux->bg_idle, &aux->bg_lock);
+  err = aux->bg_error;
+  pthread_mutex_unlock(&aux->bg_lock);
+  return err;
+#else
+  (void)stream;
+  return 0;
+#endif
+}
+
+/* Level 0 is full: pack it up right here, or swap it for the spare and
+ * leave that to the background worker. That only has to wait if the
+ * worker is still busy with the previous block. */
+static int
+gkstr_level0_full(stream_t *stream)
+{
+#ifndef QE_NO_THREADS
+  if (gkstr_has_background(stream)) {
+    gkstr_aux_t *aux = stream->aux;
+    int err;
+
+    pthread_mutex_lock(&aux->bg_lock);
+    while (aux->pending)
+      pthread_cond_wait(&aux->bg_idle, &aux->bg_lock);
+    gks_swap(&stream->level0, &aux->spare);
+    aux->pending = 1;
+    err = aux->bg_error;
+    pthread_cond_signal(&aux->bg_work);
+    pthread_mutex_unlock(&aux->bg_lock);
+    return err;
+  }
+#endif
+  if (gkstr_reserve_pack(stream))
+    return 1;
+  return gkstr_pack(stream, &stream->level0);
+}
+
+int
+gkstr_start_background(stream_t *stream)
+{
+#ifndef QE_NO_THREADS
+  gkstr_aux_t *aux;
+
+  if (gkstr_has_background(stream))
+    return 0;
+  aux = gkstr_aux(stream);
+  if (aux == NULL
+      || gkstr_reserve_pack(stream)
+      || gks_init(&aux->spare, stream->b))
+    return 1;
+  pthread_mutex_init(&aux->bg_lock, NULL);
+  pthread_cond_init(&aux->bg_work, NULL);
+  pthread_cond_init(&aux->bg_idle, NULL);
+  aux->pending = aux->bg_stop = aux->bg_error = 0;
+  if (pthread_create(&aux->bg_thread, NULL, gkstr_background_worker, stream) != 0) {
+    pthread_cond_destroy(&aux->bg_idle);
+    pthread_cond_destroy(&aux->bg_work);
+    pthread_mutex_destroy(&aux->bg_lock);
+    gks_destroy(&aux->spare);
+    return 1;
+  }
+  aux->background = 1;
+  return 0;
+#else
+  (void)stream;
+  return 1;
+#endif
+}
+
+/* Let the worker finish whatever is pending, and get rid of it */
+static void
+gkstr_stop_background(stream_t *stream)
+{
+#ifndef QE_NO_THREADS
+  gkstr_aux_t *aux = stream->aux;
+
+  if (!gkstr_has_background(stream))
+    return;
+  pthread_mutex_lock(&aux->bg_lock);
+  aux->bg_stop = 1;
+  pthread_cond_signal(&aux->bg_work);
+  pthread_mutex_unlock(&aux->bg_lock);
+  pthread_join(aux->bg_thread, NULL);
+
+  pthread_cond_destroy(&aux->bg_idle);
+  pthread_cond_destroy(&aux->bg_work);
+  pthread_mutex_destroy(&aux->bg_lock);
+  gks_destroy(&aux->spare);
+  aux->background = 0;
+#else
+  (void)stream;
+#endif
+}
+
+/* Merge all levels into level 0, leaving the other levels empty */
+static int
+gkstr_collapse_levels(stream_t *s)
+{
+  gksummary_t *gk = &s->level0;
+  size_t i;
+  const size_t n_summaries = gkstr_nlevels(s);
+
+  if (gkstr_reserve_scratch(s, gks_len(gk)))
+    return 1;
+  gks_sort_values(gk, s->sort_scratch);
+
+  for (i = 1; i < n_summaries; ++i) {
+    gksummary_t *level = gkstr_level(s, i);
+    if (gks_len(level) == 0)
+      continue;
+    if (gks_merge(gk, level, &s->merged))
+      return 1;
+    gks_swap(gk, &s->merged);
+    gks_clear(level);
+  }
+
+  return 0;
+}
+
+/* Unbounded streams: fold the current partition into the done summary
+ * and set up the levels for the next, twice as large, partition. */
+static int
+gkstr_next_partition(stream_t *stream)
+{
+  gksummary_t *gk = &stream->level0;
+
+  if (gkstr_wait_background(stream)
+      || gkstr_collapse_levels(stream)
+      || gks_prune(gk, (int)ceil(1. / stream->epsilon), &stream->carry)
+      || gks_merge(&stream->done, &stream->carry, &stream->merged))
+    return 1;
+  gks_swap(&stream->done, &stream->merged);
+  gks_clear(gk);
+  gks_clear(&stream->carry);
+  /* all levels were cleared, and the done summary below them changed */
+  stream->dirty_level = gkstr_nlevels(stream) - 1;
+
+  if (gkstr_set_block_size(stream, 2 * stream->n))
+    return 1;
+  stream->partition_end = stream->count + stream->n;
+
+  return 0;
+}
+
+int
+gkstr_update(stream_t *stream, double e)
+{
+  gksummary_t *gk = &stream->level0;
+
+  /* Level 0 is packed up as soon as it's full (b tuples), and grows
+   * on the way there. Only the value is stored until then. */
+  if (gk->len == gk->size && gkstr_grow_level0(stream))
+    return 1;
+  gk->v[gk->len++] = e;
+  ++stream->count;
+
+  if (stream->unbounded && stream->count == stream->partition_end)
+    return gkstr_next_partition(stream);
+
+  if (gks_len(gk) < stream->b)
+    return 0; /* done */
+
+  /* -----------------------------------
+   * Level 0 is full... PACK IT UP !!!
+   * ----------------------------------- */
+  return gkstr_level0_full(stream);
+}
+
+int
+gkstr_update_many(stream_t *stream, const double *vals, size_t n)
+{
+  gksummary_t *gk = &stream->level0;
+
+  while (n > 0) {
+    size_t chunk;
+
+    if (gk->len == gk->size && gkstr_grow_level0(stream))
+      return 1;
+    /* level 0 may have inherited a buffer larger than b */
+    chunk = (gk->size < stream->b ? gk->size : stream->b) - gks_len(gk);
+    if (chunk > n)
+      chunk = n;
+    if (stream->unbounded && chunk > stream->partition_end - stream->count)
+      chunk = (size_t)(stream->partition_end - stream->count);
+
+    memcpy(gk->v + gk->len, vals, chunk * sizeof(double));
+    gk->len += chunk;
+    stream->count += chunk;
+    vals += chunk;
+    n -= chunk;
+
+    if (stream->unbounded && stream->count == stream->partition_end) {
+      if (gkstr_next_partition(stream))
+        return 1;
+    }
+    else if (gks_len(gk) == stream->b && gkstr_level0_full(stream)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* A merge that doesn't line up with dst's levels goes into the done
+ * summary uncompressed as long as that stays within this many times
+ * 1/epsilon tuples, see gkstr_merge */
+#define QE_MERGE_DONE_FACTOR 16
+
+/* The error of a fresh stream: epsilon, and for unbounded streams the
+ * per-partition epsilon plus as much again for pruning the partitions */
+static double
+gkstr_own_error(stream_t *stream)
+{
+  return stream->unbounded ? 2. * stream->epsilon : stream->epsilon;
+}
+
+/* Carries a summary of count elements into the levels, at the lowest
+ * one meant for at least that many elements, pruned to the size of the
+ * levels first. From there on, it's carried up like any other level. */
+static int
+gkstr_carry_summary(stream_t *stream, gksummary_t *gk, qe_count_t count)
+{
+  size_t k = 1;
+
+  while (k < 63 && (count >> k) > stream->b)
+    ++k;
+  if (gks_prune(gk, (int)gkstr_prune_size(stream), &stream->carry))
+    return 1;
+
+  return gkstr_carry_up(stream, k);
+}
+
+/* Merges the summary of elements from another stream into the done
+ * summary, or while that's full, carries it into the levels. *error is
+ * the error of those elements on the way in, and their error in dst on
+ * the way out. */
+static int
+gkstr_merge_summary(stream_t *dst, gksummary_t *gk, double *error)
+{
+  const qe_count_t count = gks_size(gk);
+
+  if (gks_len(&dst->done) + gks_len(gk)
+      <= QE_MERGE_DONE_FACTOR * (size_t)ceil(1. / dst->epsilon))
+  {
+    if (gks_merge(&dst->done, gk, &dst->merged))
+      return 1;
+    gks_swap(&dst->done, &dst->merged);
+    dst->dirty_level = gkstr_nlevels(dst) - 1;
+  }
+  else {
+    if (gkstr_carry_summary(dst, gk, count))
+      return 1;
+    *error += gkstr_own_error(dst);
+  }
+  dst->count += count;
+  /* the current partition still gets all of its elements */
+  if (dst->unbounded)
+    dst->partition_end += count;
+
+  return 0;
+}
+
+/* Two bounded streams with the same block size have levels of the same
+ * shape: level k of either summarizes 2^k * b elements with the same
+ * error. So src's levels can be carried into dst's just like dst's own,
+ * and the result is as good as a single stream that saw everything.
+ * Unbounded streams (and streams with different block sizes) don't line
+ * up like that. Then src's finished summary gets merged into the
+ * summary below the levels instead (the done summary of the finished
+ * partitions, which is empty in bounded streams). That's a plain GK
+ * merge, which keeps the error bound at the larger of the two, but
+ * doesn't compress: the done summary grows by the size of src's.
+ * So once that would take the done summary past QE_MERGE_DONE_FACTOR
+ * / epsilon tuples, src's summary is carried into the levels instead,
+ * which bounds the memory after any number of merges by the log of the
+ * count. That prunes src's elements a few more times, though, just like
+ * dst's own: their error becomes src's plus dst's own. */
+int
+gkstr_merge(stream_t *dst, stream_t *src)
+{
+  gksummary_t *src_level0 = &src->level0;
+  double src_error = src->error;
+  size_t k;
+
+  if (dst == src || gkstr_wait_background(dst) || gkstr_wait_background(src))
+    return 1;
+
+  if (!dst->unbounded && !src->unbounded && dst->b == src->b) {
+    for (k = 1; k < gkstr_nlevels(src); ++k) {
+      gksummary_t *level = gkstr_level(src, k);
+      if (gks_len(level) == 0)
+        continue;
+      if (gks_copy(&dst->carry, level) || gkstr_carry_up(dst, k))
+        return 1;
+      dst->count += gks_size(level);
+    }
+    /* what src took in from streams that didn't line up */
+    if (gks_len(&src->done) != 0
+        && gkstr_merge_summary(dst, &src->done, &src_error))
+      return 1;
+    /* the raw values of level 0 are just more updates */
+    if (gkstr_update_many(dst, src_level0->v, gks_len(src_level0)))
+      return 1;
+  }
+  else if (src->count == gks_len(src_level0)) {
+    /* src still has all its values as they came */
+    if (gkstr_update_many(dst, src_level0->v, gks_len(src_level0)))
+      return 1;
+  }
+  else {
+    gksummary_t *all;
+
+    if (!gkstream_is_current(src) && gkstream_finish(src))
+      return 1;
+    all = (gksummary_t *)ptrarray_data_pointer(src->aux->snapshots)[0];
+    if (gks_len(all) == 0)
+      return 0;
+
+    if (gkstr_merge_summary(dst, all, &src_error))
+      return 1;
+  }
+
+  if (src_error > dst->error)
+    dst->error = src_error;
+  return 0;
+}
+
+/* gkstr_merge_many reduces the streams in a balanced binary tree: in
+ * the round with a given step, streams[i+step] is merged into
+ * streams[i] for every i that's a multiple of 2*step. All merges of a
+ * round are independent of each other, so the workers share them out,
+ * and only move on to the next round once the whole round is done.
+ * The tree doesn't depend on the number of threads, so neither does
+ * the result. */
 typedef struct {
-  double v;
-  int g;
-  int delta;
-} tuple_t;
+  stream_t **streams;
+  size_t k;
+  size_t step; /* of the current round */
+  size_t next; /* next i to merge into in the current round */
+  size_t in_flight; /* merges of the current round still running */
+  int failed;
+#ifndef QE_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t round_done;
+#endif
+} qe_merge_tree_t;
+
+/* Start the next round if the current one has been handed out and
+ * finished. Returns non-zero if that happened. */
+QE_STATIC_INLINE int
+qe_merge_tree_advance(qe_merge_tree_t *t)
+{
+  if (t->next + t->step < t->k || t->in_flight != 0)
+    return 0;
+  t->step *= 2;
+  t->next = 0;
+  return 1;
+}
+
+#ifndef QE_NO_THREADS
+static void *
+qe_merge_tree_worker(void *arg)
+{
+  qe_merge_tree_t *t = (qe_merge_tree_t *)arg;
+
+  pthread_mutex_lock(&t->lock);
+  while (!t->failed && t->step < t->k) {
+    if (t->next + t->step < t->k) {
+      const size_t i = t->next;
+      int err;
+
+      t->next += 2 * t->step;
+      ++t->in_flight;
+      pthread_mutex_unlock(&t->lock);
+      err = gkstr_merge(t->streams[i], t->streams[i + t->step]);
+      pthread_mutex_lock(&t->lock);
+      --t->in_flight;
+      t->failed |= err;
+      if (qe_merge_tree_advance(t) || t->failed)
+        pthread_cond_broadcast(&t->round_done);
+    }
+    else {
+      /* nothing left to hand out: wait for the others to finish */
+      pthread_cond_wait(&t->round_done, &t->lock);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  return NULL;
+}
+#endif
+
+static int
+qe_cmp_ptr(const void *a, const void *b)
+{
+  const uintptr_t pa = (uintptr_t)*(void *const *)a;
+  const uintptr_t pb = (uintptr_t)*(void *const *)b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* Non-zero if any of the k pointers appears more than once, found as
+ * equal neighbours in a sorted copy, or on OOM */
+static int
+qe_has_duplicates(void *const *ptrs, size_t k)
+{
+  void **sorted;
+  size_t i;
+  int dup = 0;
+
+  if (k < 2)
+    return 0;
+  sorted = QE_MALLOC(k * sizeof(void *));
+  if (sorted == NULL)
+    return 1;
+  memcpy(sorted, ptrs, k * sizeof(void *));
+  qsort(sorted, k, sizeof(void *), qe_cmp_ptr);
+  for (i = 1; i < k && !dup; ++i)
+    dup = sorted[i] == sorted[i-1];
+  QE_FREE(sorted);
+
+  return dup;
+}
+
+int
+gkstr_merge_many(stream_t **streams, size_t k, int nthreads)
+{
+  qe_merge_tree_t t;
+
+  /* a stream merged into twice, or into itself, counts twice and races
+   * with itself on the worker threads */
+  if (qe_has_duplicates((void *const *)streams, k))
+    return 1;
+
+  t.streams = streams;
+  t.k = k;
+  t.step = 1;
+  t.next = 0;
+  t.in_flight = 0;
+  t.failed = 0;
+
+#ifndef QE_NO_THREADS
+  /* no point in more threads than merges in the first round */
+  if (nthreads > 1 && k > 2) {
+    pthread_t *threads;
+    int nspawned = 0;
+    int i;
+
+    if ((size_t)nthreads > k / 2)
+      nthreads = (int)(k / 2);
+    threads = QE_MALLOC((nthreads - 1) * sizeof(pthread_t));
+    if (threads == NULL)
+      return 1;
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.round_done, NULL);
+
+    /* the calling thread is one of the workers */
+    for (i = 0; i < nthreads - 1; ++i) {
+      if (pthread_create(&threads[i], NULL, qe_merge_tree_worker, &t) != 0)
+        break; /* carry on with fewer */
+      ++nspawned;
+    }
+    qe_merge_tree_worker(&t);
+    for (i = 0; i < nspawned; ++i)
+      pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&t.round_done);
+    pthread_mutex_destroy(&t.lock);
+    QE_FREE(threads);
+    return t.failed;
+  }
+#else
+  (void)nthreads;
+#endif
+
+  while (!t.failed && t.step < t.k) {
+    for (; t.next + t.step < t.k; t.next += 2 * t.step)
+      t.failed |= gkstr_merge(t.streams[t.next], t.streams[t.next + t.step]);
+    qe_merge_tree_advance(&t);
+  }
+
+  return t.failed;
+}
+
+double
+gkstr_error_bound(stream_t *stream)
+{
+  return stream->error;
+}
+
+/* Heap bytes of a list of summaries, with their ptrarray, leaving out
+ * the first skip summaries */
+static size_t
+gkstr_summaries_memory(summaries_t *summaries, size_t skip)
+{
+  gksummary_t **gks;
+  size_t size, i;
+
+  if (summaries == NULL)
+    return 0;
+  gks = (gksummary_t **)ptrarray_data_pointer(summaries);
+  size = sizeof(ptrarray_t) + summaries->size * sizeof(void *);
+  for (i = skip; i < ptrarray_nelems(summaries); ++i)
+    size += sizeof(gksummary_t) + gks[i]->size * QE_TUPLE_BYTES;
+
+  return size;
+}
+
+size_t
+gkstr_memory_usage(stream_t *stream)
+{
+  size_t size = sizeof(stream_t);
+  gkstr_aux_t *aux = stream->aux;
+
+  gkstr_wait_background(stream);
+  size += gkstr_summaries_memory(stream->summaries, 1); /* level 0 is ours */
+  size += (stream->level0.size + stream->carry.size + stream->merged.size
+           + stream->done.size) * QE_TUPLE_BYTES;
+  size += stream->sort_scratch_size * 2 * sizeof(uint64_t);
+  if (aux != NULL) {
+    size += sizeof(gkstr_aux_t);
+    size += gkstr_summaries_memory(aux->snapshots, 0);
+    size += aux->snapshot_rmin_size * sizeof(qe_count_t);
+#ifndef QE_NO_THREADS
+    size += aux->spare.size * QE_TUPLE_BYTES;
+#endif
+  }
+
+  return size;
+}
+
+/* !! Must call Finish to allow processing queries
+ * Builds the summary that queries are answered from without touching
+ * the levels, so the stream can still be updated afterwards. Updates
+ * aren't visible to queries until the next finish, which only
+ * re-merges the levels that changed in the meantime: level 0 always,
+ * the others only when a full level 0 was carried up to them.
+ * Returns non-zero on OOM. */
+int
+gkstream_finish(stream_t *s)
+{
+  size_t n_summaries;
+  gkstr_aux_t *aux;
+  gksummary_t **snaps;
+  gksummary_t *level0 = &s->merged; /* not in use outside of updates */
+  const size_t len0 = gks_len(&s->level0);
+  size_t k;
+
+  if (gkstr_wait_background(s))
+    return 1;
+  n_summaries = gkstr_nlevels(s);
+
+  /* Small streams: no summary needed, and the answers are exact */
+  if (s->count == len0) {
+    if (len0 > QE_SORT_INSERTION_MAX && gkstr_reserve_scratch(s, len0))
+      return 1;
+    qe_kernels.sort_doubles(s->level0.v, len0, s->sort_scratch);
+    s->exact = 1;
+    s->snapshot_count = s->count;
+    return 0;
+  }
+  s->exact = 0;
+
+  aux = gkstr_aux(s);
+  if (aux == NULL)
+    return 1;
+  if (aux->snapshots == NULL) {
+    aux->snapshots = ptrarray_make(2, 0);
+    if (aux->snapshots == NULL)
+      return 1;
+  }
+  while (ptrarray_nelems(aux->snapshots) < n_summaries) {
+    gksummary_t *gk = gks_new(0);
+    if (gk == NULL)
+      return 1;
+    if (ptrarray_push(aux->snapshots, gk)) {
+      gks_free(gk);
+      return 1;
+    }
+  }
+  snaps = (gksummary_t **)ptrarray_data_pointer(aux->snapshots);
+
+  if (s->dirty_level >= n_summaries)
+    s->dirty_level = n_summaries - 1;
+
+  /* Everything above level 0 that changed, top-down */
+  for (k = s->dirty_level; k >= 1; --k) {
+    gksummary_t *above = k+1 < n_summaries ? snaps[k+1] : &s->done;
+    if (gks_merge(gkstr_level(s, k), above, snaps[k]))
+      return 1;
+  }
+
+  /* Level 0 is an unsorted buffer: sort a copy of it */
+  gks_clear(level0);
+  if (len0 != 0) {
+    if (gks_reserve(level0, len0) || gkstr_reserve_scratch(s, len0))
+      return 1;
+    memcpy(level0->v, s->level0.v, len0 * sizeof(double));
+    level0->len = len0;
+    gks_sort_values(level0, s->sort_scratch);
+  }
+  if (gks_merge(level0, n_summaries > 1 ? snaps[1] : &s->done, snaps[0]))
+    return 1;
+  gks_clear(level0);
+
+  /* The cumulative ranks for the queries */
+  {
+    const size_t ntuples = gks_len(snaps[0]);
+    const qe_tuple_count_t *g = snaps[0]->g;
+    qe_count_t *rmin = aux->snapshot_rmin;
+    qe_count_t sum = 0;
+    size_t i;
+
+    if (ntuples > aux->snapshot_rmin_size) {
+      rmin = QE_REALLOC(rmin, ntuples * sizeof(qe_count_t));
+      if (rmin == NULL)
+        return 1;
+      aux->snapshot_rmin = rmin;
+      aux->snapshot_rmin_size = ntuples;
+    }
+
+    for (i = 0; i < ntuples; ++i) {
+      sum += g[i];
+      rmin[i] = sum;
+    }
+  }
+
+  s->dirty_level = 0;
+  s->snapshot_count = s->count;
+  return 0;
+}
+
+qe_count_t
+gkstr_count(stream_t *s)
+{
+  return s->count;
+}
+
+int
+gkstream_is_current(stream_t *s)
+{
+  return (s->exact || (s->aux != NULL && s->aux->snapshots != NULL
+                       && !ptrarray_empty(s->aux->snapshots)))
+         && s->snapshot_count == s->count;
+}
+
+/* Sets up view for the finished summary of s. Returns zero if there's
+ * nothing to query. */
+int
+gkstream_view(stream_t *s, qe_view_t *view)
+{
+  gksummary_t *gk;
+
+  if (s->exact) {
+    /* the stream may have packed up level 0 since the finish */
+    if (s->snapshot_count == 0 || s->count != gks_len(&s->level0))
+      return 0;
+    view->v = s->level0.v;
+    view->delta = NULL;
+    view->rmin = NULL;
+    view->ntuples = (size_t)s->snapshot_count;
+    view->count = s->snapshot_count;
+    return 1;
+  }
+  if (s->aux == NULL || s->aux->snapshots == NULL
+      || ptrarray_empty(s->aux->snapshots))
+    return 0; /* not finished */
+  gk = (gksummary_t *)ptrarray_data_pointer(s->aux->snapshots)[0];
+  if (gks_len(gk) == 0)
+    return 0;
+
+  view->v = gk->v;
+  view->delta = gk->delta;
+  view->rmin = s->aux->snapshot_rmin;
+  view->ntuples = gks_len(gk);
+  view->count = s->snapshot_count;
+  return 1;
+}
+
+/* convert quantile to rank */
+QE_STATIC_INLINE qe_count_t
+qe_view_quantile_rank(const qe_view_t *view, double q)
+{
+  if (q <= 0.)
+    return 0;
+  else if (q >= 1.)
+    return view->count;
+  else
+    return (qe_count_t)(q * (double)view->count);
+}
+
+/* Number of entries in the ascending array a that are <= r.
+ * The loop has a fixed trip count for a given n and the compiler turns
+ * the conditional into a cmov, so there are no mispredicted branches. */
+QE_STATIC_INLINE size_t
+gkstream_upper_bound(const qe_count_t *a, size_t n, qe_count_t r)
+{
+  const qe_count_t *base = a;
+
+  if (n == 0)
+    return 0;
+
+  while (n > 1) {
+    const size_t half = n / 2;
+    base = base[half] <= r ? base + half : base;
+    n -= half;
+  }
+
+  return (size_t)(base - a) + (*base <= r);
+}
+
+/* The same as gkstream_upper_bound(rmin + 1, ntuples - 1, r) for the
+ * rmin(i) = i+1 of exact views */
+QE_STATIC_INLINE size_t
+qe_view_exact_index(const qe_view_t *view, qe_count_t r)
+{
+  if (r == 0)
+    return 0;
+  return r - 1 < view->ntuples - 1 ? (size_t)(r - 1) : view->ntuples - 1;
+}
+
+/* GK query
+ * The answer is the value of tuple i with rmin(i) <= r < rmin(i+1),
+ * or the minimum if r is below rmin(0). So i is just the number of
+ * tuples after the first one with rmin <= r. */
+double
+qe_view_query(const qe_view_t *view, double q)
+{
+  const qe_count_t r = qe_view_quantile_rank(view, q);
+
+  if (view->rmin == NULL)
+    return view->v[qe_view_exact_index(view, r)];
+  return view->v[gkstream_upper_bound(view->rmin + 1, view->ntuples - 1, r)];
+}
+
+/* Like qe_view_query for k quantiles at once. For ascending quantiles
+ * that's a single pass over the summary, advancing from one answer to
+ * the next; any quantile smaller than its predecessor falls back to a
+ * binary search. */
+void
+qe_view_query_many(const qe_view_t *view, const double *qs, double *out, size_t k)
+{
+  const qe_count_t *rmin = view->rmin;
+  const size_t ntuples = view->ntuples;
+  size_t i;
+  size_t idx = 0;
+
+  if (rmin == NULL) {
+    for (i = 0; i < k; ++i)
+      out[i] = view->v[qe_view_exact_index(view, qe_view_quantile_rank(view, qs[i]))];
+    return;
+  }
+
+  for (i = 0; i < k; ++i) {
+    const qe_count_t r = qe_view_quantile_rank(view, qs[i]);
+
+    if (i > 0 && qs[i] < qs[i-1])
+      idx = gkstream_upper_bound(rmin + 1, ntuples - 1, r);
+    else
+      idx = qe_kernels.scan_counts(rmin, idx + 1, ntuples, r) - 1;
+
+    out[i] = view->v[idx];
+  }
+}
 
-typedef ptrarray_t gksummary_t;
+/* Estimate for the number of elements <= x, given that tuple i-1 is
+ * the last one with a value <= x. That number is at least rmin(i-1)
+ * and less than rmax(i), so the midpoint is off by at most half of
+ * g(i) + delta(i), which the summary keeps below epsilon*N. */
+QE_STATIC_INLINE double
+qe_view_rank_at(const qe_view_t *view, size_t i)
+{
+  const qe_count_t *rmin = view->rmin;
+
+  if (i == 0)
+    return 0.; /* below the minimum, which is exact */
+  if (rmin == NULL)
+    return (double)i; /* exact view */
+  if (i == view->ntuples)
+    return (double)view->count;
+  if (view->delta == NULL)
+    return (double)rmin[i-1]; /* weighted sample */
+
+  return 0.5 * ((double)rmin[i-1] + (double)(rmin[i] + view->delta[i] - 1));
+}
 
-#define QE_GET_TUPLES(gk) ((tuple_t **)ptrarray_data_pointer(gk))
+/* Inverse of qe_view_query: the (estimated) number of elements <= x */
+double
+qe_view_rank(const qe_view_t *view, double x)
+{
+  return qe_view_rank_at(view, gkstream_value_upper_bound(view->v, view->ntuples, x));
+}
 
-typedef ptrarray_t summaries_t;
+/* The fraction of elements <= x for each of the k values in xs.
+ * Same as qe_view_query_many, but the other way around. */
+void
+qe_view_cdf_many(const qe_view_t *view, const double *xs, double *out, size_t k)
+{
+  const double *v = view->v;
+  const size_t ntuples = view->ntuples;
+  size_t i;
+  size_t idx = 0;
 
-struct stream_struct {
-  summaries_t *summaries; /* AoA of tuples */
-  double epsilon;
-  int n;
-  size_t b; /* block size */
-};
+  for (i = 0; i < k; ++i) {
+    if (i > 0 && xs[i] < xs[i-1])
+      idx = gkstream_value_upper_bound(v, ntuples, xs[i]);
+    else
+      idx = qe_kernels.scan_doubles(v, idx, ntuples, xs[i]);
 
+    out[i] = qe_view_rank_at(view, idx) / (double)view->count;
+  }
+}
 
-/**************************************************
- * Tuple functions
- **************************************************/
+double
+gkstream_query(stream_t *s, double q)
+{
+  qe_view_t view;
+
+  return gkstream_view(s, &view) ? qe_view_query(&view, q) : NAN;
+}
 
-QE_STATIC_INLINE tuple_t *
-gktuple_new()
+void
+gkstream_query_many(stream_t *s, const double *qs, double *out, size_t k)
 {
-  tuple_t *t = calloc(1, sizeof(tuple_t));
+  qe_view_t view;
 
-  if (t == NULL)
-    return NULL;
+  if (gkstream_view(s, &view))
+    qe_view_query_many(&view, qs, out, k);
+  else
+    qe_fill_nan(out, k);
+}
+
+double
+gkstream_rank(stream_t *s, double x)
+{
+  qe_view_t view;
 
-  return t;
+  return gkstream_view(s, &view) ? qe_view_rank(&view, x) : NAN;
 }
 
-QE_STATIC_INLINE tuple_t *
-gktuple_clone(tuple_t *proto)
+void
+gkstream_cdf_many(stream_t *s, const double *xs, double *out, size_t k)
 {
-  tuple_t *res = malloc(sizeof(tuple_t));
-  if (res == NULL)
-    return NULL;
+  qe_view_t view;
 
-  *res = *proto;
-  return res;
+  if (gkstream_view(s, &view))
+    qe_view_cdf_many(&view, xs, out, k);
+  else
+    qe_fill_nan(out, k);
 }
 
 /**************************************************
- * gksummary_t functions
+ * Serialization
  **************************************************/
 
-QE_STATIC_INLINE gksummary_t *
-gks_new(size_t nprealloc)
+/* Binary format, version 1. All multi-byte fixed-size fields are little
+ * endian, "varint" is an unsigned LEB128 number (7 bits per byte, low
+ * bits first, high bit set on all but the last byte).
+ *
+ *   "QEST"        magic
+ *   u8            format version (1)
+ *   u8            flags: bit 0 set for unbounded streams
+ *   f64           epsilon (for unbounded streams, the per-partition one,
+ *                 ie. half of what gkstr_new_unbounded was given)
+ *   f64           the error bound, see gkstr_error_bound
+ *   varint        n, the expected number of elements (of the partition)
+ *   varint        b, the block size
+ *   varint        number of elements seen so far
+ *   varint        end of the current partition (0 if bounded)
+ *   varint        number of values in level 0, followed by the values
+ *                 as f64, in no particular order
+ *   varint        number of levels above level 0, followed by a summary
+ *                 per level, bottom up
+ *   summary       the finished partitions (empty if bounded)
+ *
+ * A summary is the varint number of tuples followed by the tuples, each
+ * as three varints: the value, g and delta. The value is encoded as its
+ * order-preserving 64-bit key (see qe_sort.h) minus that of the
+ * previous tuple, modulo 2^64. Values are sorted, so this is the
+ * (small) difference between neighbouring values. The first tuple's
+ * value is relative to 0. */
+
+#define QE_SERIAL_MAGIC "QEST"
+#define QE_SERIAL_VERSION 1
+#define QE_SERIAL_FLAG_UNBOUNDED 1
+static size_t
+gks_serialized_size(gksummary_t *gk)
 {
-  return ptrarray_make(nprealloc, PTRARRAYf_FREE_ELEMS);
+  return QE_VARINT_MAX + gks_len(gk) * 3 * QE_VARINT_MAX;
 }
 
-QE_STATIC_INLINE void
-gks_free(gksummary_t *gk)
+static unsigned char *
+gks_serialize(gksummary_t *gk, unsigned char *p)
 {
-  ptrarray_free(gk);
-}
+  const size_t n = gks_len(gk);
+  uint64_t prev = 0;
+  size_t i;
 
-/* N tuples in summary */
-QE_STATIC_INLINE unsigned int
-gks_len(gksummary_t *gk)
-{
-  return ptrarray_nelems(gk);
+  p = qe_put_varint(p, n);
+  for (i = 0; i < n; ++i) {
+    const uint64_t key = qe_sort_double_to_key(gk->v[i]);
+    p = qe_put_varint(p, key - prev);
+    p = qe_put_varint(p, gk->g[i]);
+    p = qe_put_varint(p, gk->delta[i]);
+    prev = key;
+  }
+
+  return p;
 }
 
-/* N items that the summary represents */
-QE_STATIC_INLINE int
-gks_size(gksummary_t *gk)
+/* Replaces the contents of gk. Returns non-zero on malformed input or
+ * OOM. */
+static int
+gks_deserialize(gksummary_t *gk, qe_reader_t *r)
 {
+  const uint64_t n = qe_get_varint(r);
+  uint64_t key = 0;
   size_t i;
-  int n = 0;
-  const size_t l = gks_len(gk);
-  tuple_t **d = QE_GET_TUPLES(gk);
 
-  if (l == 0)
-    return 0;
+  gks_clear(gk);
+  /* every tuple takes at least 3 bytes: don't let garbage make us
+   * allocate huge buffers */
+  if (r->p == NULL || n > (uint64_t)(r->end - r->p) / 3
+      || gks_reserve(gk, (size_t)n))
+    return 1;
 
-  for (i = 0; i < l; ++i) {
-    n += d[i]->g;
+  for (i = 0; i < n; ++i) {
+    const uint64_t key_delta = qe_get_varint(r);
+    uint64_t g, delta;
+    g = qe_get_varint(r);
+    delta = qe_get_varint(r);
+    /* The keys only go up, unless the sum wraps around. Every tuple
+     * stands for at least one element, and NaNs can't be ordered. A
+     * build with wider tuple counts may have written larger ones. */
+    if (key + key_delta < key || g == 0
+        || g > QE_TUPLE_COUNT_MAX || delta > QE_TUPLE_COUNT_MAX)
+      return 1;
+    key += key_delta;
+    gk->v[i] = qe_sort_key_to_double(key);
+    if (gk->v[i] != gk->v[i])
+      return 1;
+    gk->g[i] = (qe_tuple_count_t)g;
+    gk->delta[i] = (qe_tuple_count_t)delta;
   }
+  gk->len = (size_t)n;
 
-  return n + d[l-1]->delta;
+  return r->p == NULL;
 }
 
-QE_STATIC_INLINE void
-gks_clear(gksummary_t *gk)
+size_t
+gkstr_serialized_size(stream_t *s)
 {
-  ptrarray_truncate(gk, 0);
+  size_t size;
+  size_t k;
+
+  gkstr_wait_background(s);
+
+  size = 4 + 1 + 1 + 2 * 8 + 5 * QE_VARINT_MAX + 8 * gks_len(&s->level0);
+  size += QE_VARINT_MAX + gks_serialized_size(&s->done);
+  for (k = 1; k < gkstr_nlevels(s); ++k)
+    size += gks_serialized_size(gkstr_level(s, k));
+
+  return size;
 }
 
-/* reduces the number of elements but doesn't lose precision.
- * Algorithm "value merging" in Appendix A of
- * "Power-Conserving Computation of Order-Statistics over Sensor Networks" (Greenwald, Khanna 2004)
- * http://www.cis.upenn.edu/~mbgreen/papers/pods04.pdf
- */
-QE_STATIC_INLINE void
-gks_merge_values(gksummary_t *gk)
+size_t
+gkstr_serialize(stream_t *s, unsigned char *buf, size_t size)
 {
-  int missing = 0;
-  size_t src;
-  size_t dst = 0;
-  tuple_t **d = QE_GET_TUPLES(gk);
-  const size_t n = gks_len(gk);
+  gksummary_t *level0 = &s->level0;
+  size_t n_summaries;
+  unsigned char *p = buf;
+  size_t k;
 
-  for (src = 1; src < n; ++src) {
-    if (d[dst]->v == d[src]->v) {
-      d[dst]->delta += d[src]->g + d[src]->delta;
-      missing += d[src]->g;
-      continue;
-    }
+  if (gkstr_wait_background(s) || size < gkstr_serialized_size(s))
+    return 0;
+  n_summaries = gkstr_nlevels(s);
+
+  memcpy(p, QE_SERIAL_MAGIC, 4);
+  p += 4;
+  *p++ = QE_SERIAL_VERSION;
+  *p++ = s->unbounded ? QE_SERIAL_FLAG_UNBOUNDED : 0;
+  p = qe_put_f64(p, s->epsilon);
+  p = qe_put_f64(p, s->error);
+  p = qe_put_varint(p, s->n);
+  p = qe_put_varint(p, s->b);
+  p = qe_put_varint(p, s->count);
+  p = qe_put_varint(p, s->unbounded ? s->partition_end : 0);
+
+  p = qe_put_varint(p, gks_len(level0));
+  for (k = 0; k < gks_len(level0); ++k)
+    p = qe_put_f64(p, level0->v[k]);
+
+  p = qe_put_varint(p, n_summaries - 1);
+  for (k = 1; k < n_summaries; ++k)
+    p = gks_serialize(gkstr_level(s, k), p);
+  p = gks_serialize(&s->done, p);
+
+  return (size_t)(p - buf);
+}
 
-    ++dst;
-    /* add in the extra 'g' for the elements we removed */
-    d[src]->g += missing;
-    missing = 0;
-    d[dst] = d[src];
+/* Reads everything after the header into the fresh stream s.
+ * Returns non-zero on malformed input or OOM. */
+static int
+gkstr_deserialize_levels(stream_t *s, qe_reader_t *r)
+{
+  gksummary_t *gk = &s->level0;
+  uint64_t len0, n_levels, k;
+  qe_count_t total;
+
+  /* level 0 gets packed up as soon as it's full, and every value takes
+   * 8 bytes of the input */
+  len0 = qe_get_varint(r);
+  if (r->p == NULL || len0 >= s->b || len0 > (uint64_t)(r->end - r->p) / 8
+      || gks_reserve(gk, (size_t)len0))
+    return 1;
+  for (k = 0; k < len0; ++k)
+    gk->v[k] = qe_get_f64(r);
+  gk->len = (size_t)len0;
+  total = len0;
+
+  /* a level holds 2^k blocks, so there can't be more than 64 */
+  n_levels = qe_get_varint(r);
+  if (r->p == NULL || n_levels > 64 || (n_levels > 0 && gkstr_reserve_levels(s)))
+    return 1;
+  for (k = 0; k < n_levels; ++k) {
+    /* sized by what the input has, not by b: gks_deserialize caps it
+     * by the bytes left, and the level grows like any other later */
+    gk = gks_new(0);
+    if (gk == NULL)
+      return 1;
+    if (ptrarray_push(s->summaries, gk)) {
+      gks_free(gk);
+      return 1;
+    }
+    if (gks_deserialize(gk, r))
+      return 1;
+    total += gks_size(gk);
   }
 
-  ptrarray_truncate(gk, dst);
-}
+  if (gks_deserialize(&s->done, r))
+    return 1;
+  total += gks_size(&s->done);
 
-/* From http://www.mathcs.emory.edu/~cheung/Courses/584-StreamDB/Syllabus/08-Quantile/Greenwald-D.html "Prune" */
-QE_STATIC_INLINE gksummary_t *
-gks_prune(gksummary_t *gk, int b)
-{
-  tuple_t *tmp_tuple;
-  gksummary_t *resgk;
-  const int input_n_tuples = gks_len(gk);
-  tuple_t **tuples = QE_GET_TUPLES(gk);
-  int gk_idx = 0;
-  size_t gk_rmin = 1;
-  size_t i;
+  /* trailing garbage, or counts that don't add up */
+  return r->p != r->end || total != s->count;
+}
 
-  if (input_n_tuples == 0)
+stream_t *
+gkstr_deserialize(const unsigned char *buf, size_t len)
+{
+  qe_reader_t r;
+  stream_t *s;
+  int flags;
+  double epsilon, error, expected_b;
+  uint64_t n, b, count, partition_end;
+
+  if (len < 6 || memcmp(buf, QE_SERIAL_MAGIC, 4) != 0
+      || buf[4] != QE_SERIAL_VERSION || (buf[5] & ~QE_SERIAL_FLAG_UNBOUNDED) != 0)
     return NULL;
-
-  resgk = gks_new(4);
-  if (resgk == NULL)
+  flags = buf[5];
+  r.p = buf + 6;
+  r.end = buf + len;
+
+  epsilon = qe_get_f64(&r);
+  error = qe_get_f64(&r);
+  n = qe_get_varint(&r);
+  b = qe_get_varint(&r);
+  count = qe_get_varint(&r);
+  partition_end = qe_get_varint(&r);
+  if (r.p == NULL || !(epsilon > 0. && epsilon < 1.) || !(error >= epsilon && error < 1.))
     return NULL;
 
-  tmp_tuple = gktuple_clone(tuples[0]); /* TODO consider if that allocation could be avoided */
-  if (tmp_tuple == NULL)
+  /* b is stored rather than recomputed so that a different libm can't
+   * change the layout of the levels, but it still has to fit n */
+  expected_b = floor(log(epsilon * (double)n) / epsilon);
+  if (b < 1 || fabs((double)b - expected_b) > 1.)
+    return NULL;
+  if ((flags & QE_SERIAL_FLAG_UNBOUNDED) && partition_end <= count)
     return NULL;
-  ptrarray_push(resgk, tmp_tuple);
 
-  for (i = 1; i <= (size_t)b; ++i) {
-    const size_t rank = (size_t)((double)gks_size(gk) * (double)i / (double)b);
+  s = gkstr_alloc(epsilon);
+  if (s == NULL)
+    return NULL;
+  s->unbounded = flags & QE_SERIAL_FLAG_UNBOUNDED;
+  s->partition_end = partition_end;
+  s->count = count;
+  s->error = error;
+
+  if (gkstr_use_block_size(s, n, (size_t)b)
+      || gkstr_deserialize_levels(s, &r))
+  {
+    gkstr_free(s);
+    return NULL;
+  }
 
-    /* find an element of rank 'rank' in gk */
-    while (gk_idx < input_n_tuples-1) {
+  /* nothing to reuse for queries: gkstream_finish starts from scratch */
+  s->dirty_level = gkstr_nlevels(s);
+  return s;
+}
 
-      if (gk_rmin <= rank && rank < gk_rmin + tuples[gk_idx+1]->g)
-        break;
+/**************************************************
+ * Sketch engines
+ **************************************************/
 
-      ++gk_idx;
-      gk_rmin += tuples[gk_idx]->g;
-    }
+struct sketch_struct {
+  const qe_engine_t *engine;
+  void *impl;
+};
 
-    if (gk_idx >= input_n_tuples)
-      gk_idx = input_n_tuples - 1;
+/* "gk": the streams */
 
-    {
-      tuple_t *elt = tuples[gk_idx];
+static void *
+qe_gk_create(double epsilon, qe_count_t n)
+{
+  return n > 0 ? gkstr_new(epsilon, n) : gkstr_new_unbounded(epsilon);
+}
 
-      if (((tuple_t *)ptrarray_peek(resgk))->v == elt->v) {
-        /* ignore if we've already seen it */
-        continue;
-      }
+static void
+qe_gk_destroy(void *impl)
+{
+  gkstr_free((stream_t *)impl);
+}
 
-      tmp_tuple = gktuple_clone(elt); /* TODO consider if that allocation could be avoided */
-      if (tmp_tuple == NULL)
-        return NULL;
-      ptrarray_push(resgk, tmp_tuple);
-    }
-  }
+static int
+qe_gk_update(void *impl, double e)
+{
+  return gkstr_update((stream_t *)impl, e);
+}
 
-  return resgk;
+static int
+qe_gk_update_many(void *impl, const double *vals, size_t n)
+{
+  return gkstr_update_many((stream_t *)impl, vals, n);
 }
 
+static int
+qe_gk_merge(void *dst, void *src)
+{
+  return gkstr_merge((stream_t *)dst, (stream_t *)src);
+}
 
-/* This is the Merge algorithm from
- * http://www.cs.ubc.ca/~xujian/paper/quant.pdf .  It is much simpler than the
- * MERGE algorithm at
- * http://www.mathcs.emory.edu/~cheung/Courses/584-StreamDB/Syllabus/08-Quantile/Greenwald-D.html
- * or "COMBINE" in http://www.cis.upenn.edu/~mbgreen/papers/chapter.pdf
- * "Quantiles and Equidepth Histograms over Streams" (Greenwald, Khanna 2005) */
-/* Takes ownership of the input summaries */
-QE_STATIC_INLINE gksummary_t *
-gks_merge(gksummary_t * s1, gksummary_t *s2, double epsilon, int N1, int N2)
+static qe_count_t
+qe_gk_count(void *impl)
 {
-  gksummary_t *smerge;
-  size_t i1 = 0;
-  size_t i2 = 0;
-  int rmin = 0;
-  int k = 0;
-  tuple_t **s1t = QE_GET_TUPLES(s1);
-  tuple_t **s2t = QE_GET_TUPLES(s2);
-  const size_t n1 = gks_len(s1);
-  const size_t n2 = gks_len(s2);
-  tuple_t *newt;
-  tuple_t *t = NULL;
+  return gkstr_count((stream_t *)impl);
+}
 
-  if (gks_len(s1) == 0) {
-    gks_free(s1);
-    return s2;
-  }
+static double
+qe_gk_error_bound(void *impl)
+{
+  return gkstr_error_bound((stream_t *)impl);
+}
 
-  if (gks_len(s2) == 0) {
-    gks_free(s2);
-    return s1;
-  }
+static int
+qe_gk_finish(void *impl)
+{
+  stream_t *s = (stream_t *)impl;
 
-  s1t[0]->g = 1;
-  s2t[0]->g = 1;
+  return gkstream_is_current(s) ? 0 : gkstream_finish(s);
+}
 
-  smerge = gks_new(n1);
-  if (smerge == NULL)
-    return NULL;
+static void
+qe_gk_query_many(void *impl, const double *qs, double *out, size_t k)
+{
+  gkstream_query_many((stream_t *)impl, qs, out, k);
+}
 
-  while (i1 < n1 || i2 < n2) {
-    if (i1 < n1 && i2 < n2) {
-      if (s1t[i1]->v <= s2t[i2]->v)
-        t = s1t[i1++];
-      else
-        t = s2t[i2++];
-    }
-    else if (i1 < n1 && i2 >= n2) { /* technically, just i1 < n1 should be enough */
-      t = s1t[i1++];
-    }
-    else if (i1 >= n1 && i2 < n2) { /* technically, just i2 < n2 needed */
-      t = s2t[i2++];
-    }
-    else {
-      abort(); /* never happens */
-    }
+static double
+qe_gk_rank(void *impl, double x)
+{
+  return gkstream_rank((stream_t *)impl, x);
+}
 
-    newt = gktuple_new();
-    newt->v = t->v;
-    newt->g = t->g;
+static void
+qe_gk_cdf_many(void *impl, const double *xs, double *out, size_t k)
+{
+  gkstream_cdf_many((stream_t *)impl, xs, out, k);
+}
 
-    ++k;
-    /* If you're following along with the paper, the Algorithm has
-     * a typo on lines 9 and 11.  The summation is listed as going
-     * from 1..k , which doesn't make any sense.  It should be
-     * 1..l, the number of summaries we're merging.  In this case,
-     * l=2, so we just add the sizes of the sets. */
-    if (k == 1) {
-      newt->delta = (int)(epsilon * ((double)N1 + (double)N2));
-    }
-    else {
-      const int rmax = rmin + (int)(2*epsilon * ((double)N1 + (double)N2));
-      rmin += newt->g;
-      newt->delta = rmax - rmin;
-      ptrarray_push(smerge, newt);
-    }
-  } /* end while */
+static size_t
+qe_gk_serialized_size(void *impl)
+{
+  return gkstr_serialized_size((stream_t *)impl);
+}
 
+static size_t
+qe_gk_serialize(void *impl, unsigned char *buf, size_t size)
+{
+  return gkstr_serialize((stream_t *)impl, buf, size);
+}
 
-  /* all done
-   * The merged list might have duplicate elements -- merge them. */
-  gks_merge_values(smerge);
+static void *
+qe_gk_deserialize(const unsigned char *buf, size_t len)
+{
+  return gkstr_deserialize(buf, len);
+}
 
-  return smerge;
+static size_t
+qe_gk_memory_usage(void *impl)
+{
+  return gkstr_memory_usage((stream_t *)impl);
 }
 
+static const qe_engine_t qe_engine_gk = {
+  "gk", QE_SERIAL_MAGIC,
+  qe_gk_create, qe_gk_destroy, qe_gk_update, qe_gk_update_many, qe_gk_merge,
+  qe_gk_count, qe_gk_error_bound, qe_gk_finish, qe_gk_query_many, qe_gk_rank,
+  qe_gk_cdf_many, qe_gk_serialized_size, qe_gk_serialize, qe_gk_deserialize,
+  qe_gk_memory_usage
+};
 
+static const qe_engine_t *const qe_engines[] = {
+  &qe_engine_gk,
+  &qe_engine_kll,
+  &qe_engine_tdigest
+};
 
-/**************************************************
- * stream_t functions
- **************************************************/
+#define QE_NENGINES (sizeof(qe_engines) / sizeof(qe_engines[0]))
 
-void
-gkstr_free(stream_t *stream)
+/* A sketch around impl, which it takes over. NULL if impl is. */
+static sketch_t *
+qesk_wrap(const qe_engine_t *engine, void *impl)
 {
-  size_t i;
-  const size_t n = ptrarray_nelems(stream->summaries);
-  gksummary_t **t = (gksummary_t **)ptrarray_data_pointer(stream->summaries);
+  sketch_t *sk;
 
-  for (i = 0; i < n; ++i)
-    gks_free(t[i]);
+  if (impl == NULL)
+    return NULL;
+  sk = (sketch_t *)QE_MALLOC(sizeof(sketch_t));
+  if (sk == NULL) {
+    engine->destroy(impl);
+    return NULL;
+  }
+  sk->engine = engine;
+  sk->impl = impl;
 
-  ptrarray_free(stream->summaries);
-  free(stream);
+  return sk;
 }
 
-stream_t *
-gkstr_new(double epsilon, int n)
+sketch_t *
+qesk_new(const char *engine, double epsilon, qe_count_t n)
 {
-  const double epsN = epsilon * (double)n;
-  const int b = (int)floor(log(epsN) / epsilon);
-  stream_t *stream;
-  gksummary_t *gk;
-
-  if (b < 0)
-    return NULL; /* FIXME error handling */
-
-  stream = (stream_t *)malloc(sizeof(stream_t));
-  if (stream == NULL)
-    return NULL; /* FIXME error handling */
-
-  stream->n = n;
-  stream->b = b;
+  size_t i;
 
-  stream->summaries = ptrarray_make(2, 0);
-  if (stream->summaries == NULL) {
-    free(stream);
-    return NULL;
+  for (i = 0; i < QE_NENGINES; ++i) {
+    if (strcmp(qe_engines[i]->name, engine) == 0)
+      return qesk_wrap(qe_engines[i], qe_engines[i]->create(epsilon, n));
   }
 
-  gk = gks_new((size_t)b);
-  if (gk == NULL) {
-    gkstr_free(stream);
-    return NULL;
-  }
-  ptrarray_push(stream->summaries, gk);
+  return NULL;
+}
 
-  return stream;
+void
+qesk_free(sketch_t *sk)
+{
+  sk->engine->destroy(sk->impl);
+  QE_FREE(sk);
 }
 
-static int
-gkstr_tuple_cmp(const void *p1, const void *p2)
+const char *
+qesk_engine(const sketch_t *sk)
 {
-  tuple_t *t1 = (tuple_t *)p1;
-  tuple_t *t2 = (tuple_t *)p2;
+  return sk->engine->name;
+}
 
-  /* Do not need stable sort */
-  return (t1->v < t2->v)  ? -1 : 1;
+stream_t *
+qesk_stream(sketch_t *sk)
+{
+  return sk->engine == &qe_engine_gk ? (stream_t *)sk->impl : NULL;
 }
 
 int
-gkstr_update(stream_t *stream, double e)
+qesk_update(sketch_t *sk, double e)
 {
-  tuple_t *tuple;
-  gksummary_t **gks = (gksummary_t **)ptrarray_data_pointer(stream->summaries);
-  gksummary_t *gk = gks[0];
-  gksummary_t *tmp_summary;
-  const size_t ntuples = gks_len(gk);
-  tuple_t **tuples = QE_GET_TUPLES(gk);
-  size_t k;
-  size_t n_summaries;
+  return sk->engine->update(sk->impl, e);
+}
 
-  tuple = gktuple_new();
-  if (tuple == NULL)
-    return 1;
-  tuple->v = e;
-  tuple->g = 1;
-  tuple->delta = 0;
+int
+qesk_update_many(sketch_t *sk, const double *vals, size_t n)
+{
+  return sk->engine->update_many(sk->impl, vals, n);
+}
 
-  ptrarray_push(gk, tuple);
-  if (ntuples+1 < (size_t)stream->b)
-    return 0; /* done */
+int
+qesk_merge(sketch_t *dst, sketch_t *src)
+{
+  if (dst == src || dst->engine != src->engine)
+    return 1;
+  return dst->engine->merge(dst->impl, src->impl);
+}
 
-  /* -----------------------------------
-   * Level 0 is full... PACK IT UP !!!
-   * ----------------------------------- */
+int
+qesk_merge_many(sketch_t **sketches, size_t k, int nthreads)
+{
+  stream_t **streams;
+  size_t i;
+  int failed = 0;
 
-  /* TODO nlogn */
-  /* FIXME validate ptrs and derefs... */
-  qsort((void *)*tuples, ntuples, sizeof(tuple_t *), gkstr_tuple_cmp);
+  for (i = 1; i < k; ++i) {
+    if (sketches[i]->engine != sketches[0]->engine)
+      return 1;
+  }
+  if (qe_has_duplicates((void *const *)sketches, k))
+    return 1;
 
-  gks_merge_values(gk);
+  if (k < 2 || sketches[0]->engine != &qe_engine_gk) {
+    for (i = 1; i < k; ++i)
+      failed |= qesk_merge(sketches[0], sketches[i]);
+    return failed;
+  }
 
-  tmp_summary = gks_prune(gk, (stream->b+1)/2+1);
-  gks_clear(gk); /* TODO this frees the tuples, but they could have instead been stolen */
+  streams = QE_MALLOC(k * sizeof(stream_t *));
+  if (streams == NULL)
+    return 1;
+  for (i = 0; i < k; ++i)
+    streams[i] = (stream_t *)sketches[i]->impl;
+  failed = gkstr_merge_many(streams, k, nthreads);
+  QE_FREE(streams);
 
-  n_summaries = ptrarray_nelems(stream->summaries);
-  for (k = 1; k < n_summaries; ++k) {
-    gksummary_t *tmp;
+  return failed;
+}
 
-    if (gks_len(gks[k]) == 0) {
-      /* --------------------------------------
-       * Empty: put compressed summary in sk
-       * -------------------------------------- */
-      gks_free(gks[k]); /* FIXME this is just terrible. Such a waste! */
-      gks[k] = tmp_summary; /* Store it */
-      return 0;
-    }
+qe_count_t
+qesk_count(sketch_t *sk)
+{
+  return sk->engine->count(sk->impl);
+}
 
-    /* --------------------------------------
-     * sk contained a compressed summary
-     * -------------------------------------- */
+double
+qesk_error_bound(sketch_t *sk)
+{
+  return sk->engine->error_bound(sk->impl);
+}
 
-    /* here we're merging two summaries with s.b * 2^k entries each */
-    /* The gks_merge takes ownership of the two summaries passed in */
-    tmp = gks_merge(
-      gks[k],
-      tmp_summary,
-      stream->epsilon,
-      stream->b * (1<<((unsigned int)k)),
-      stream->b * (1<<((unsigned int)k))
-    );
-    tmp_summary = gks_prune(tmp, (stream->b+1)/2+1);
-    /* NOTE: tmp_summary is used in next iteration
-     * -  it is passed to the next level ! */
+int
+qesk_finish(sketch_t *sk)
+{
+  return sk->engine->finish(sk->impl);
+}
 
-    gks[k] = gks_new(stream->b); /* Re-initialize FIXME avoid alloc */
-  }
+double
+qesk_query(sketch_t *sk, double q)
+{
+  double out;
 
-  /* fell off the end of our loop -- no more stream->summaries entries */
-  ptrarray_push(stream->summaries, tmp_summary);
-  return 0;
+  qesk_query_many(sk, &q, &out, 1);
+  return out;
 }
 
-/* !! Must call Finish to allow processing queries */
 void
-gkstream_finish(stream_t *s)
+qesk_query_many(sketch_t *sk, const double *qs, double *out, size_t k)
 {
-  gksummary_t **gks = (gksummary_t **)ptrarray_data_pointer(s->summaries);
-  gksummary_t *gk = gks[0];
-  const size_t ntuples = gks_len(gk);
-  tuple_t **tuples = QE_GET_TUPLES(gk);
-  size_t size;
-  size_t i;
-  size_t n_summaries = ptrarray_nelems(s->summaries);
-
-  /* TODO As per Damian, wouldn't have to merge into the summary at [0]. Could just use fresh summary to keep stream updateable. */
-  qsort((void *)*tuples, ntuples, sizeof(tuple_t *), gkstr_tuple_cmp);
-  gks_merge_values(gk);
-  size = gks_len(gk);
-
-  for (i = 1; i < n_summaries; ++i) {
-    gk = gks_merge(gk, gks[i], s->epsilon, size, s->b * (1<<((unsigned int)i)));
-    size += s->b * (1 << ((unsigned int)i));
-  }
-  gks[0] = gk; /* TODO see above */
+  if (sk->engine->finish(sk->impl))
+    qe_fill_nan(out, k);
+  else
+    sk->engine->query_many(sk->impl, qs, out, k);
 }
 
-/* GK query */
 double
-gkstream_query(stream_t *s, double q)
+qesk_rank(sketch_t *sk, double x)
 {
-  /* convert quantile to rank */
-  const int r = (int)(q * (double)s->n);
-  int rmin = 0;
-  int rmin_next;
-  size_t i;
-  gksummary_t **gks = (gksummary_t **)ptrarray_data_pointer(s->summaries);
-  gksummary_t *gk = gks[0];
-  const size_t ntuples = gks_len(gk);
-  tuple_t **tuples = QE_GET_TUPLES(gk);
+  return sk->engine->finish(sk->impl) ? NAN : sk->engine->rank(sk->impl, x);
+}
 
+void
+qesk_cdf_many(sketch_t *sk, const double *xs, double *out, size_t k)
+{
+  if (sk->engine->finish(sk->impl))
+    qe_fill_nan(out, k);
+  else
+    sk->engine->cdf_many(sk->impl, xs, out, k);
+}
 
-  for (i = 0; i < ntuples; ++i) {
-    tuple_t *t = tuples[i];
+size_t
+qesk_serialized_size(sketch_t *sk)
+{
+  return sk->engine->serialized_size(sk->impl);
+}
 
-    if (i+1 == ntuples)
-      return t->v;
+size_t
+qesk_serialize(sketch_t *sk, unsigned char *buf, size_t size)
+{
+  return sk->engine->serialize(sk->impl, buf, size);
+}
 
-    rmin += t->g;
-    rmin_next = rmin + tuples[i+1]->g;
+sketch_t *
+qesk_deserialize(const unsigned char *buf, size_t len)
+{
+  size_t i;
 
-    if (rmin <= r && r < rmin_next)
-      return t->v;
+  for (i = 0; i < QE_NENGINES && len >= 4; ++i) {
+    if (memcmp(buf, qe_engines[i]->magic, 4) == 0)
+      return qesk_wrap(qe_engines[i], qe_engines[i]->deserialize(buf, len));
   }
 
-  abort(); /* not reached */
+  return NULL;
 }
 
-
+size_t
+qesk_memory_usage(sketch_t *sk)
+{
+  return sizeof(sketch_t) + sk->engine->memory_usage(sk->impl);
+}
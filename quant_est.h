@@ -1,14 +1,223 @@
 #ifndef QUANT_EST_H_
 #define QUANT_EST_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct stream_struct stream_t;
 
-stream_t * gkstr_new(double epsilon, int n);
+/* Element counts and ranks */
+typedef uint64_t qe_count_t;
+
+stream_t * gkstr_new(double epsilon, qe_count_t n);
+/* For streams whose length isn't known up front. Grows the block size
+ * as the stream grows, at the cost of a bit more memory than gkstr_new
+ * with the right n would use. */
+stream_t * gkstr_new_unbounded(double epsilon);
 void gkstr_free(stream_t *stream);
 
 int gkstr_update(stream_t *stream, double e);
+/* Same as calling gkstr_update for each of the n values, but copies
+ * them into level 0 a block at a time. */
+int gkstr_update_many(stream_t *stream, const double *vals, size_t n);
+/* Moves the packing up of full blocks of updates to a background
+ * thread, so that updates just store the value (but wait if the thread
+ * hasn't finished the previous block yet). Everything else waits for
+ * the thread to be done first. Errors of the thread are returned by
+ * later calls. Returns non-zero if the thread can't be started, or
+ * if built without threads. */
+int gkstr_start_background(stream_t *stream);
+/* Number of elements seen so far */
+qe_count_t gkstr_count(stream_t *stream);
+/* Merges everything src has seen into dst, as if dst had seen it, too.
+ * src is left alone apart from being finished. Bounded streams with the
+ * same epsilon and n (or block size) merge level by level and stay
+ * compact. Other streams merge without loss until dst has taken in
+ * summaries of about 16/epsilon tuples that way. After that, they are
+ * compressed into dst's levels, which adds dst's own error to theirs,
+ * see gkstr_error_bound. Returns non-zero on OOM or if dst and src are
+ * the same stream. */
+int gkstr_merge(stream_t *dst, stream_t *src);
+/* Merges all k streams into streams[0], as a balanced binary tree of
+ * gkstr_merge calls, log2(k) rounds deep. The merges of each round run
+ * on up to nthreads threads. The other streams end up with parts of the
+ * tree merged into them, so only streams[0] is meaningful afterwards.
+ * The result is the same for any nthreads. Streams that are compressed
+ * while merging (see gkstr_merge) can be at every level of the tree,
+ * and each of those levels adds epsilon to the error bound. Returns
+ * non-zero on OOM or if a stream appears twice. */
+int gkstr_merge_many(stream_t **streams, size_t k, int nthreads);
+/* The guaranteed rank error of queries, as a fraction of the number of
+ * elements. That's epsilon, or after merging streams with different
+ * epsilons, the largest of them, plus epsilon for streams that were
+ * compressed into the levels while merging. */
+double gkstr_error_bound(stream_t *stream);
+/* Bytes of memory the stream holds (not counting published snapshots) */
+size_t gkstr_memory_usage(stream_t *stream);
 
-void gkstream_finish(stream_t *s);
+/* Brings the summary that queries use up to date with the updates so
+ * far. The stream can still be updated afterwards; call it again to
+ * make later updates visible to queries. Until the stream has seen a
+ * block of values (log(epsilon*n)/epsilon of them), it keeps them all,
+ * finishing just sorts them and queries are exact. The first block
+ * that gets packed up ends that, and queries return NaN until the next
+ * finish. */
+int gkstream_finish(stream_t *s);
+/* Non-zero if the stream has been finished since its last update */
+int gkstream_is_current(stream_t *s);
+/* Returns NaN if the stream hasn't been finished or has no data */
 double gkstream_query(stream_t *s, double q);
+/* Answers k quantile queries at once, writing the results to out.
+ * Fastest with the quantiles in ascending order. */
+void gkstream_query_many(stream_t *s, const double *qs, double *out, size_t k);
+/* The other way around: the estimated number of elements <= x, within
+ * epsilon*N of the true number. NaN if there's nothing to query. */
+double gkstream_rank(stream_t *s, double x);
+/* The estimated fraction of elements <= x for each of the k values in
+ * xs, written to out. Fastest with xs in ascending order. */
+void gkstream_cdf_many(stream_t *s, const double *xs, double *out, size_t k);
+
+/* Serialization to a compact, portable binary format (documented in
+ * quant_est.c). gkstr_serialized_size gives an upper bound of the size
+ * of the serialized stream. gkstr_serialize writes it to buf and returns
+ * the number of bytes written, or 0 if size is too small.
+ * gkstr_deserialize returns NULL on malformed input or OOM. */
+size_t gkstr_serialized_size(stream_t *s);
+size_t gkstr_serialize(stream_t *s, unsigned char *buf, size_t size);
+stream_t * gkstr_deserialize(const unsigned char *buf, size_t len);
+
+/* A registry of many streams with the same epsilon and n (0 for
+ * unbounded streams), looked up by integer or string keys. The streams
+ * are allocated in slabs and hold no buffers until they get values, so
+ * idle streams are cheap. Up to the block size (a few hundred values
+ * for typical epsilons), a stream keeps all its values and answers
+ * queries exactly. The streams belong to the registry and must not be
+ * passed to gkstr_free. */
+typedef struct registry_struct registry_t;
+/* Called for each stream by gkreg_each. key is NULL for integer keys.
+ * A non-zero return value stops the iteration. */
+typedef int (*gkreg_each_cb)(void *ctx, const char *key, size_t keylen,
+                             uint64_t ikey, stream_t *s);
+
+/* Returns NULL if epsilon and n won't do for gkstr_new(_unbounded) */
+registry_t * gkreg_new(double epsilon, qe_count_t n);
+void gkreg_free(registry_t *reg);
+/* The stream for key, created if there's none yet. NULL on OOM. */
+stream_t * gkreg_get(registry_t *reg, uint64_t key);
+stream_t * gkreg_get_str(registry_t *reg, const char *key, size_t len);
+/* The stream for key, or NULL if there's none */
+stream_t * gkreg_find(registry_t *reg, uint64_t key);
+stream_t * gkreg_find_str(registry_t *reg, const char *key, size_t len);
+/* Number of streams */
+size_t gkreg_size(registry_t *reg);
+/* Calls cb for every stream, in no particular order. Returns the first
+ * non-zero return value of cb, or 0. The registry must not be changed
+ * from within cb, but the streams may be. */
+int gkreg_each(registry_t *reg, gkreg_each_cb cb, void *ctx);
+
+#ifndef QE_NO_THREADS
+/* A front-end for updating one stream from many threads. Each of the
+ * nshards shards has its own level 0, and only full blocks, compressed
+ * by the thread that filled them, go to the shared levels through a
+ * lock-free queue. Threads should use distinct shard_ids (any int, taken
+ * modulo nshards) so that they don't contend for a shard. Only for
+ * streams of known length n. */
+typedef struct sharded_struct sharded_t;
+
+sharded_t * gkshard_new(double epsilon, qe_count_t n, int nshards);
+void gkshard_free(sharded_t *sh);
+int gkshard_update(sharded_t *sh, int shard_id, double e);
+int gkshard_update_many(sharded_t *sh, int shard_id, const double *vals, size_t n);
+/* A finished stream with everything added so far, for queries. The
+ * caller owns it. Returns NULL on OOM. */
+stream_t * gkshard_snapshot(sharded_t *sh);
+
+/* Published snapshots: immutable copies of the finished summary that
+ * other threads can query while the stream keeps being updated.
+ * gkstr_publish is called by the thread that updates the stream. It
+ * finishes the stream and replaces the published snapshot. Old
+ * snapshots are freed once no reader can see them any more.
+ * Readers (up to 64 at a time) register once the stream has been
+ * published for the first time. gkstr_reader_register returns the
+ * reader's id, or -1 if there's none left or nothing has been
+ * published. Between gkstr_read_begin and gkstr_read_end, the snapshot
+ * returned by gkstr_read_begin stays valid. None of these block. */
+typedef struct qe_snapshot_struct qe_snapshot_t;
+
+int gkstr_publish(stream_t *s);
+int gkstr_reader_register(stream_t *s);
+void gkstr_reader_unregister(stream_t *s, int reader);
+const qe_snapshot_t * gkstr_read_begin(stream_t *s, int reader);
+void gkstr_read_end(stream_t *s, int reader);
+/* Same as the gkstream_ query functions */
+qe_count_t gksnap_count(const qe_snapshot_t *snap);
+double gksnap_query(const qe_snapshot_t *snap, double q);
+void gksnap_query_many(const qe_snapshot_t *snap, const double *qs, double *out, size_t k);
+double gksnap_rank(const qe_snapshot_t *snap, double x);
+void gksnap_cdf_many(const qe_snapshot_t *snap, const double *xs, double *out, size_t k);
+#endif
+
+/* Sketches: one API over several quantile sketch engines, so that the
+ * engine can be picked per use (eg. per metric) without changing the
+ * code that feeds and queries it. The engines are
+ *   "gk"      the streams above, with a guaranteed rank error of epsilon
+ *   "kll"     the KLL sketch of Karnin, Lang and Liberty: much smaller,
+ *             with O(1) amortized updates, but the rank error is only
+ *             within epsilon with high probability (99%)
+ *   "tdigest" the merging t-digest of Dunning and Ertl, for the far
+ *             tails: the error shrinks with the distance to the nearer
+ *             end, to about epsilon * min(q, 1-q) near the quantile q,
+ *             and is typically far below epsilon in the middle, but
+ *             nothing is guaranteed
+ * n is the expected number of elements, or 0 if it isn't known. Only
+ * "gk" makes use of it. The functions work like their stream
+ * counterparts. */
+typedef struct sketch_struct sketch_t;
+
+/* NULL for unknown engines, if epsilon and n won't do, or on OOM */
+sketch_t * qesk_new(const char *engine, double epsilon, qe_count_t n);
+void qesk_free(sketch_t *sk);
+/* The name of the sketch's engine */
+const char * qesk_engine(const sketch_t *sk);
+/* The stream of a "gk" sketch, for what only streams can do. NULL for
+ * other engines. */
+stream_t * qesk_stream(sketch_t *sk);
+int qesk_update(sketch_t *sk, double e);
+int qesk_update_many(sketch_t *sk, const double *vals, size_t n);
+/* Also fails for sketches of different engines */
+int qesk_merge(sketch_t *dst, sketch_t *src);
+/* For "gk" sketches, gkstr_merge_many. Other engines merge the sketches
+ * into sketches[0] one after the other, and leave them alone. Fails if
+ * a sketch appears twice. */
+int qesk_merge_many(sketch_t **sketches, size_t k, int nthreads);
+qe_count_t qesk_count(sketch_t *sk);
+double qesk_error_bound(sketch_t *sk);
+/* Brings what the queries read up to date, see gkstream_finish. The
+ * queries call it themselves, and return NaN if it fails (on OOM). */
+int qesk_finish(sketch_t *sk);
+double qesk_query(sketch_t *sk, double q);
+void qesk_query_many(sketch_t *sk, const double *qs, double *out, size_t k);
+double qesk_rank(sketch_t *sk, double x);
+void qesk_cdf_many(sketch_t *sk, const double *xs, double *out, size_t k);
+/* Each engine has its own format, "gk" the one of gkstr_serialize.
+ * qesk_deserialize tells them apart. */
+size_t qesk_serialized_size(sketch_t *sk);
+size_t qesk_serialize(sketch_t *sk, unsigned char *buf, size_t size);
+sketch_t * qesk_deserialize(const unsigned char *buf, size_t len);
+/* Bytes of memory the sketch holds */
+size_t qesk_memory_usage(sketch_t *sk);
+
+/* Which of the CPU specific variants of the hot kernels is in use:
+ * "avx512", "avx2", "sse2" (the x86-64 baseline) or "generic". They
+ * all give bit for bit the same results: the t-digest's sums are added
+ * up in four lanes, combined as (a0 + a1) + (a2 + a3), whatever the
+ * vector width. */
+const char * gkstr_cpu_variant(void);
+
+#if DEBUG
+/* Number of malloc/calloc/realloc/free calls the library has made so far.
+ * Only available in debug builds, for the tests. */
+unsigned long gkstr_debug_nalloc_calls(void);
+#endif
 
 #endif
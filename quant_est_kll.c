@@ -0,0 +1,858 @@
+#include "qe_internal.h"
+#include "qe_sort.h"
+
+/**************************************************
+ * KLL sketch
+ **************************************************/
+
+/* Karnin, Lang and Liberty, "Optimal Quantile Approximation in Streams"
+ * (FOCS 2016), laid out the way the DataSketches library does it.
+ * Level h holds items that stand for 2^h elements each, and levels 1
+ * and up are sorted. All levels share one buffer, with the free space
+ * at the bottom: level h is items[levels[h] .. levels[h+1]), and
+ * updates go to items[--levels[0]]. Once the buffer is full, the lowest
+ * level at its capacity is compacted: sorted, every other item
+ * (starting with a random one of the first two) goes up a level, and
+ * the rest is dropped. The capacities shrink by 2/3 per level from k at
+ * the top down, so there are O(k) items in all, and an update costs
+ * O(1) amortized. Unlike GK, the rank error is only within epsilon with
+ * high probability. */
+
+/* Smallest capacity of a level, and the largest k */
+#define QE_KLL_MIN_CAP 8
+#define QE_KLL_MAX_K 65535
+/* Items of level h weigh 2^h, and counts are 64 bits */
+#define QE_KLL_MAX_LEVELS 64
+/* Sketches flip their coins in the same order, so that the results
+ * are reproducible */
+#define QE_KLL_SEED UINT64_C(0x2545f4914f6cdd1d)
+
+typedef struct {
+  unsigned int k;
+  double error; /* epsilon, or after merges, the largest of them */
+  qe_count_t count;
+  double min; /* the extremes, which the compactions may have dropped */
+  double max;
+  double *items;
+  size_t levels[QE_KLL_MAX_LEVELS + 1]; /* levels[nlevels] is the size of items */
+  unsigned int nlevels;
+  uint64_t rng; /* splitmix64 state for the coin flips */
+  uint64_t *sort_scratch; /* for sorting level 0 */
+  size_t sort_scratch_size; /* N values it can sort */
+  /* Queries are answered from all items sorted by value, with their
+   * cumulative weights, as built by kll_finish */
+  double *view_v;
+  qe_count_t *view_rmin;
+  size_t view_len;
+  size_t view_size; /* N entries allocated */
+  qe_count_t view_count; /* count at the last finish */
+} qe_kll_t;
+
+/* The capacity of level h of nlevels: k * (2/3)^depth, rounded, with
+ * depth the distance from the top level. Integer arithmetic, so that it
+ * comes out the same everywhere. */
+QE_STATIC_INLINE size_t
+kll_level_capacity(unsigned int k, unsigned int nlevels, unsigned int h)
+{
+  const unsigned int depth = nlevels - h - 1;
+  uint64_t pow3 = 1;
+  uint64_t cap;
+  unsigned int i;
+
+  if (depth > 30)
+    return QE_KLL_MIN_CAP;
+  for (i = 0; i < depth; ++i)
+    pow3 *= 3;
+  cap = (((uint64_t)2 * k << depth) / pow3 + 1) / 2;
+
+  return cap < QE_KLL_MIN_CAP ? QE_KLL_MIN_CAP : (size_t)cap;
+}
+
+static size_t
+kll_capacity(unsigned int k, unsigned int nlevels)
+{
+  size_t cap = 0;
+  unsigned int h;
+
+  for (h = 0; h < nlevels; ++h)
+    cap += kll_level_capacity(k, nlevels, h);
+
+  return cap;
+}
+
+QE_STATIC_INLINE size_t
+kll_level_len(const qe_kll_t *kll, unsigned int h)
+{
+  return kll->levels[h+1] - kll->levels[h];
+}
+
+/* N items in all levels */
+QE_STATIC_INLINE size_t
+kll_nitems(const qe_kll_t *kll)
+{
+  return kll->levels[kll->nlevels] - kll->levels[0];
+}
+
+/* 0 or 1, from splitmix64 */
+QE_STATIC_INLINE unsigned int
+kll_coin(qe_kll_t *kll)
+{
+  uint64_t z = (kll->rng += UINT64_C(0x9e3779b97f4a7c15));
+
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return (unsigned int)((z ^ (z >> 31)) >> 63);
+}
+
+/* Sorts n values of level 0. Returns non-zero on OOM. */
+static int
+kll_sort(qe_kll_t *kll, double *vals, size_t n)
+{
+  if (n > QE_SORT_INSERTION_MAX && n > kll->sort_scratch_size) {
+    uint64_t *scratch = QE_REALLOC(kll->sort_scratch, 2 * n * sizeof(uint64_t));
+    if (scratch == NULL)
+      return 1;
+    kll->sort_scratch = scratch;
+    kll->sort_scratch_size = n;
+  }
+  qe_kernels.sort_doubles(vals, n, kll->sort_scratch);
+
+  return 0;
+}
+
+/* Keeps every other one of the n (even) items at buf, starting with the
+ * first one or the second one, in the lower half of buf */
+QE_STATIC_INLINE void
+kll_halve_down(double *buf, size_t n, unsigned int offset)
+{
+  size_t i;
+
+  for (i = 0; i < n/2; ++i)
+    buf[i] = buf[2*i + offset];
+}
+
+/* Same in the upper half: from the top down, so that every item is read
+ * before its slot gets overwritten */
+QE_STATIC_INLINE void
+kll_halve_up(double *buf, size_t n, unsigned int offset)
+{
+  size_t i;
+
+  for (i = n/2; i-- > 0; )
+    buf[n/2 + i] = buf[2*i + offset];
+}
+
+/* Merges the sorted arrays a and b into out. out may overlap b if it
+ * starts at least na items before it, and a ends before out. */
+static void
+kll_merge_sorted(const double *a, size_t na, const double *b, size_t nb, double *out)
+{
+  size_t i = 0, j = 0;
+
+  while (i < na && j < nb)
+    *out++ = b[j] < a[i] ? b[j++] : a[i++];
+  while (i < na)
+    *out++ = a[i++];
+  if (out != b + j)
+    memmove(out, b + j, (nb - j) * sizeof(double));
+}
+
+/* Puts an empty level on top of the full buffer, which grows by the
+ * capacity of the new level 0. Returns non-zero on OOM. */
+static int
+kll_add_level(qe_kll_t *kll)
+{
+  const size_t size = kll->levels[kll->nlevels];
+  size_t grow;
+  double *items;
+  unsigned int h;
+
+  if (kll->nlevels == QE_KLL_MAX_LEVELS)
+    return 1;
+  grow = kll_level_capacity(kll->k, kll->nlevels + 1, 0);
+  items = QE_REALLOC(kll->items, (size + grow) * sizeof(double));
+  if (items == NULL)
+    return 1;
+  memmove(items + grow, items, size * sizeof(double));
+
+  for (h = 0; h <= kll->nlevels; ++h)
+    kll->levels[h] += grow;
+  ++kll->nlevels;
+  kll->levels[kll->nlevels] = size + grow;
+  kll->items = items;
+  return 0;
+}
+
+/* Makes room in the full buffer by compacting the lowest level at its
+ * capacity, or the top level, which first gets a new level above it.
+ * The surviving half of the level is merged into the level above it,
+ * and the levels below move up into the space that was freed.
+ * Returns non-zero on OOM. */
+static int
+kll_compress(qe_kll_t *kll)
+{
+  double *items;
+  size_t raw_beg, raw_end, raw_pop, pop_above, adj_beg, half;
+  unsigned int h;
+
+  for (h = 0; h + 1 < kll->nlevels; ++h) {
+    if (kll_level_len(kll, h) >= kll_level_capacity(kll->k, kll->nlevels, h))
+      break;
+  }
+  if (h + 1 == kll->nlevels && kll_add_level(kll))
+    return 1;
+
+  items = kll->items;
+  raw_beg = kll->levels[h];
+  raw_end = kll->levels[h+1];
+  raw_pop = raw_end - raw_beg;
+  pop_above = kll->levels[h+2] - raw_end;
+  /* an odd one out stays behind */
+  adj_beg = raw_beg + (raw_pop & 1);
+  half = raw_pop / 2;
+
+  if (h == 0 && kll_sort(kll, items + adj_beg, 2 * half))
+    return 1;
+  if (pop_above == 0) {
+    kll_halve_up(items + adj_beg, 2 * half, kll_coin(kll));
+  }
+  else {
+    kll_halve_down(items + adj_beg, 2 * half, kll_coin(kll));
+    kll_merge_sorted(items + adj_beg, half, items + raw_end, pop_above, items + adj_beg + half);
+  }
+
+  kll->levels[h+1] -= half;
+  if (raw_pop & 1) {
+    kll->levels[h] = kll->levels[h+1] - 1;
+    items[kll->levels[h]] = items[raw_beg];
+  }
+  else {
+    kll->levels[h] = kll->levels[h+1];
+  }
+
+  if (h > 0) {
+    const size_t below = kll->levels[0];
+    unsigned int i;
+    memmove(items + below + half, items + below, (raw_beg - below) * sizeof(double));
+    for (i = 0; i < h; ++i)
+      kll->levels[i] += half;
+  }
+
+  return 0;
+}
+
+/* A sketch with a buffer of capacity items and a single empty level */
+static qe_kll_t *
+kll_alloc(unsigned int k, size_t capacity)
+{
+  qe_kll_t *kll = (qe_kll_t *)QE_CALLOC(1, sizeof(qe_kll_t));
+
+  if (kll == NULL)
+    return NULL;
+  kll->items = QE_MALLOC(capacity * sizeof(double));
+  if (kll->items == NULL) {
+    QE_FREE(kll);
+    return NULL;
+  }
+  kll->k = k;
+  kll->nlevels = 1;
+  kll->levels[0] = kll->levels[1] = capacity;
+  kll->rng = QE_KLL_SEED;
+
+  return kll;
+}
+
+static void
+kll_free(qe_kll_t *kll)
+{
+  QE_FREE(kll->items);
+  QE_FREE(kll->sort_scratch);
+  QE_FREE(kll->view_v);
+  QE_FREE(kll->view_rmin);
+  QE_FREE(kll);
+}
+
+/* The k for a rank error of epsilon with 99% confidence, from the
+ * empirical fit epsilon = 2.296 / k^0.9723 of the DataSketches library.
+ * 0 if there's none. */
+static unsigned int
+kll_k_for_epsilon(double epsilon)
+{
+  double k;
+
+  if (!(epsilon > 0. && epsilon < 1.))
+    return 0;
+  k = ceil(pow(2.296 / epsilon, 1. / 0.9723));
+  if (k < QE_KLL_MIN_CAP)
+    k = QE_KLL_MIN_CAP;
+
+  return k > QE_KLL_MAX_K ? 0 : (unsigned int)k;
+}
+
+static qe_kll_t *
+kll_new(double epsilon)
+{
+  const unsigned int k = kll_k_for_epsilon(epsilon);
+  qe_kll_t *kll;
+
+  if (k == 0)
+    return NULL;
+  kll = kll_alloc(k, k);
+  if (kll == NULL)
+    return NULL;
+  kll->error = epsilon;
+
+  return kll;
+}
+
+QE_STATIC_INLINE int
+kll_update(qe_kll_t *kll, double e)
+{
+  if (kll->levels[0] == 0 && kll_compress(kll))
+    return 1;
+
+  kll->items[--kll->levels[0]] = e;
+  if (kll->count == 0 || e < kll->min)
+    kll->min = e;
+  if (kll->count == 0 || e > kll->max)
+    kll->max = e;
+  ++kll->count;
+  return 0;
+}
+
+/* Same as kll_update for each value, with the values stored in the
+ * same (reversed) order */
+static int
+kll_update_many(qe_kll_t *kll, const double *vals, size_t n)
+{
+  while (n > 0) {
+    double *dst;
+    double min, max;
+    size_t chunk, i;
+
+    if (kll->levels[0] == 0 && kll_compress(kll))
+      return 1;
+    chunk = n < kll->levels[0] ? n : kll->levels[0];
+    kll->levels[0] -= chunk;
+    dst = kll->items + kll->levels[0] + chunk - 1;
+
+    min = kll->count != 0 ? kll->min : vals[0];
+    max = kll->count != 0 ? kll->max : vals[0];
+    for (i = 0; i < chunk; ++i) {
+      const double e = vals[i];
+      dst[-(ptrdiff_t)i] = e;
+      min = e < min ? e : min;
+      max = e > max ? e : max;
+    }
+    kll->min = min;
+    kll->max = max;
+    kll->count += chunk;
+    vals += chunk;
+    n -= chunk;
+  }
+
+  return 0;
+}
+
+/* Compacts the levels of in, bounded by in_levels, into out, bottom up
+ * and each level at most once: while there are more items than the
+ * capacity, every level at its capacity is compacted into the one
+ * above. Compacting the top level adds a level, which adds capacity.
+ * in_levels needs room for two more entries than there are levels.
+ * Sets the new number of levels and the capacity for them. Returns
+ * non-zero on OOM. */
+static int
+kll_general_compress(qe_kll_t *kll, unsigned int *nlevels_p,
+                     double *in, size_t *in_levels,
+                     double *out, size_t *out_levels, size_t *capacity_p)
+{
+  unsigned int nlevels = *nlevels_p;
+  size_t nitems = in_levels[nlevels] - in_levels[0];
+  size_t capacity = kll_capacity(kll->k, nlevels);
+  unsigned int h;
+
+  out_levels[0] = 0;
+  for (h = 0; h < nlevels; ++h) {
+    const size_t raw_beg = in_levels[h];
+    const size_t raw_end = in_levels[h+1];
+    const size_t raw_pop = raw_end - raw_beg;
+
+    if (h + 1 == nlevels)
+      in_levels[h+2] = raw_end; /* an empty level above the top */
+
+    if (nitems < capacity || raw_pop < kll_level_capacity(kll->k, nlevels, h)) {
+      memcpy(out + out_levels[h], in + raw_beg, raw_pop * sizeof(double));
+      out_levels[h+1] = out_levels[h] + raw_pop;
+    }
+    else {
+      const size_t pop_above = in_levels[h+2] - raw_end;
+      const size_t adj_beg = raw_beg + (raw_pop & 1);
+      const size_t half = raw_pop / 2;
+
+      out_levels[h+1] = out_levels[h];
+      if (raw_pop & 1)
+        out[out_levels[h+1]++] = in[raw_beg];
+
+      if (h == 0 && kll_sort(kll, in + adj_beg, 2 * half))
+        return 1;
+      if (pop_above == 0) {
+        kll_halve_up(in + adj_beg, 2 * half, kll_coin(kll));
+      }
+      else {
+        kll_halve_down(in + adj_beg, 2 * half, kll_coin(kll));
+        kll_merge_sorted(in + adj_beg, half, in + raw_end, pop_above, in + adj_beg + half);
+      }
+      nitems -= half;
+      in_levels[h+1] -= half;
+
+      if (h + 1 == nlevels) {
+        if (nlevels == QE_KLL_MAX_LEVELS)
+          return 1;
+        ++nlevels;
+        capacity += kll_level_capacity(kll->k, nlevels, 0);
+      }
+    }
+  }
+
+  *nlevels_p = nlevels;
+  *capacity_p = capacity;
+  return 0;
+}
+
+/* Level h of src goes to level h of dst, where it weighs the same,
+ * whatever the k of either. The result is compacted until it fits. */
+static int
+kll_merge(qe_kll_t *dst, qe_kll_t *src)
+{
+  const unsigned int nlevels = dst->nlevels > src->nlevels ? dst->nlevels : src->nlevels;
+  const size_t n = kll_nitems(dst) + kll_nitems(src);
+  size_t in_levels[QE_KLL_MAX_LEVELS + 2];
+  size_t out_levels[QE_KLL_MAX_LEVELS + 2];
+  size_t capacity, nitems, pos = 0;
+  unsigned int h, new_nlevels = nlevels;
+  double *in, *out, *items;
+
+  if (dst == src)
+    return 1;
+  if (src->count == 0)
+    return 0;
+
+  in = QE_MALLOC(2 * n * sizeof(double));
+  if (in == NULL)
+    return 1;
+  out = in + n;
+
+  for (h = 0; h < nlevels; ++h) {
+    const size_t na = h < dst->nlevels ? kll_level_len(dst, h) : 0;
+    const size_t nb = h < src->nlevels ? kll_level_len(src, h) : 0;
+    const double *a = dst->items + (h < dst->nlevels ? dst->levels[h] : 0);
+    const double *b = src->items + (h < src->nlevels ? src->levels[h] : 0);
+
+    in_levels[h] = pos;
+    if (h == 0) {
+      memcpy(in, a, na * sizeof(double));
+      memcpy(in + na, b, nb * sizeof(double));
+    }
+    else {
+      kll_merge_sorted(a, na, b, nb, in + pos);
+    }
+    pos += na + nb;
+  }
+  in_levels[nlevels] = pos;
+
+  if (kll_general_compress(dst, &new_nlevels, in, in_levels, out, out_levels, &capacity)) {
+    QE_FREE(in);
+    return 1;
+  }
+  nitems = out_levels[new_nlevels];
+  if (capacity < nitems)
+    capacity = nitems;
+
+  /* the new buffer, with the free space at the bottom */
+  items = QE_MALLOC(capacity * sizeof(double));
+  if (items == NULL) {
+    QE_FREE(in);
+    return 1;
+  }
+  memcpy(items + capacity - nitems, out, nitems * sizeof(double));
+  for (h = 0; h <= new_nlevels; ++h)
+    dst->levels[h] = out_levels[h] + capacity - nitems;
+  QE_FREE(dst->items);
+  QE_FREE(in);
+  dst->items = items;
+  dst->nlevels = new_nlevels;
+
+  if (dst->count == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (dst->count == 0 || src->max > dst->max)
+    dst->max = src->max;
+  dst->count += src->count;
+  if (src->error > dst->error)
+    dst->error = src->error;
+  return 0;
+}
+
+/* Builds the sorted view of all items for the queries, merging the
+ * levels (after sorting level 0 in place). There are few levels, so
+ * each step just picks the smallest of their heads. The extremes stand
+ * in for the smallest and the largest item. Returns non-zero on OOM. */
+static int
+kll_finish(qe_kll_t *kll)
+{
+  const size_t n = kll_nitems(kll);
+  const double *items = kll->items;
+  size_t pos[QE_KLL_MAX_LEVELS];
+  qe_count_t rank = 0;
+  size_t i;
+  unsigned int h;
+
+  if (kll->view_count == kll->count)
+    return 0;
+
+  if (n > kll->view_size) {
+    double *v = QE_REALLOC(kll->view_v, n * sizeof(double));
+    qe_count_t *rmin;
+    if (v == NULL)
+      return 1;
+    kll->view_v = v;
+    rmin = QE_REALLOC(kll->view_rmin, n * sizeof(qe_count_t));
+    if (rmin == NULL)
+      return 1;
+    kll->view_rmin = rmin;
+    kll->view_size = n;
+  }
+  if (kll_sort(kll, kll->items + kll->levels[0], kll_level_len(kll, 0)))
+    return 1;
+
+  for (h = 0; h < kll->nlevels; ++h)
+    pos[h] = kll->levels[h];
+  for (i = 0; i < n; ++i) {
+    unsigned int best = kll->nlevels;
+    for (h = 0; h < kll->nlevels; ++h) {
+      if (pos[h] < kll->levels[h+1]
+          && (best == kll->nlevels || items[pos[h]] < items[pos[best]]))
+        best = h;
+    }
+    kll->view_v[i] = items[pos[best]++];
+    rank += (qe_count_t)1 << best;
+    kll->view_rmin[i] = rank;
+  }
+  if (n != 0) {
+    kll->view_v[0] = kll->min;
+    kll->view_v[n-1] = kll->max;
+  }
+
+  kll->view_len = n;
+  kll->view_count = kll->count;
+  return 0;
+}
+
+/* Sets up view for the finished sketch. Returns zero if there's nothing
+ * to query. */
+QE_STATIC_INLINE int
+kll_view(qe_kll_t *kll, qe_view_t *view)
+{
+  if (kll->view_len == 0 || kll->view_count != kll->count)
+    return 0;
+
+  view->v = kll->view_v;
+  view->delta = NULL;
+  view->rmin = kll->view_rmin;
+  view->ntuples = kll->view_len;
+  view->count = kll->view_count;
+  return 1;
+}
+
+static size_t
+kll_memory_usage(qe_kll_t *kll)
+{
+  return sizeof(qe_kll_t)
+         + kll->levels[kll->nlevels] * sizeof(double)
+         + kll->sort_scratch_size * 2 * sizeof(uint64_t)
+         + kll->view_size * (sizeof(double) + sizeof(qe_count_t));
+}
+
+/* Binary format, version 1, with the same conventions as that of the
+ * streams:
+ *
+ *   "QEKL"        magic
+ *   u8            format version (1)
+ *   u8            flags (none yet)
+ *   f64           the error bound
+ *   varint        k
+ *   varint        number of elements seen so far
+ *   f64           minimum
+ *   f64           maximum
+ *   varint        state of the random number generator
+ *   varint        capacity of the buffer
+ *   varint        number of levels, followed by the levels bottom up,
+ *                 each as the varint number of items and the items.
+ *                 Level 0 has the values as f64, in no particular
+ *                 order, the (sorted) levels above have them delta
+ *                 encoded as the values of summaries are.
+ */
+
+#define QE_KLL_SERIAL_MAGIC "QEKL"
+#define QE_KLL_SERIAL_VERSION 1
+
+static size_t
+kll_serialized_size(qe_kll_t *kll)
+{
+  return 4 + 1 + 1 + 3 * 8 + (5 + kll->nlevels) * QE_VARINT_MAX
+         + kll_level_len(kll, 0) * 8
+         + (kll_nitems(kll) - kll_level_len(kll, 0)) * QE_VARINT_MAX;
+}
+
+static size_t
+kll_serialize(qe_kll_t *kll, unsigned char *buf, size_t size)
+{
+  unsigned char *p = buf;
+  unsigned int h;
+  size_t i;
+
+  if (size < kll_serialized_size(kll))
+    return 0;
+
+  memcpy(p, QE_KLL_SERIAL_MAGIC, 4);
+  p += 4;
+  *p++ = QE_KLL_SERIAL_VERSION;
+  *p++ = 0;
+  p = qe_put_f64(p, kll->error);
+  p = qe_put_varint(p, kll->k);
+  p = qe_put_varint(p, kll->count);
+  p = qe_put_f64(p, kll->min);
+  p = qe_put_f64(p, kll->max);
+  p = qe_put_varint(p, kll->rng);
+  p = qe_put_varint(p, kll->levels[kll->nlevels]);
+
+  p = qe_put_varint(p, kll->nlevels);
+  for (h = 0; h < kll->nlevels; ++h) {
+    const double *items = kll->items + kll->levels[h];
+    const size_t len = kll_level_len(kll, h);
+    uint64_t prev = 0;
+
+    p = qe_put_varint(p, len);
+    for (i = 0; i < len; ++i) {
+      if (h == 0) {
+        p = qe_put_f64(p, items[i]);
+      }
+      else {
+        const uint64_t key = qe_sort_double_to_key(items[i]);
+        p = qe_put_varint(p, key - prev);
+        prev = key;
+      }
+    }
+  }
+
+  return (size_t)(p - buf);
+}
+
+/* Reads the nlevels levels into the fresh sketch kll, whose buffer has
+ * the capacity, and checks that their weights add up to the count.
+ * Returns non-zero on malformed input. */
+static int
+kll_deserialize_levels(qe_kll_t *kll, qe_reader_t *r, unsigned int nlevels)
+{
+  const size_t capacity = kll->levels[kll->nlevels];
+  qe_count_t weight = 0;
+  size_t pos = 0;
+  unsigned int h;
+  size_t i;
+
+  /* bottom up from the start of the buffer, moved to its top at the end */
+  for (h = 0; h < nlevels; ++h) {
+    const uint64_t len = qe_get_varint(r);
+    uint64_t key = 0;
+
+    if (r->p == NULL || len > capacity - pos)
+      return 1;
+    kll->levels[h] = pos;
+    for (i = 0; i < len; ++i) {
+      if (h == 0) {
+        kll->items[pos + i] = qe_get_f64(r);
+      }
+      else {
+        const uint64_t next = key + qe_get_varint(r);
+        if (next < key)
+          return 1; /* not sorted */
+        key = next;
+        kll->items[pos + i] = qe_sort_key_to_double(key);
+      }
+    }
+    pos += (size_t)len;
+    if (len > (~(qe_count_t)0 - weight) >> h)
+      return 1;
+    weight += (qe_count_t)len << h;
+  }
+  if (r->p != r->end || weight != kll->count)
+    return 1;
+
+  memmove(kll->items + capacity - pos, kll->items, pos * sizeof(double));
+  kll->nlevels = nlevels;
+  for (h = 0; h < nlevels; ++h)
+    kll->levels[h] += capacity - pos;
+  kll->levels[nlevels] = capacity;
+  return 0;
+}
+
+static qe_kll_t *
+kll_deserialize(const unsigned char *buf, size_t len)
+{
+  qe_reader_t r;
+  qe_kll_t *kll;
+  double error, min, max;
+  uint64_t k, count, rng, capacity, nlevels;
+
+  if (len < 6 || memcmp(buf, QE_KLL_SERIAL_MAGIC, 4) != 0
+      || buf[4] != QE_KLL_SERIAL_VERSION || buf[5] != 0)
+    return NULL;
+  r.p = buf + 6;
+  r.end = buf + len;
+
+  error = qe_get_f64(&r);
+  k = qe_get_varint(&r);
+  count = qe_get_varint(&r);
+  min = qe_get_f64(&r);
+  max = qe_get_f64(&r);
+  rng = qe_get_varint(&r);
+  capacity = qe_get_varint(&r);
+  nlevels = qe_get_varint(&r);
+  if (r.p == NULL || !(error > 0. && error < 1.)
+      || k < QE_KLL_MIN_CAP || k > QE_KLL_MAX_K
+      || nlevels < 1 || nlevels > QE_KLL_MAX_LEVELS
+      || (count != 0 && !(min <= max)))
+    return NULL;
+  /* the capacity is that of the levels, or a bit more after merges:
+   * garbage must not allocate huge buffers */
+  if (capacity < k || capacity > 2 * kll_capacity((unsigned int)k, (unsigned int)nlevels))
+    return NULL;
+
+  kll = kll_alloc((unsigned int)k, (size_t)capacity);
+  if (kll == NULL)
+    return NULL;
+  kll->error = error;
+  kll->count = count;
+  kll->min = min;
+  kll->max = max;
+  kll->rng = rng;
+
+  if (kll_deserialize_levels(kll, &r, (unsigned int)nlevels)) {
+    kll_free(kll);
+    return NULL;
+  }
+
+  return kll;
+}
+
+/* "kll" */
+
+static void *
+qe_kll_create(double epsilon, qe_count_t n)
+{
+  (void)n; /* the sketch doesn't depend on it */
+  return kll_new(epsilon);
+}
+
+static void
+qe_kll_destroy(void *impl)
+{
+  kll_free((qe_kll_t *)impl);
+}
+
+static int
+qe_kll_update(void *impl, double e)
+{
+  return kll_update((qe_kll_t *)impl, e);
+}
+
+static int
+qe_kll_update_many(void *impl, const double *vals, size_t n)
+{
+  return kll_update_many((qe_kll_t *)impl, vals, n);
+}
+
+static int
+qe_kll_merge(void *dst, void *src)
+{
+  return kll_merge((qe_kll_t *)dst, (qe_kll_t *)src);
+}
+
+static qe_count_t
+qe_kll_count(void *impl)
+{
+  return ((qe_kll_t *)impl)->count;
+}
+
+static double
+qe_kll_error_bound(void *impl)
+{
+  return ((qe_kll_t *)impl)->error;
+}
+
+static int
+qe_kll_finish(void *impl)
+{
+  return kll_finish((qe_kll_t *)impl);
+}
+
+static void
+qe_kll_query_many(void *impl, const double *qs, double *out, size_t k)
+{
+  qe_view_t view;
+
+  if (kll_view((qe_kll_t *)impl, &view))
+    qe_view_query_many(&view, qs, out, k);
+  else
+    qe_fill_nan(out, k);
+}
+
+static double
+qe_kll_rank(void *impl, double x)
+{
+  qe_view_t view;
+
+  return kll_view((qe_kll_t *)impl, &view) ? qe_view_rank(&view, x) : NAN;
+}
+
+static void
+qe_kll_cdf_many(void *impl, const double *xs, double *out, size_t k)
+{
+  qe_view_t view;
+
+  if (kll_view((qe_kll_t *)impl, &view))
+    qe_view_cdf_many(&view, xs, out, k);
+  else
+    qe_fill_nan(out, k);
+}
+
+static size_t
+qe_kll_serialized_size(void *impl)
+{
+  return kll_serialized_size((qe_kll_t *)impl);
+}
+
+static size_t
+qe_kll_serialize(void *impl, unsigned char *buf, size_t size)
+{
+  return kll_serialize((qe_kll_t *)impl, buf, size);
+}
+
+static void *
+qe_kll_deserialize(const unsigned char *buf, size_t len)
+{
+  return kll_deserialize(buf, len);
+}
+
+static size_t
+qe_kll_memory_usage(void *impl)
+{
+  return kll_memory_usage((qe_kll_t *)impl);
+}
+
+const qe_engine_t qe_engine_kll = {
+  "kll", QE_KLL_SERIAL_MAGIC,
+  qe_kll_create, qe_kll_destroy, qe_kll_update, qe_kll_update_many, qe_kll_merge,
+  qe_kll_count, qe_kll_error_bound, qe_kll_finish, qe_kll_query_many, qe_kll_rank,
+  qe_kll_cdf_many, qe_kll_serialized_size, qe_kll_serialize, qe_kll_deserialize,
+  qe_kll_memory_usage
+};
@@ -0,0 +1,235 @@
+#include "qe_internal.h"
+
+/**************************************************
+ * Published snapshots for lock-free readers
+ **************************************************/
+
+#ifndef QE_NO_THREADS
+
+/* An immutable copy of a finished summary. One allocation holds the
+ * struct and the arrays the view points to. */
+struct qe_snapshot_struct {
+  qe_view_t view;
+  /* reclamation: the epoch it was replaced in, and the list of those */
+  uint64_t retired_epoch;
+  struct qe_snapshot_struct *next;
+};
+
+#define QE_MAX_READERS 64
+
+/* A reader announces the epoch it started reading in, 0 when it isn't
+ * reading. Padded so that readers don't share cache lines. */
+typedef struct {
+  uint64_t epoch;
+  int in_use;
+  char pad[64 - sizeof(uint64_t) - sizeof(int)];
+} qe_reader_slot_t;
+
+/* Epoch based reclamation: a replaced snapshot is retired with the
+ * current epoch E, and then the epoch is incremented. Any reader that
+ * can still see it has announced an epoch of at most E (it announced
+ * before loading the pointer, which was before the replacement), so it
+ * can be freed once all readers are idle or have announced a later
+ * epoch. All accesses to current, epoch and the reader epochs are
+ * sequentially consistent, which is what makes that reasoning hold. */
+struct qe_published_struct {
+  qe_reader_slot_t readers[QE_MAX_READERS];
+  qe_snapshot_t *current;
+  uint64_t epoch;
+  qe_snapshot_t *retired; /* only touched by the writer */
+};
+
+static qe_snapshot_t *
+qe_snapshot_new(const qe_view_t *view)
+{
+  const size_t n = view->ntuples;
+  /* exact views only have the values */
+  const size_t nranks = view->rmin != NULL ? n : 0;
+  qe_snapshot_t *snap;
+  char *p;
+
+  /* the 8-byte arrays first, to keep everything aligned */
+  snap = QE_MALLOC(sizeof(qe_snapshot_t) + n * sizeof(double)
+                   + nranks * (sizeof(qe_count_t) + sizeof(qe_tuple_count_t)));
+  if (snap == NULL)
+    return NULL;
+  p = (char *)(snap + 1);
+
+  snap->view.v = (double *)p;
+  p += n * sizeof(double);
+  snap->view.rmin = NULL;
+  snap->view.delta = NULL;
+  if (n != 0)
+    memcpy((double *)snap->view.v, view->v, n * sizeof(double));
+  if (nranks != 0) {
+    snap->view.rmin = (qe_count_t *)p;
+    p += n * sizeof(qe_count_t);
+    snap->view.delta = (qe_tuple_count_t *)p;
+    memcpy((qe_count_t *)snap->view.rmin, view->rmin, n * sizeof(qe_count_t));
+    memcpy((qe_tuple_count_t *)snap->view.delta, view->delta, n * sizeof(qe_tuple_count_t));
+  }
+  snap->view.ntuples = n;
+  snap->view.count = view->count;
+  snap->next = NULL;
+
+  return snap;
+}
+
+/* Free the retired snapshots that no reader can see any more */
+static void
+gkstr_reclaim(qe_published_t *pub)
+{
+  uint64_t min_epoch = UINT64_MAX;
+  qe_snapshot_t **snapp = &pub->retired;
+  int i;
+
+  for (i = 0; i < QE_MAX_READERS; ++i) {
+    const uint64_t e = __atomic_load_n(&pub->readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (e != 0 && e < min_epoch)
+      min_epoch = e;
+  }
+
+  while (*snapp != NULL) {
+    qe_snapshot_t *snap = *snapp;
+    if (snap->retired_epoch < min_epoch) {
+      *snapp = snap->next;
+      QE_FREE(snap);
+    }
+    else {
+      snapp = &snap->next;
+    }
+  }
+}
+
+int
+gkstr_publish(stream_t *s)
+{
+  qe_published_t *pub = s->published;
+  qe_snapshot_t *snap;
+  qe_snapshot_t *old;
+  qe_view_t view;
+
+  /* the snapshot is a copy, so the stream can go on with the updates */
+  if (!gkstream_is_current(s) && gkstream_finish(s))
+    return 1;
+
+  if (pub == NULL) {
+    pub = QE_CALLOC(1, sizeof(qe_published_t));
+    if (pub == NULL)
+      return 1;
+    pub->epoch = 1;
+    __atomic_store_n(&s->published, pub, __ATOMIC_RELEASE);
+  }
+
+  if (!gkstream_view(s, &view))
+    memset(&view, 0, sizeof(view));
+  snap = qe_snapshot_new(&view);
+  if (snap == NULL)
+    return 1;
+
+  old = __atomic_exchange_n(&pub->current, snap, __ATOMIC_SEQ_CST);
+  if (old != NULL) {
+    old->retired_epoch = __atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST);
+    old->next = pub->retired;
+    pub->retired = old;
+  }
+  __atomic_add_fetch(&pub->epoch, 1, __ATOMIC_SEQ_CST);
+  gkstr_reclaim(pub);
+
+  return 0;
+}
+
+void
+gkstr_free_published(stream_t *stream)
+{
+  qe_published_t *pub = stream->published;
+  qe_snapshot_t *snap;
+
+  if (pub == NULL)
+    return;
+  while (pub->retired != NULL) {
+    snap = pub->retired;
+    pub->retired = snap->next;
+    QE_FREE(snap);
+  }
+  QE_FREE(pub->current);
+  QE_FREE(pub);
+}
+
+int
+gkstr_reader_register(stream_t *s)
+{
+  qe_published_t *pub = __atomic_load_n(&s->published, __ATOMIC_ACQUIRE);
+  int i;
+
+  if (pub == NULL)
+    return -1;
+  for (i = 0; i < QE_MAX_READERS; ++i) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&pub->readers[i].in_use, &expected, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return i;
+  }
+
+  return -1;
+}
+
+void
+gkstr_reader_unregister(stream_t *s, int reader)
+{
+  __atomic_store_n(&s->published->readers[reader].in_use, 0, __ATOMIC_RELEASE);
+}
+
+const qe_snapshot_t *
+gkstr_read_begin(stream_t *s, int reader)
+{
+  qe_published_t *pub = s->published;
+
+  __atomic_store_n(&pub->readers[reader].epoch,
+                   __atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&pub->current, __ATOMIC_SEQ_CST);
+}
+
+void
+gkstr_read_end(stream_t *s, int reader)
+{
+  __atomic_store_n(&s->published->readers[reader].epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+qe_count_t
+gksnap_count(const qe_snapshot_t *snap)
+{
+  return snap->view.count;
+}
+
+double
+gksnap_query(const qe_snapshot_t *snap, double q)
+{
+  return snap->view.ntuples == 0 ? NAN : qe_view_query(&snap->view, q);
+}
+
+void
+gksnap_query_many(const qe_snapshot_t *snap, const double *qs, double *out, size_t k)
+{
+  if (snap->view.ntuples == 0)
+    qe_fill_nan(out, k);
+  else
+    qe_view_query_many(&snap->view, qs, out, k);
+}
+
+double
+gksnap_rank(const qe_snapshot_t *snap, double x)
+{
+  return snap->view.ntuples == 0 ? NAN : qe_view_rank(&snap->view, x);
+}
+
+void
+gksnap_cdf_many(const qe_snapshot_t *snap, const double *xs, double *out, size_t k)
+{
+  if (snap->view.ntuples == 0)
+    qe_fill_nan(out, k);
+  else
+    qe_view_cdf_many(&snap->view, xs, out, k);
+}
+
+#endif
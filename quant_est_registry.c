@@ -0,0 +1,303 @@
+#include "qe_internal.h"
+
+/**************************************************
+ * Keyed registry of many small streams
+ **************************************************/
+
+/* Streams are carved out of slabs of this many stream_ts */
+#define QE_REG_SLAB 256
+/* Key strings are copied into arena chunks of at least this many bytes */
+#define QE_REG_ARENA 4096
+
+/* A slot of the hash table. Empty slots have no stream. Integer keys
+ * have no key string, string keys keep their hash in ikey. */
+typedef struct {
+  uint64_t ikey;
+  const char *key;
+  size_t keylen;
+  stream_t *stream;
+} qe_reg_entry_t;
+
+struct registry_struct {
+  double epsilon;
+  qe_count_t n; /* 0 for unbounded streams */
+  /* Open addressing with linear probing, never more than half full */
+  qe_reg_entry_t *table;
+  size_t capacity; /* a power of two */
+  size_t nstreams;
+  ptrarray_t *slabs; /* arrays of QE_REG_SLAB stream_ts */
+  size_t slab_used;  /* stream_ts handed out from the last slab */
+  ptrarray_t *arena; /* chunks holding the key strings */
+  char *arena_pos;
+  size_t arena_left;
+};
+
+/* splitmix64's finalizer, so that sequential ids spread out */
+QE_STATIC_INLINE uint64_t
+gkreg_hash_int(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+/* 64 bit FNV-1a */
+QE_STATIC_INLINE uint64_t
+gkreg_hash_str(const char *key, size_t len)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= (unsigned char)key[i];
+    h *= UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+QE_STATIC_INLINE uint64_t
+gkreg_entry_hash(const qe_reg_entry_t *e)
+{
+  return e->key == NULL ? gkreg_hash_int(e->ikey) : e->ikey;
+}
+
+/* The slot of the key, or the empty slot it would go to. key is NULL for
+ * integer keys, and hash the string's hash otherwise. */
+static qe_reg_entry_t *
+gkreg_lookup(registry_t *reg, uint64_t ikey, const char *key, size_t keylen)
+{
+  const size_t mask = reg->capacity - 1;
+  size_t i = (size_t)(key == NULL ? gkreg_hash_int(ikey) : ikey) & mask;
+
+  for (;; i = (i + 1) & mask) {
+    qe_reg_entry_t *e = &reg->table[i];
+    if (e->stream == NULL)
+      return e;
+    if (e->ikey != ikey || (e->key == NULL) != (key == NULL))
+      continue;
+    if (key == NULL || (e->keylen == keylen && memcmp(e->key, key, keylen) == 0))
+      return e;
+  }
+}
+
+/* Double the table. Returns non-zero on OOM. */
+static int
+gkreg_grow(registry_t *reg)
+{
+  qe_reg_entry_t *old = reg->table;
+  const size_t old_capacity = reg->capacity;
+  const size_t capacity = 2 * old_capacity;
+  qe_reg_entry_t *table = (qe_reg_entry_t *)QE_CALLOC(capacity, sizeof(qe_reg_entry_t));
+  size_t i;
+
+  if (table == NULL)
+    return 1;
+  reg->table = table;
+  reg->capacity = capacity;
+  for (i = 0; i < old_capacity; ++i) {
+    size_t j;
+    if (old[i].stream == NULL)
+      continue;
+    j = (size_t)gkreg_entry_hash(&old[i]) & (capacity - 1);
+    while (table[j].stream != NULL)
+      j = (j + 1) & (capacity - 1);
+    table[j] = old[i];
+  }
+  QE_FREE(old);
+
+  return 0;
+}
+
+/* A zeroed out stream_t from the slabs. Returns NULL on OOM. */
+static stream_t *
+gkreg_alloc_stream(registry_t *reg)
+{
+  stream_t *slab;
+
+  if (ptrarray_nelems(reg->slabs) == 0 || reg->slab_used == QE_REG_SLAB) {
+    slab = (stream_t *)QE_CALLOC(QE_REG_SLAB, sizeof(stream_t));
+    if (slab == NULL)
+      return NULL;
+    if (ptrarray_push(reg->slabs, slab)) {
+      QE_FREE(slab);
+      return NULL;
+    }
+    reg->slab_used = 0;
+  }
+  slab = (stream_t *)ptrarray_peek(reg->slabs);
+
+  return &slab[reg->slab_used++];
+}
+
+/* Gives the stream that gkreg_alloc_stream just handed out back to the
+ * slab, after freeing whatever gkstr_setup made of it */
+static void
+gkreg_release_stream(registry_t *reg, stream_t *s)
+{
+  gkstr_destroy(s);
+  memset(s, 0, sizeof(stream_t));
+  --reg->slab_used;
+}
+
+/* A copy of the key in the arena. Returns NULL on OOM. */
+static const char *
+gkreg_copy_key(registry_t *reg, const char *key, size_t len)
+{
+  char *copy;
+
+  if (len > reg->arena_left) {
+    const size_t size = len > QE_REG_ARENA ? len : QE_REG_ARENA;
+    char *chunk = (char *)QE_MALLOC(size);
+    if (chunk == NULL)
+      return NULL;
+    if (ptrarray_push(reg->arena, chunk)) {
+      QE_FREE(chunk);
+      return NULL;
+    }
+    reg->arena_pos = chunk;
+    reg->arena_left = size;
+  }
+  copy = reg->arena_pos;
+  if (len > 0)
+    memcpy(copy, key, len);
+  reg->arena_pos += len;
+  reg->arena_left -= len;
+
+  return copy;
+}
+
+static stream_t *
+gkreg_get_impl(registry_t *reg, uint64_t ikey, const char *key, size_t keylen)
+{
+  qe_reg_entry_t *e = gkreg_lookup(reg, ikey, key, keylen);
+  stream_t *s;
+
+  if (e->stream != NULL)
+    return e->stream;
+
+  if (2 * (reg->nstreams + 1) > reg->capacity) {
+    if (gkreg_grow(reg))
+      return NULL;
+    e = gkreg_lookup(reg, ikey, key, keylen);
+  }
+
+  s = gkreg_alloc_stream(reg);
+  if (s == NULL)
+    return NULL;
+  /* the key is copied last: the arena can't give it back */
+  if ((reg->n > 0 ? gkstr_setup(s, reg->epsilon, reg->n)
+                  : gkstr_setup_unbounded(s, reg->epsilon))
+      || (key != NULL && (key = gkreg_copy_key(reg, key, keylen)) == NULL))
+  {
+    gkreg_release_stream(reg, s);
+    return NULL;
+  }
+
+  e->ikey = ikey;
+  e->key = key;
+  e->keylen = keylen;
+  e->stream = s;
+  ++reg->nstreams;
+
+  return s;
+}
+
+registry_t *
+gkreg_new(double epsilon, qe_count_t n)
+{
+  registry_t *reg;
+  stream_t probe;
+  int err;
+
+  /* Fail right away on parameters that gkstr_new wouldn't take */
+  memset(&probe, 0, sizeof(stream_t));
+  err = n > 0 ? gkstr_setup(&probe, epsilon, n)
+              : gkstr_setup_unbounded(&probe, epsilon);
+  gkstr_destroy(&probe);
+  if (err)
+    return NULL;
+
+  reg = (registry_t *)QE_CALLOC(1, sizeof(registry_t));
+  if (reg == NULL)
+    return NULL;
+  reg->epsilon = epsilon;
+  reg->n = n;
+  reg->capacity = 16;
+  reg->table = (qe_reg_entry_t *)QE_CALLOC(reg->capacity, sizeof(qe_reg_entry_t));
+  reg->slabs = ptrarray_make(4, PTRARRAYf_FREE_ELEMS);
+  reg->arena = ptrarray_make(4, PTRARRAYf_FREE_ELEMS);
+  if (reg->table == NULL || reg->slabs == NULL || reg->arena == NULL) {
+    gkreg_free(reg);
+    return NULL;
+  }
+
+  return reg;
+}
+
+void
+gkreg_free(registry_t *reg)
+{
+  size_t i;
+
+  if (reg->table != NULL) {
+    for (i = 0; i < reg->capacity; ++i) {
+      if (reg->table[i].stream != NULL)
+        gkstr_destroy(reg->table[i].stream);
+    }
+    QE_FREE(reg->table);
+  }
+  if (reg->slabs != NULL)
+    ptrarray_free(reg->slabs);
+  if (reg->arena != NULL)
+    ptrarray_free(reg->arena);
+  QE_FREE(reg);
+}
+
+stream_t *
+gkreg_get(registry_t *reg, uint64_t key)
+{
+  return gkreg_get_impl(reg, key, NULL, 0);
+}
+
+stream_t *
+gkreg_get_str(registry_t *reg, const char *key, size_t len)
+{
+  return gkreg_get_impl(reg, gkreg_hash_str(key, len), key, len);
+}
+
+stream_t *
+gkreg_find(registry_t *reg, uint64_t key)
+{
+  return gkreg_lookup(reg, key, NULL, 0)->stream;
+}
+
+stream_t *
+gkreg_find_str(registry_t *reg, const char *key, size_t len)
+{
+  return gkreg_lookup(reg, gkreg_hash_str(key, len), key, len)->stream;
+}
+
+size_t
+gkreg_size(registry_t *reg)
+{
+  return reg->nstreams;
+}
+
+int
+gkreg_each(registry_t *reg, gkreg_each_cb cb, void *ctx)
+{
+  size_t i;
+
+  for (i = 0; i < reg->capacity; ++i) {
+    const qe_reg_entry_t *e = &reg->table[i];
+    int ret;
+
+    if (e->stream == NULL)
+      continue;
+    ret = cb(ctx, e->key, e->keylen, e->key == NULL ? e->ikey : 0, e->stream);
+    if (ret != 0)
+      return ret;
+  }
+
+  return 0;
+}
@@ -0,0 +1,234 @@
+#include "qe_internal.h"
+
+/**************************************************
+ * Sharded front-end for concurrent updates
+ **************************************************/
+
+#ifndef QE_NO_THREADS
+
+/* A full level 0 block of a shard, sorted and compressed, on its way to
+ * the shared levels */
+typedef struct qe_block_struct {
+  struct qe_block_struct *next;
+  gksummary_t gk;
+  qe_count_t count; /* number of elements it summarizes */
+} qe_block_t;
+
+/* Each shard is a level 0 buffer with its own lock. Normally only one
+ * thread uses a shard, so the lock isn't contended: it's there so that
+ * snapshots can look at the buffer. Padded to keep shards used by
+ * different threads out of each other's cache lines. */
+typedef struct {
+  pthread_mutex_t lock;
+  gksummary_t level0;
+  uint64_t *sort_scratch;
+  char pad[64];
+} qe_shard_t;
+
+struct sharded_struct {
+  stream_t *core; /* the shared levels, level 0 of which stays empty */
+  pthread_mutex_t core_lock;
+  /* Full blocks waiting for the core: a lock-free stack that any number
+   * of shards push to. Whoever holds core_lock takes all of it at once,
+   * which sidesteps the ABA problem of popping single entries. */
+  qe_block_t *pending;
+  qe_shard_t *shards;
+  int nshards;
+};
+
+/* Move all pending blocks into the core levels. Needs core_lock. */
+static int
+gkshard_drain(sharded_t *sh)
+{
+  stream_t *core = sh->core;
+  qe_block_t *block = QE_ATOMIC_XCHG_PTR(&sh->pending, NULL);
+  int err = 0;
+
+  while (block != NULL) {
+    qe_block_t *next = block->next;
+
+    /* the block's summary becomes the carry, and its buffer goes with
+     * the block */
+    if (!err) {
+      gks_swap(&core->carry, &block->gk);
+      err = gkstr_carry_up(core, 1);
+      core->count += block->count;
+    }
+    gks_destroy(&block->gk);
+    QE_FREE(block);
+    block = next;
+  }
+
+  return err;
+}
+
+/* Compress the full level 0 of a shard into a block and queue it for
+ * the core. Needs the shard's lock. */
+static int
+gkshard_pack(sharded_t *sh, qe_shard_t *shard)
+{
+  stream_t *core = sh->core;
+  qe_block_t *block;
+  qe_block_t *head;
+
+  block = QE_MALLOC(sizeof(qe_block_t));
+  if (block == NULL)
+    return 1;
+  if (gks_init(&block->gk, gkstr_level_size(core))) {
+    QE_FREE(block);
+    return 1;
+  }
+  block->count = gks_len(&shard->level0);
+
+  gks_sort_values(&shard->level0, shard->sort_scratch);
+  if (gks_prune(&shard->level0, (int)gkstr_prune_size(core), &block->gk)) {
+    gks_destroy(&block->gk);
+    QE_FREE(block);
+    return 1;
+  }
+  gks_clear(&shard->level0);
+
+  /* a failed CAS updates head */
+  head = QE_ATOMIC_LOAD_PTR(&sh->pending);
+  do {
+    block->next = head;
+  } while (!QE_ATOMIC_CAS_PTR(&sh->pending, head, block));
+
+  return 0;
+}
+
+void
+gkshard_free(sharded_t *sh)
+{
+  int i;
+
+  if (sh->core != NULL) {
+    gkshard_drain(sh); /* frees the blocks */
+    gkstr_free(sh->core);
+  }
+  if (sh->shards != NULL) {
+    for (i = 0; i < sh->nshards; ++i) {
+      gks_destroy(&sh->shards[i].level0);
+      QE_FREE(sh->shards[i].sort_scratch);
+      pthread_mutex_destroy(&sh->shards[i].lock);
+    }
+    QE_FREE(sh->shards);
+  }
+  pthread_mutex_destroy(&sh->core_lock);
+  QE_FREE(sh);
+}
+
+sharded_t *
+gkshard_new(double epsilon, qe_count_t n, int nshards)
+{
+  sharded_t *sh;
+  int i;
+
+  if (nshards < 1)
+    return NULL;
+
+  sh = (sharded_t *)QE_CALLOC(1, sizeof(sharded_t));
+  if (sh == NULL)
+    return NULL;
+  pthread_mutex_init(&sh->core_lock, NULL);
+
+  sh->core = gkstr_new(epsilon, n);
+  sh->shards = (qe_shard_t *)QE_CALLOC(nshards, sizeof(qe_shard_t));
+  if (sh->core == NULL || sh->shards == NULL) {
+    gkshard_free(sh);
+    return NULL;
+  }
+
+  for (i = 0; i < nshards; ++i) {
+    qe_shard_t *shard = &sh->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    ++sh->nshards; /* from here on, gkshard_free cleans up this shard */
+    shard->sort_scratch = QE_MALLOC(2 * sh->core->b * sizeof(uint64_t));
+    if (shard->sort_scratch == NULL || gks_init(&shard->level0, sh->core->b)) {
+      gkshard_free(sh);
+      return NULL;
+    }
+  }
+
+  return sh;
+}
+
+int
+gkshard_update_many(sharded_t *sh, int shard_id, const double *vals, size_t n)
+{
+  qe_shard_t *shard = &sh->shards[(unsigned int)shard_id % (unsigned int)sh->nshards];
+  gksummary_t *gk = &shard->level0;
+  const size_t b = sh->core->b;
+  int packed = 0;
+  int err = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  while (n > 0 && !err) {
+    size_t chunk = b - gks_len(gk);
+
+    if (chunk > n)
+      chunk = n;
+    memcpy(gk->v + gk->len, vals, chunk * sizeof(double));
+    gk->len += chunk;
+    vals += chunk;
+    n -= chunk;
+
+    if (gks_len(gk) == b) {
+      err = gkshard_pack(sh, shard);
+      packed = 1;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  /* Whoever gets the core lock first moves all queued blocks in. If it's
+   * taken, the holder or the next shard to fill up will do it. */
+  if (packed && pthread_mutex_trylock(&sh->core_lock) == 0) {
+    err |= gkshard_drain(sh);
+    pthread_mutex_unlock(&sh->core_lock);
+  }
+
+  return err;
+}
+
+int
+gkshard_update(sharded_t *sh, int shard_id, double e)
+{
+  return gkshard_update_many(sh, shard_id, &e, 1);
+}
+
+/* With all shards locked, every element is in exactly one of the shard
+ * buffers, the pending blocks, or the core, so the snapshot sees a
+ * consistent state. */
+stream_t *
+gkshard_snapshot(sharded_t *sh)
+{
+  stream_t *s;
+  int err;
+  int i;
+
+  s = gkstr_new(sh->core->epsilon, sh->core->n);
+  if (s == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&sh->core_lock);
+  for (i = 0; i < sh->nshards; ++i)
+    pthread_mutex_lock(&sh->shards[i].lock);
+
+  err = gkshard_drain(sh) || gkstr_merge(s, sh->core);
+  for (i = 0; i < sh->nshards; ++i) {
+    gksummary_t *gk = &sh->shards[i].level0;
+    err = err || gkstr_update_many(s, gk->v, gks_len(gk));
+  }
+
+  for (i = 0; i < sh->nshards; ++i)
+    pthread_mutex_unlock(&sh->shards[i].lock);
+  pthread_mutex_unlock(&sh->core_lock);
+
+  if (err || gkstream_finish(s)) {
+    gkstr_free(s);
+    return NULL;
+  }
+  return s;
+}
+
+#endif
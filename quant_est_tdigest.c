@@ -0,0 +1,789 @@
+#include "qe_internal.h"
+#include "qe_sort.h"
+
+/**************************************************
+ * t-digest
+ **************************************************/
+
+/* The merging t-digest of Dunning and Ertl, "Computing Extremely
+ * Accurate Quantiles Using t-Digests" (2019). The elements are summed
+ * up in centroids, sorted by their mean, each with the number of
+ * elements (its weight) behind it. The scale function
+ * k(q) = log(q / (1-q)) / (4 * epsilon) decides how large they get: a
+ * centroid spans at most one unit of k, which is epsilon of the
+ * elements at the median, but only about 4 * epsilon * q of them near
+ * the quantile q (and likewise near 1), down to single elements at the
+ * extremes. So the tails, which latency SLOs care about, are resolved
+ * finely, with O(log(n) / epsilon) centroids in all. Queries interpolate
+ * between neighbouring centroids; unlike with GK, there's no guaranteed
+ * rank error.
+ *
+ * Updates just go to a buffer. Once that's full, it's sorted and merged
+ * with the centroids in one pass, which starts a new centroid whenever
+ * the next one or the next element doesn't fit into the current one.
+ * Runs of elements that all go into the current centroid are added up
+ * at once with the vector kernel. */
+
+/* Smallest epsilon. The buffer then takes 6.4 MB, and its sort scratch
+ * another 12.8 MB once it's first flushed: about 19 MB in all. */
+#define QE_TD_MIN_EPSILON 1e-5
+/* The buffer holds this many elements per 1/epsilon. About as many as
+ * there are centroids, so that a merge pass costs O(1) per element. */
+#define QE_TD_BUFFER_FACTOR 8
+
+typedef struct {
+  double epsilon;
+  double error; /* epsilon, or after merges, the largest of them */
+  double growth; /* exp(4 * epsilon): how much q / (1-q) grows per unit of k */
+  qe_count_t count; /* including the buffered elements */
+  double min; /* the extremes of the centroids */
+  double max;
+  /* The centroids, by ascending mean */
+  double *mean;
+  double *weight;
+  size_t ncentroids;
+  size_t size; /* N entries allocated in each of the centroid arrays */
+  /* The weight of the centroids before each one, as built by td_finish */
+  double *cum;
+  int cum_current;
+  /* Elements that aren't in the centroids yet, in no particular order */
+  double *buffer;
+  size_t nbuffered;
+  size_t buffer_size;
+  uint64_t *sort_scratch; /* for sorting the buffer, see td_reserve_scratch */
+} qe_tdigest_t;
+
+static qe_tdigest_t *
+td_new(double epsilon)
+{
+  qe_tdigest_t *td;
+
+  if (!(epsilon >= QE_TD_MIN_EPSILON && epsilon < 1.))
+    return NULL;
+  td = (qe_tdigest_t *)QE_CALLOC(1, sizeof(qe_tdigest_t));
+  if (td == NULL)
+    return NULL;
+  td->epsilon = epsilon;
+  td->error = epsilon;
+  td->growth = exp(4. * epsilon);
+  td->min = INFINITY;
+  td->max = -INFINITY;
+  td->buffer_size = (size_t)ceil(QE_TD_BUFFER_FACTOR / epsilon);
+  td->buffer = QE_MALLOC(td->buffer_size * sizeof(double));
+  if (td->buffer == NULL) {
+    QE_FREE(td);
+    return NULL;
+  }
+
+  return td;
+}
+
+static void
+td_free(qe_tdigest_t *td)
+{
+  QE_FREE(td->mean);
+  QE_FREE(td->weight);
+  QE_FREE(td->cum);
+  QE_FREE(td->buffer);
+  QE_FREE(td->sort_scratch);
+  QE_FREE(td);
+}
+
+/* Makes sure the centroid arrays have room for n centroids. They grow
+ * by half: the number of centroids only grows with log(count). Returns
+ * non-zero on OOM. */
+static int
+td_reserve(qe_tdigest_t *td, size_t n)
+{
+  double **arrays[3];
+  size_t size, i;
+
+  if (n <= td->size)
+    return 0;
+  size = td->size + td->size / 2 > n ? td->size + td->size / 2 : n;
+  arrays[0] = &td->mean;
+  arrays[1] = &td->weight;
+  arrays[2] = &td->cum;
+  for (i = 0; i < 3; ++i) {
+    double *a = QE_REALLOC(*arrays[i], size * sizeof(double));
+    if (a == NULL)
+      return 1;
+    *arrays[i] = a;
+  }
+  td->size = size;
+
+  return 0;
+}
+
+/* The largest weight that the centroids up to and including the current
+ * one may have, given the weight before it: q / (1-q) of that weight,
+ * grown by one unit of k. It's 0 for nothing before, and stays below
+ * the total by more than 1 / growth, so the first and the last centroid
+ * are single elements. */
+QE_STATIC_INLINE double
+td_limit(const qe_tdigest_t *td, double total, double before)
+{
+  return total * td->growth * before / (total + (td->growth - 1.) * before);
+}
+
+/* Number of the n ascending values that are less than x. The runs that
+ * go into a centroid are short, so that's a linear scan. */
+QE_STATIC_INLINE size_t
+td_count_below(const double *v, size_t n, double x)
+{
+  size_t i = 0;
+
+  while (i < n && v[i] < x)
+    ++i;
+
+  return i;
+}
+
+/* Allocates the scratch for sorting a full buffer, the first time the
+ * buffer needs more than an insertion sort. It's twice the size of the
+ * buffer, so digests that never see much data don't pay for it. Returns
+ * non-zero on OOM. */
+static int
+td_reserve_scratch(qe_tdigest_t *td)
+{
+  if (td->sort_scratch != NULL || td->nbuffered <= QE_SORT_INSERTION_MAX)
+    return 0;
+  td->sort_scratch = QE_MALLOC(2 * td->buffer_size * sizeof(uint64_t));
+  return td->sort_scratch == NULL;
+}
+
+/* Merges the nc centroids (by ascending mean) and the buffered elements
+ * into new centroids, which replace the old ones. The centroid arrays
+ * need room for nc + nbuffered centroids. The given centroids may be the
+ * upper end of them: each new centroid takes at least one of the
+ * buffered elements or given centroids, so it never overwrites one that
+ * is still to be read. The mean of a new centroid is kept between the
+ * first and the last of its parts, so that rounding can't put the means
+ * out of order. The caller must have called td_reserve_scratch. */
+static void
+td_compress(qe_tdigest_t *td, const double *cmean, const double *cweight, size_t nc)
+{
+  const double total = (double)td->count;
+  const double *buf = td->buffer;
+  const size_t nb = td->nbuffered;
+  double *mean = td->mean;
+  double *weight = td->weight;
+  double sum = 0., w = 0., first = 0., last = 0.;
+  double before = 0., limit = 0.;
+  size_t i = 0, j = 0, n = 0;
+
+  qe_kernels.sort_doubles(td->buffer, nb, td->sort_scratch);
+  if (nb > 0 && buf[0] < td->min)
+    td->min = buf[0];
+  if (nb > 0 && buf[nb-1] > td->max)
+    td->max = buf[nb-1];
+
+  while (i < nc || j < nb) {
+    const int centroid = j == nb || (i < nc && cmean[i] <= buf[j]);
+
+    if (centroid) {
+      if (before + w + cweight[i] <= limit) {
+        sum += cmean[i] * cweight[i];
+        w += cweight[i];
+        last = cmean[i++];
+        continue;
+      }
+    }
+    else if (limit - before - w >= 1.) {
+      /* all buffered elements that fit, up to the next centroid (the
+       * first one is below it, or this would be the centroid's turn) */
+      const double room = limit - before - w;
+      size_t run = nb - j;
+
+      if ((double)run > room)
+        run = (size_t)room;
+      if (i < nc)
+        run = td_count_below(buf + j, run, cmean[i]);
+      sum += qe_kernels.sum_doubles(buf + j, run);
+      w += (double)run;
+      j += run;
+      last = buf[j-1];
+      continue;
+    }
+
+    /* doesn't fit: it starts the next centroid */
+    if (w > 0.) {
+      const double m = sum / w;
+      mean[n] = m < first ? first : m > last ? last : m;
+      weight[n++] = w;
+      before += w;
+      limit = td_limit(td, total, before);
+    }
+    if (centroid) {
+      sum = cmean[i] * cweight[i];
+      w = cweight[i];
+      first = last = cmean[i++];
+    }
+    else {
+      sum = first = last = buf[j++];
+      w = 1.;
+    }
+  }
+  if (w > 0.) {
+    const double m = sum / w;
+    mean[n] = m < first ? first : m > last ? last : m;
+    weight[n++] = w;
+  }
+
+  td->ncentroids = n;
+  td->nbuffered = 0;
+  td->cum_current = 0;
+}
+
+/* Merges the buffer into the centroids, which move up to make room for
+ * td_compress. Returns non-zero on OOM. */
+static int
+td_flush(qe_tdigest_t *td)
+{
+  const size_t nb = td->nbuffered, nc = td->ncentroids;
+
+  if (nb == 0)
+    return 0;
+  if (td_reserve(td, nc + nb) || td_reserve_scratch(td))
+    return 1;
+  memmove(td->mean + nb, td->mean, nc * sizeof(double));
+  memmove(td->weight + nb, td->weight, nc * sizeof(double));
+  td_compress(td, td->mean + nb, td->weight + nb, nc);
+  return 0;
+}
+
+QE_STATIC_INLINE int
+td_update(qe_tdigest_t *td, double e)
+{
+  if (td->nbuffered == td->buffer_size && td_flush(td))
+    return 1;
+
+  td->buffer[td->nbuffered++] = e;
+  ++td->count;
+  return 0;
+}
+
+static int
+td_update_many(qe_tdigest_t *td, const double *vals, size_t n)
+{
+  while (n > 0) {
+    size_t chunk;
+
+    if (td->nbuffered == td->buffer_size && td_flush(td))
+      return 1;
+    chunk = td->buffer_size - td->nbuffered;
+    if (chunk > n)
+      chunk = n;
+    memcpy(td->buffer + td->nbuffered, vals, chunk * sizeof(double));
+    td->nbuffered += chunk;
+    td->count += chunk;
+    vals += chunk;
+    n -= chunk;
+  }
+
+  return 0;
+}
+
+/* The buffered elements of src are added to dst like any others, the
+ * centroids of both are merged by mean and then compressed with the
+ * buffer of dst. */
+static int
+td_merge(qe_tdigest_t *dst, qe_tdigest_t *src)
+{
+  const size_t nb = src->ncentroids;
+  double *mean, *weight;
+  size_t na, i = 0, j = 0, n = 0;
+
+  if (dst == src)
+    return 1;
+  if (src->count == 0)
+    return 0;
+  if (td_update_many(dst, src->buffer, src->nbuffered))
+    return 1;
+  if (src->error > dst->error)
+    dst->error = src->error;
+  if (nb == 0)
+    return 0;
+
+  /* after td_update_many, which may have changed them */
+  na = dst->ncentroids;
+
+  if (td_reserve(dst, na + nb + dst->nbuffered) || td_reserve_scratch(dst))
+    return 1;
+  mean = QE_MALLOC(2 * (na + nb) * sizeof(double));
+  if (mean == NULL)
+    return 1;
+  weight = mean + na + nb;
+  while (i < na || j < nb) {
+    if (j == nb || (i < na && dst->mean[i] <= src->mean[j])) {
+      mean[n] = dst->mean[i];
+      weight[n++] = dst->weight[i++];
+    }
+    else {
+      mean[n] = src->mean[j];
+      weight[n++] = src->weight[j++];
+    }
+  }
+
+  dst->count += src->count - src->nbuffered;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  td_compress(dst, mean, weight, n);
+  QE_FREE(mean);
+
+  return 0;
+}
+
+/* Merges the buffer and sets up the cumulative weights for the queries.
+ * Returns non-zero on OOM. */
+static int
+td_finish(qe_tdigest_t *td)
+{
+  double before = 0.;
+  size_t i;
+
+  if (td_flush(td))
+    return 1;
+  if (!td->cum_current) {
+    for (i = 0; i < td->ncentroids; ++i) {
+      td->cum[i] = before;
+      before += td->weight[i];
+    }
+    td->cum_current = 1;
+  }
+
+  return 0;
+}
+
+/* Non-zero if the digest is finished and has data */
+QE_STATIC_INLINE int
+td_is_queryable(const qe_tdigest_t *td)
+{
+  return td->ncentroids > 0 && td->nbuffered == 0 && td->cum_current;
+}
+
+/* The rank of the middle of centroid i's weight */
+QE_STATIC_INLINE double
+td_center(const qe_tdigest_t *td, size_t i)
+{
+  return td->cum[i] + td->weight[i] / 2.;
+}
+
+/* Number of centroids with their center at or below the rank r */
+static size_t
+td_centers_below(const qe_tdigest_t *td, double r)
+{
+  size_t lo = 0, hi = td->ncentroids;
+
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (td_center(td, mid) <= r)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* x1 and x2 weighted by w1 and w2, and clamped to lie between them */
+QE_STATIC_INLINE double
+td_weighted_average(double x1, double w1, double x2, double w2)
+{
+  const double x = (x1 * w1 + x2 * w2) / (w1 + w2);
+
+  return x < x1 ? x1 : x > x2 ? x2 : x;
+}
+
+/* The value at position r, given that i centroids have their center at
+ * or below r. Positions run from 0 to the count, and the element of
+ * rank k takes up [k-1, k]. Each centroid's mean is taken to be at its
+ * center, and values in between are interpolated linearly. The extremes
+ * are single elements at the ends, and so are centroids of weight 1:
+ * they take up half a position on either side of their center, and
+ * aren't interpolated into. */
+static double
+td_quantile_at(const qe_tdigest_t *td, double r, size_t i)
+{
+  const double *mean = td->mean;
+  const double *weight = td->weight;
+  const size_t n = td->ncentroids;
+  const double total = (double)td->count;
+  double left, right, lunit = 0., runit = 0.;
+
+  if (!(r >= 1.))
+    return td->min;
+  if (r > total - 1.)
+    return td->max;
+  if (i == 0) {
+    /* 1 <= r < weight[0] / 2, so weight[0] > 2 */
+    return td->min + (r - 1.) / (weight[0] / 2. - 1.) * (mean[0] - td->min);
+  }
+  if (i == n) {
+    const double half = weight[n-1] / 2.;
+    if (half <= 1.)
+      return mean[n-1];
+    return td->max - (total - r - 1.) / (half - 1.) * (td->max - mean[n-1]);
+  }
+
+  left = td_center(td, i-1);
+  right = td_center(td, i);
+  if (weight[i-1] == 1.) {
+    if (r - left < 0.5)
+      return mean[i-1];
+    lunit = 0.5;
+  }
+  if (weight[i] == 1.) {
+    if (right - r <= 0.5)
+      return mean[i];
+    runit = 0.5;
+  }
+  return td_weighted_average(mean[i-1], right - r - runit, mean[i], r - left - lunit);
+}
+
+/* The values at k quantiles, in a single pass for ascending quantiles,
+ * as qe_view_query_many does. Like with the other engines, the quantile
+ * q is the element of rank floor(q * count), whose position starts at
+ * q * count - 1. */
+static void
+td_query_many(const qe_tdigest_t *td, const double *qs, double *out, size_t k)
+{
+  const size_t n = td->ncentroids;
+  size_t i;
+  size_t idx = 0;
+
+  for (i = 0; i < k; ++i) {
+    const double r = qs[i] * (double)td->count - 1.;
+
+    if (i > 0 && qs[i] < qs[i-1])
+      idx = td_centers_below(td, r);
+    else
+      while (idx < n && td_center(td, idx) <= r)
+        ++idx;
+
+    out[i] = td_quantile_at(td, r, idx);
+  }
+}
+
+/* The inverse of td_quantile_at: the estimated number of elements <= x,
+ * given that i centroids have a mean <= x */
+static double
+td_rank_at(const qe_tdigest_t *td, double x, size_t i)
+{
+  const double *mean = td->mean;
+  const double *weight = td->weight;
+  const size_t n = td->ncentroids;
+  const double total = (double)td->count;
+  double lunit = 0., runit = 0.;
+
+  if (x < td->min)
+    return 0.;
+  if (x >= td->max)
+    return total;
+  if (i == 0)
+    return 1. + (x - td->min) / (mean[0] - td->min) * (weight[0] / 2. - 1.);
+  if (i == n)
+    return total - 1. - (td->max - x) / (td->max - mean[n-1]) * (weight[n-1] / 2. - 1.);
+
+  /* mean[i-1] <= x < mean[i] */
+  if (weight[i-1] == 1. && weight[i] == 1.)
+    return td->cum[i];
+  if (weight[i-1] == 1.)
+    lunit = 0.5;
+  else if (weight[i] == 1.)
+    runit = 0.5;
+  return td->cum[i-1] + weight[i-1] / 2. + lunit
+         + ((weight[i-1] + weight[i]) / 2. - lunit - runit)
+           * (x - mean[i-1]) / (mean[i] - mean[i-1]);
+}
+
+static double
+td_rank(const qe_tdigest_t *td, double x)
+{
+  return td_rank_at(td, x, gkstream_value_upper_bound(td->mean, td->ncentroids, x));
+}
+
+/* Like qe_view_cdf_many */
+static void
+td_cdf_many(const qe_tdigest_t *td, const double *xs, double *out, size_t k)
+{
+  const double *mean = td->mean;
+  const size_t n = td->ncentroids;
+  size_t i;
+  size_t idx = 0;
+
+  for (i = 0; i < k; ++i) {
+    if (i > 0 && xs[i] < xs[i-1])
+      idx = gkstream_value_upper_bound(mean, n, xs[i]);
+    else
+      idx = qe_kernels.scan_doubles(mean, idx, n, xs[i]);
+
+    out[i] = td_rank_at(td, xs[i], idx) / (double)td->count;
+  }
+}
+
+static size_t
+td_memory_usage(qe_tdigest_t *td)
+{
+  return sizeof(qe_tdigest_t)
+         + td->buffer_size * sizeof(double)
+         + (td->sort_scratch != NULL ? td->buffer_size * 2 * sizeof(uint64_t) : 0)
+         + td->size * 3 * sizeof(double);
+}
+
+/* Binary format, version 1, with the same conventions as that of the
+ * streams:
+ *
+ *   "QETD"        magic
+ *   u8            format version (1)
+ *   u8            flags (none yet)
+ *   f64           epsilon
+ *   f64           the error bound
+ *   varint        number of elements seen so far
+ *   f64           minimum of the centroids
+ *   f64           maximum of the centroids
+ *   varint        number of centroids, followed by the centroids by
+ *                 ascending mean, each as the mean, delta encoded as
+ *                 the values of summaries are, and the varint weight
+ *   varint        number of buffered elements, followed by them as f64
+ */
+
+#define QE_TD_SERIAL_MAGIC "QETD"
+#define QE_TD_SERIAL_VERSION 1
+
+static size_t
+td_serialized_size(qe_tdigest_t *td)
+{
+  return 4 + 1 + 1 + 4 * 8 + 3 * QE_VARINT_MAX
+         + td->ncentroids * 2 * QE_VARINT_MAX + td->nbuffered * 8;
+}
+
+static size_t
+td_serialize(qe_tdigest_t *td, unsigned char *buf, size_t size)
+{
+  unsigned char *p = buf;
+  uint64_t prev = 0;
+  size_t i;
+
+  if (size < td_serialized_size(td))
+    return 0;
+
+  memcpy(p, QE_TD_SERIAL_MAGIC, 4);
+  p += 4;
+  *p++ = QE_TD_SERIAL_VERSION;
+  *p++ = 0;
+  p = qe_put_f64(p, td->epsilon);
+  p = qe_put_f64(p, td->error);
+  p = qe_put_varint(p, td->count);
+  p = qe_put_f64(p, td->min);
+  p = qe_put_f64(p, td->max);
+
+  p = qe_put_varint(p, td->ncentroids);
+  for (i = 0; i < td->ncentroids; ++i) {
+    const uint64_t key = qe_sort_double_to_key(td->mean[i]);
+    p = qe_put_varint(p, key - prev);
+    p = qe_put_varint(p, (uint64_t)td->weight[i]);
+    prev = key;
+  }
+  p = qe_put_varint(p, td->nbuffered);
+  for (i = 0; i < td->nbuffered; ++i)
+    p = qe_put_f64(p, td->buffer[i]);
+
+  return (size_t)(p - buf);
+}
+
+/* Reads the centroids and the buffered elements into the fresh digest
+ * td and checks that their weights add up to the count. Returns
+ * non-zero on malformed input. */
+static int
+td_deserialize_data(qe_tdigest_t *td, qe_reader_t *r, uint64_t ncentroids,
+                    double min, double max)
+{
+  uint64_t key = 0, nbuffered;
+  qe_count_t weight = 0;
+  size_t i;
+
+  for (i = 0; i < ncentroids; ++i) {
+    const uint64_t next = key + qe_get_varint(r);
+    const uint64_t w = qe_get_varint(r);
+
+    if (next < key || w == 0 || w > td->count - weight)
+      return 1; /* not sorted, or more weight than elements */
+    key = next;
+    td->mean[i] = qe_sort_key_to_double(key);
+    td->weight[i] = (double)w;
+    weight += w;
+  }
+  td->ncentroids = (size_t)ncentroids;
+  if (ncentroids != 0) {
+    if (!(min <= td->mean[0] && td->mean[ncentroids-1] <= max))
+      return 1;
+    td->min = min;
+    td->max = max;
+  }
+
+  nbuffered = qe_get_varint(r);
+  if (r->p == NULL || nbuffered > td->buffer_size || nbuffered != td->count - weight)
+    return 1;
+  for (i = 0; i < nbuffered; ++i)
+    td->buffer[i] = qe_get_f64(r);
+  td->nbuffered = (size_t)nbuffered;
+
+  return r->p != r->end;
+}
+
+static qe_tdigest_t *
+td_deserialize(const unsigned char *buf, size_t len)
+{
+  qe_reader_t r;
+  qe_tdigest_t *td;
+  double epsilon, error, min, max;
+  uint64_t count, ncentroids;
+
+  if (len < 6 || memcmp(buf, QE_TD_SERIAL_MAGIC, 4) != 0
+      || buf[4] != QE_TD_SERIAL_VERSION || buf[5] != 0)
+    return NULL;
+  r.p = buf + 6;
+  r.end = buf + len;
+
+  epsilon = qe_get_f64(&r);
+  error = qe_get_f64(&r);
+  count = qe_get_varint(&r);
+  min = qe_get_f64(&r);
+  max = qe_get_f64(&r);
+  ncentroids = qe_get_varint(&r);
+  /* each centroid takes at least two bytes: garbage must not allocate
+   * huge arrays */
+  if (r.p == NULL || !(error >= epsilon && error < 1.)
+      || ncentroids > (uint64_t)(r.end - r.p) / 2
+      || (ncentroids != 0 && !(min <= max)))
+    return NULL;
+
+  td = td_new(epsilon);
+  if (td == NULL)
+    return NULL;
+  td->error = error;
+  td->count = count;
+  if (td_reserve(td, (size_t)ncentroids)
+      || td_deserialize_data(td, &r, ncentroids, min, max)) {
+    td_free(td);
+    return NULL;
+  }
+
+  return td;
+}
+
+/* "tdigest" */
+
+static void *
+qe_td_create(double epsilon, qe_count_t n)
+{
+  (void)n; /* the digest doesn't depend on it */
+  return td_new(epsilon);
+}
+
+static void
+qe_td_destroy(void *impl)
+{
+  td_free((qe_tdigest_t *)impl);
+}
+
+static int
+qe_td_update(void *impl, double e)
+{
+  return td_update((qe_tdigest_t *)impl, e);
+}
+
+static int
+qe_td_update_many(void *impl, const double *vals, size_t n)
+{
+  return td_update_many((qe_tdigest_t *)impl, vals, n);
+}
+
+static int
+qe_td_merge(void *dst, void *src)
+{
+  return td_merge((qe_tdigest_t *)dst, (qe_tdigest_t *)src);
+}
+
+static qe_count_t
+qe_td_count(void *impl)
+{
+  return ((qe_tdigest_t *)impl)->count;
+}
+
+static double
+qe_td_error_bound(void *impl)
+{
+  return ((qe_tdigest_t *)impl)->error;
+}
+
+static int
+qe_td_finish(void *impl)
+{
+  return td_finish((qe_tdigest_t *)impl);
+}
+
+static void
+qe_td_query_many(void *impl, const double *qs, double *out, size_t k)
+{
+  const qe_tdigest_t *td = (qe_tdigest_t *)impl;
+
+  if (td_is_queryable(td))
+    td_query_many(td, qs, out, k);
+  else
+    qe_fill_nan(out, k);
+}
+
+static double
+qe_td_rank(void *impl, double x)
+{
+  const qe_tdigest_t *td = (qe_tdigest_t *)impl;
+
+  return td_is_queryable(td) ? td_rank(td, x) : NAN;
+}
+
+static void
+qe_td_cdf_many(void *impl, const double *xs, double *out, size_t k)
+{
+  const qe_tdigest_t *td = (qe_tdigest_t *)impl;
+
+  if (td_is_queryable(td))
+    td_cdf_many(td, xs, out, k);
+  else
+    qe_fill_nan(out, k);
+}
+
+static size_t
+qe_td_serialized_size(void *impl)
+{
+  return td_serialized_size((qe_tdigest_t *)impl);
+}
+
+static size_t
+qe_td_serialize(void *impl, unsigned char *buf, size_t size)
+{
+  return td_serialize((qe_tdigest_t *)impl, buf, size);
+}
+
+static void *
+qe_td_deserialize(const unsigned char *buf, size_t len)
+{
+  return td_deserialize(buf, len);
+}
+
+static size_t
+qe_td_memory_usage(void *impl)
+{
+  return td_memory_usage((qe_tdigest_t *)impl);
+}
+
+const qe_engine_t qe_engine_tdigest = {
+  "tdigest", QE_TD_SERIAL_MAGIC,
+  qe_td_create, qe_td_destroy, qe_td_update, qe_td_update_many, qe_td_merge,
+  qe_td_count, qe_td_error_bound, qe_td_finish, qe_td_query_many, qe_td_rank,
+  qe_td_cdf_many, qe_td_serialized_size, qe_td_serialize, qe_td_deserialize,
+  qe_td_memory_usage
+};
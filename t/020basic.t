@@ -0,0 +1,127 @@
+use strict;
+use warnings;
+use Test::More;
+use Math::QuantileEstimate;
+
+my $n = 100000;
+my @vals = map { ($_ * 7919) % $n + 1 } 0 .. $n-1; # permutation of 1..$n
+
+for my $args ([epsilon => 0.01, n => $n], [epsilon => 0.01], [epsilon => 0.01, engine => 'kll'],
+              [epsilon => 0.01, engine => 'tdigest']) {
+  my $qe = Math::QuantileEstimate->new(@$args);
+  isa_ok($qe, 'Math::QuantileEstimate');
+
+  $qe->add(@vals[0 .. $n/2-1]);
+  is($qe->count, $n/2, "count after add");
+  $qe->add_packed(pack('d*', @vals[$n/2 .. $n-1]));
+  is($qe->count, $n, "count after add_packed");
+
+  is($qe->quantile(0), 1, "quantile(0) is the minimum");
+  is($qe->quantile(1), $n, "quantile(1) is the maximum");
+  my @qs = map $_/10, 0..10;
+  my @res = $qe->quantiles(@qs);
+  is(scalar(@res), scalar(@qs), "quantiles returns one value per quantile");
+  for my $i (0..$#qs) {
+    ok(abs($res[$i] - $qs[$i]*$n) <= 0.02*$n, "quantile $qs[$i] is close")
+      or diag("got $res[$i]");
+    is($res[$i], $qe->quantile($qs[$i]), "quantiles agrees with quantile for $qs[$i]");
+  }
+
+  ok(abs($qe->rank($n/4) - $n/4) <= 0.01*$n, "rank is close");
+  my @cdf = $qe->cdf($n/4, $n/2);
+  ok(abs($cdf[0] - 0.25) <= 0.01 && abs($cdf[1] - 0.5) <= 0.01, "cdf is close");
+
+  # More data after querying
+  $qe->add(($n+1) x $n);
+  is($qe->quantile(0.9), $n+1, "updates after a query are seen by the next query");
+}
+
+for my $args ([epsilon => 0.01, n => $n], [epsilon => 0.01], [epsilon => 0.01, engine => 'kll'],
+              [epsilon => 0.01, engine => 'tdigest']) {
+  my @parts = map Math::QuantileEstimate->new(@$args), 1..3;
+  $parts[$_ % 3]->add($vals[$_]) for 0..$n-1;
+  my $qe = shift @parts;
+  $qe->merge($_) for @parts;
+  is($qe->count, $n, "count after merge");
+  # unbounded GK streams don't merge level by level, see merge
+  my %args = @$args;
+  if (!$args{n} && !$args{engine}) {
+    ok($qe->error_bound >= 0.01 && $qe->error_bound <= 0.02, "error bound after merge");
+  }
+  else {
+    is($qe->error_bound, 0.01, "error bound after merge");
+  }
+  ok(abs($qe->quantile(0.5) - $n/2) <= 0.02*$n, "median after merge is close");
+  is($parts[0]->count, int($n/3), "merged stream is left alone");
+  ok(!eval { $qe->merge($qe); 1 }, "merging into itself croaks");
+}
+
+{
+  my @parts = map Math::QuantileEstimate->new(epsilon => 0.01), 1..10;
+  $parts[$_ % 10]->add($vals[$_]) for 0..$n-1;
+  my $qe = shift @parts;
+  $qe->merge_many(\@parts, 3);
+  is($qe->count, $n, "count after merge_many");
+  ok(abs($qe->quantile(0.5) - $n/2) <= 0.02*$n, "median after merge_many is close");
+  ok(!eval { $qe->merge_many([1]); 1 }, "merge_many with a non-object croaks");
+  ok(!eval { $qe->merge_many([$parts[0], $parts[1], $parts[0]]); 1 },
+     "merge_many with an estimator twice croaks");
+}
+
+{
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $other = Math::QuantileEstimate->new(epsilon => 0.05);
+  $other->add(1..10);
+  $qe->merge($other);
+  is($qe->error_bound, 0.05, "error bound is the larger one after merge");
+}
+
+{
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $ref = Math::QuantileEstimate->new(epsilon => 0.01);
+  $qe->start_background;
+  $_->add(@vals) for $qe, $ref;
+  is_deeply([$qe->quantiles(0.1, 0.5, 0.9)], [$ref->quantiles(0.1, 0.5, 0.9)],
+            "same results with background compaction");
+}
+
+{
+  my $gk = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $kll = Math::QuantileEstimate->new(epsilon => 0.01, engine => 'kll');
+  is($gk->engine, 'gk', "gk is the default engine");
+  is($kll->engine, 'kll', "engine");
+  $_->add(@vals) for $gk, $kll;
+  ok($kll->memory_usage < $gk->memory_usage, "kll takes less memory than gk")
+    or diag($kll->memory_usage . " vs. " . $gk->memory_usage);
+  ok(!eval { $gk->merge($kll); 1 }, "merging estimators of different engines croaks");
+  ok(!eval { $kll->start_background; 1 }, "start_background croaks for kll");
+  ok(!eval { Math::QuantileEstimate->new(epsilon => 0.01, engine => 'foo'); 1 },
+     "unknown engines croak");
+}
+
+{
+  my $td = Math::QuantileEstimate->new(epsilon => 0.01, engine => 'tdigest');
+  is($td->engine, 'tdigest', "engine");
+  $td->add(@vals);
+  for my $q (0.999, 0.9999) {
+    ok(abs($td->quantile($q) - $q*$n) <= 0.01 * (1-$q)*$n + 1, "tdigest resolves the $q quantile")
+      or diag("got " . $td->quantile($q));
+  }
+}
+
+{
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $q = $qe->quantile(0.5);
+  ok($q != $q, "quantile without data is NaN");
+}
+
+ok(!eval { Math::QuantileEstimate->new(); 1 }, "epsilon is required");
+ok(!eval { Math::QuantileEstimate->new(epsilon => 0.01, n => 10); 1 }, "too small n croaks");
+ok(!eval { Math::QuantileEstimate->new(epsilon => 0.01, foo => 1); 1 }, "unknown arguments croak");
+ok(!eval { Math::QuantileEstimate->new(epsilon => 0.01)->add_packed("abc"); 1 },
+   "add_packed with a partial double croaks");
+
+like(Math::QuantileEstimate->cpu_variant, qr/^(?:avx512|avx2|sse2|generic)\z/,
+     "cpu_variant names a known variant");
+
+done_testing();
@@ -0,0 +1,47 @@
+use strict;
+use warnings;
+use Test::More;
+use Math::QuantileEstimate;
+
+my $n = 10000;
+my @vals = map { ($_ * 7919) % $n + 1 } 0 .. $n-1; # permutation of 1..$n
+
+my $ref = Math::QuantileEstimate->new(epsilon => 0.01);
+$ref->add(@vals);
+my @qs = map $_/20, 0..20;
+my @expect = $ref->quantiles(@qs);
+
+{
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $packed = pack('d*', @vals);
+  $qe->add_packed(\$packed);
+  is_deeply([$qe->quantiles(@qs)], \@expect, "add_packed with a reference");
+}
+
+{
+  # A buffer that doesn't start at a multiple of 8 bytes
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  my $packed = "xyz" . pack('d*', @vals);
+  $qe->add_packed(substr($packed, 3));
+  is_deeply([$qe->quantiles(@qs)], \@expect, "add_packed with an unaligned buffer");
+}
+
+{
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  $qe->add_packed_float(pack('f*', @vals));
+  is($qe->count, $n, "count after add_packed_float");
+  is_deeply([$qe->quantiles(@qs)], \@expect, "add_packed_float");
+  ok(!eval { $qe->add_packed_float("abcdef"); 1 },
+     "add_packed_float with a partial float croaks");
+}
+
+SKIP: {
+  skip "PDL not installed", 2 if not eval { require PDL; 1 };
+  for my $type (qw(double float)) {
+    my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+    $qe->add_piddle(PDL->can($type)->(\@vals));
+    is_deeply([$qe->quantiles(@qs)], \@expect, "add_piddle with a $type piddle");
+  }
+}
+
+done_testing();
@@ -0,0 +1,52 @@
+use strict;
+use warnings;
+use Test::More;
+use Storable qw(freeze thaw dclone);
+use Math::QuantileEstimate;
+
+my $n = 50000;
+my @vals = map { ($_ * 7919) % $n + 1 } 0 .. $n-1; # permutation of 1..$n
+my @qs = map $_/20, 0..20;
+
+for my $args ([epsilon => 0.01, n => $n], [epsilon => 0.01], [epsilon => 0.01, engine => 'kll'],
+              [epsilon => 0.01, engine => 'tdigest']) {
+  my $qe = Math::QuantileEstimate->new(@$args);
+  $qe->add(@vals[0 .. $n/2]);
+
+  my $bytes = $qe->to_bytes;
+  my $copy = Math::QuantileEstimate->from_bytes($bytes);
+  isa_ok($copy, 'Math::QuantileEstimate');
+  is($copy->count, $qe->count, "count survives to_bytes/from_bytes");
+  is_deeply([$copy->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "quantiles survive to_bytes/from_bytes");
+
+  my $thawed = thaw(freeze({qe => $qe}))->{qe};
+  isa_ok($thawed, 'Math::QuantileEstimate');
+  is_deeply([$thawed->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "quantiles survive Storable");
+  my $cloned = dclone($qe);
+  is_deeply([$cloned->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "quantiles survive dclone");
+
+  $_->add(@vals[$n/2+1 .. $n-1]) for $qe, $copy, $thawed;
+  is_deeply([$copy->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "copy takes more values");
+  is_deeply([$thawed->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "thawed copy takes more values");
+}
+
+ok(!eval { Math::QuantileEstimate->from_bytes("QEST garbage"); 1 },
+   "from_bytes croaks on garbage");
+
+SKIP: {
+  skip "Sereal not installed", 1
+    if not eval { require Sereal::Encoder; require Sereal::Decoder; 1 };
+  my $qe = Math::QuantileEstimate->new(epsilon => 0.01);
+  $qe->add(@vals);
+  my $enc = Sereal::Encoder->new({freeze_callbacks => 1});
+  my $copy = Sereal::Decoder->new->decode($enc->encode($qe));
+  is_deeply([$copy->quantiles(@qs)], [$qe->quantiles(@qs)],
+            "quantiles survive Sereal");
+}
+
+done_testing();
@@ -0,0 +1,9 @@
+use strict;
+use warnings;
+BEGIN {
+  push @INC, 't/lib', 'lib';
+}
+use Math::QuantileEstimate::Test;
+
+run_ctest('105c_quantized')
+  or Test::More->import(skip_all => "C executable not found");
@@ -0,0 +1,10 @@
+use strict;
+use warnings;
+BEGIN {
+  push @INC, 't/lib', 'lib';
+}
+use Math::QuantileEstimate::Test;
+
+run_ctest('110c_wide_counts')
+  or Test::More->import(skip_all => "C executable not found");
+
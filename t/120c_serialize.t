@@ -0,0 +1,10 @@
+use strict;
+use warnings;
+BEGIN {
+  push @INC, 't/lib', 'lib';
+}
+use Math::QuantileEstimate::Test;
+
+run_ctest('120c_serialize')
+  or Test::More->import(skip_all => "C executable not found");
+